@@ -0,0 +1,435 @@
+#include "AsyncIO.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <deque>
+#include <thread>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+using namespace std;
+
+AsyncIO::Backend AsyncIO::defaultBackend = AsyncIO::URING;
+
+#ifdef HAVE_IO_URING
+
+// the rings shared with the kernel. there is no liburing, so they are
+// mapped and driven by hand
+struct AsyncIO::Ring {
+  int fd;
+
+  // the submission queue: we write entries at the tail, the kernel
+  // consumes them at the head
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned* sqMask;
+  unsigned* sqArray;
+  struct io_uring_sqe* sqes;
+  unsigned  unsubmitted;  // # of entries queued but not taken by the kernel
+
+  // the completion queue: the kernel writes at the tail, we read at the head
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned* cqMask;
+  struct io_uring_cqe* cqes;
+
+  void*  sqRing;
+  size_t sqRingSize;
+  void*  cqRing;
+  size_t cqRingSize;
+  size_t sqesSize;
+
+  Ring() : fd(-1), sqes((struct io_uring_sqe*) MAP_FAILED), sqRing(MAP_FAILED), cqRing(MAP_FAILED) {}
+  ~Ring();
+
+  // set up a ring of at least entries entries. false if the kernel
+  // refuses
+  bool setup(int entries);
+
+  // call io_uring_enter(), retrying when interrupted
+  int enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+};
+
+bool AsyncIO::Ring::setup(int entries)
+{
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  if ((fd = (int) syscall(__NR_io_uring_setup, entries, &p)) < 0) return false;
+
+  sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  // newer kernels map both rings with one mmap()
+  bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single) {
+    if (cqRingSize > sqRingSize) sqRingSize = cqRingSize;
+    cqRingSize = sqRingSize;
+  }
+
+  sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, IORING_OFF_SQ_RING);
+  if (sqRing == MAP_FAILED) return false;
+  if (single) {
+    cqRing = sqRing;
+  } else {
+    cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, IORING_OFF_CQ_RING);
+    if (cqRing == MAP_FAILED) return false;
+  }
+  sqes = (struct io_uring_sqe*) mmap(NULL, sqesSize, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) return false;
+
+  char* sq = (char*) sqRing;
+  sqHead = (unsigned*) (sq + p.sq_off.head);
+  sqTail = (unsigned*) (sq + p.sq_off.tail);
+  sqMask = (unsigned*) (sq + p.sq_off.ring_mask);
+  sqArray = (unsigned*) (sq + p.sq_off.array);
+  unsubmitted = 0;
+
+  char* cq = (char*) cqRing;
+  cqHead = (unsigned*) (cq + p.cq_off.head);
+  cqTail = (unsigned*) (cq + p.cq_off.tail);
+  cqMask = (unsigned*) (cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+  return true;
+}
+
+AsyncIO::Ring::~Ring()
+{
+  if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+  if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+  if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+  if (fd >= 0) ::close(fd);
+}
+
+int AsyncIO::Ring::enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+  int ret;
+
+  do {
+    ret = (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+
+  return ret < 0 ? -errno : ret;
+}
+
+#else
+
+// io_uring is not available at compile time. every instance uses threads
+struct AsyncIO::Ring {
+  bool setup(int) { return false; }
+};
+
+#endif
+
+/**
+ * the threads of the THREADS backend, shared by all instances. a request
+ * is done with one blocking preadv() or pwritev() and handed back to the
+ * instance that submitted it.
+ */
+class IOThreads {
+ public:
+  static IOThreads& get()
+  {
+    // never destroyed, so the threads can outlive static destructors
+    static IOThreads* threads = new IOThreads(AsyncIO::IO_THREADS);
+    return *threads;
+  }
+
+  void post(AsyncIO* owner, AsyncIO::Request* req)
+  {
+    {
+      lock_guard<mutex> lock(queueMutex);
+      queue.push_back(make_pair(owner, req));
+    }
+    queueCond.notify_one();
+  }
+
+ private:
+  mutex queueMutex;
+  condition_variable queueCond;
+  deque<pair<AsyncIO*, AsyncIO::Request*> > queue;
+
+  IOThreads(int n)
+  {
+    for (int i = 0; i < n; i++) thread(&IOThreads::work, this).detach();
+  }
+
+  void work()
+  {
+    for (;;) {
+      pair<AsyncIO*, AsyncIO::Request*> item;
+      {
+        unique_lock<mutex> lock(queueMutex);
+        while (queue.empty()) queueCond.wait(lock);
+        item = queue.front();
+        queue.pop_front();
+      }
+
+      AsyncIO::Request* req = item.second;
+      ssize_t n = req->write ? ::pwritev(req->fd, req->iov, req->iovcnt, req->offset)
+                             : ::preadv(req->fd, req->iov, req->iovcnt, req->offset);
+      req->result = n < 0 ? -errno : n;
+      item.first->finished(req);
+    }
+  }
+};
+
+AsyncIO::AsyncIO(int depth, Backend backend)
+{
+  this->depth = depth > 0 ? depth : 1;
+  this->backend = THREADS;
+  inFlight = 0;
+  ring = NULL;
+
+  if (backend == URING) {
+    ring = new Ring;
+    if (ring->setup(this->depth)) {
+      this->backend = URING;
+    } else {
+      delete ring;
+      ring = NULL;
+    }
+  }
+}
+
+AsyncIO::~AsyncIO()
+{
+  // the buffers of the requests in flight may be gone once we return, so
+  // the kernel or the threads must be done with them
+  drain();
+  delete ring;
+}
+
+AsyncIO& AsyncIO::forThread()
+{
+  static thread_local AsyncIO io(DEFAULT_DEPTH, defaultBackend);
+  return io;
+}
+
+void AsyncIO::setDefaultBackend(Backend backend)
+{
+  defaultBackend = backend;
+}
+
+void AsyncIO::finished(Request* req)
+{
+  // notify under the lock: once the owner sees the request, it may
+  // return and destroy the instance
+  lock_guard<mutex> lock(doneMutex);
+  completed.push_back(req);
+  doneCond.notify_one();
+}
+
+// true for the errors of io_uring_enter() that go away by trying again
+static bool transient(int err)
+{
+  return err == -EAGAIN || err == -EBUSY || err == -EINTR;
+}
+
+// the error code of a failed batch of requests
+static RC failure(AsyncIO::Request* const* reqs, int n)
+{
+  for (int i = 0; i < n; i++) {
+    if (reqs[i]->write) return RC_FILE_WRITE_FAILED;
+  }
+  return RC_FILE_READ_FAILED;
+}
+
+int AsyncIO::reap(int min)
+{
+  // never wait for more than the requests that can still complete
+  int pending = inFlight - (int) ready.size();
+  if (min > pending) min = pending;
+
+  if (backend == THREADS) {
+    unique_lock<mutex> lock(doneMutex);
+    while ((int) completed.size() < min) doneCond.wait(lock);
+    ready.insert(ready.end(), completed.begin(), completed.end());
+    completed.clear();
+    return 0;
+  }
+
+#ifdef HAVE_IO_URING
+  int reaped = 0;
+  for (;;) {
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+      struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+      Request* req = (Request*) (uintptr_t) cqe->user_data;
+      req->result = cqe->res;
+      ready.push_back(req);
+      reaped++;
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    if (reaped >= min) return 0;
+
+    // the queued requests go along, so we never wait for requests the
+    // kernel has not seen. a full completion queue (EBUSY) is emptied
+    // above before trying again
+    int ret = ring->enter(ring->unsubmitted, min - reaped, IORING_ENTER_GETEVENTS);
+    if (ret < 0) {
+      if (transient(ret)) continue;
+      return ret;
+    }
+    ring->unsubmitted -= ret;
+  }
+#else
+  return 0;
+#endif
+}
+
+void AsyncIO::cancelUnsubmitted(int err)
+{
+#ifdef HAVE_IO_URING
+  if (ring == NULL || ring->unsubmitted == 0) return;
+
+  // the kernel reads the submission queue only when we enter it, so the
+  // entries past the ones it took can be taken back
+  unsigned tail = *ring->sqTail;
+  for (unsigned i = 1; i <= ring->unsubmitted; i++) {
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqArray[(tail - i) & *ring->sqMask]];
+    ((Request*) (uintptr_t) sqe->user_data)->result = err;
+  }
+  __atomic_store_n(ring->sqTail, tail - ring->unsubmitted, __ATOMIC_RELEASE);
+  inFlight -= ring->unsubmitted;
+  ring->unsubmitted = 0;
+#endif
+}
+
+void AsyncIO::drain()
+{
+  while (inFlight > (int) ready.size()) {
+    int err = reap(inFlight - (int) ready.size());
+    if (err == 0) continue;
+
+    // the requests the kernel has not seen will not complete. if it
+    // cannot report the ones it has, it may still use their buffers
+    // after we return, so there is no safe way on
+#ifdef HAVE_IO_URING
+    if (ring != NULL && ring->unsubmitted > 0) {
+      cancelUnsubmitted(err);
+      continue;
+    }
+#endif
+    fprintf(stderr, "AsyncIO: cannot wait for requests in flight: %s\n", strerror(-err));
+    abort();
+  }
+}
+
+RC AsyncIO::submit(Request* const* reqs, int n)
+{
+  int err;
+
+  for (int i = 0; i < n; i++) {
+    // a full queue makes room by waiting for a request to complete
+    if (inFlight - (int) ready.size() >= depth) {
+      if ((err = reap(1)) < 0) {
+        // the requests of this batch not queued yet are not started
+        cancelUnsubmitted(err);
+        for (int j = i; j < n; j++) reqs[j]->result = -ECANCELED;
+        return failure(reqs, n);
+      }
+    }
+
+    Request* req = reqs[i];
+    inFlight++;
+    if (backend == THREADS) {
+      IOThreads::get().post(this, req);
+      continue;
+    }
+
+#ifdef HAVE_IO_URING
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = req->fd;
+    sqe->addr = (unsigned long long) (uintptr_t) req->iov;
+    sqe->len = req->iovcnt;
+    sqe->off = req->offset;
+    sqe->user_data = (unsigned long long) (uintptr_t) req;
+
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+#endif
+  }
+
+#ifdef HAVE_IO_URING
+  // hand the whole batch to the kernel with one system call
+  while (backend == URING && ring->unsubmitted > 0) {
+    int ret = ring->enter(ring->unsubmitted, 0, 0);
+    if (ret < 0) {
+      // the kernel is out of resources for now. wait for some requests
+      // to complete and try again. reap() submits the queue as well
+      if (transient(ret) && (ret = reap(1)) == 0) continue;
+      cancelUnsubmitted(ret);
+      return failure(reqs, n);
+    }
+    ring->unsubmitted -= ret;
+  }
+#endif
+
+  return 0;
+}
+
+int AsyncIO::complete(Request** reqs, int max, int min)
+{
+  if (min > max) min = max;
+  if ((int) ready.size() < min && reap(min - (int) ready.size()) < 0) return 0;
+
+  // a non-blocking look for requests that completed meanwhile
+  if (ready.empty() && inFlight > 0) reap(0);
+
+  int n = (int) ready.size() < max ? (int) ready.size() : max;
+  for (int i = 0; i < n; i++) reqs[i] = ready[i];
+  ready.erase(ready.begin(), ready.begin() + n);
+  inFlight -= n;
+  return n;
+}
+
+RC AsyncIO::run(Request* reqs, int n)
+{
+  RC rc = 0;
+  Request* batch[DEFAULT_DEPTH];
+
+  // submit() waits by itself once the queue is full
+  int i = 0;
+  while (i < n) {
+    int cnt = n - i < DEFAULT_DEPTH ? n - i : DEFAULT_DEPTH;
+    for (int j = 0; j < cnt; j++) batch[j] = &reqs[i + j];
+    i += cnt;
+    if ((rc = submit(batch, cnt)) < 0) break;
+  }
+  for (; i < n; i++) reqs[i].result = -ECANCELED;
+
+  // every request started is waited for, even after an error, since it
+  // uses the caller's buffers. they are all ours, so none is left for
+  // complete()
+  drain();
+  ready.clear();
+  inFlight = 0;
+
+  return rc;
+}
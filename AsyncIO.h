@@ -0,0 +1,143 @@
+#ifndef ASYNCIO_H
+#define ASYNCIO_H
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "Bruinbase.h"
+
+/**
+ * Asynchronous file I/O in batches. A caller submits many reads and
+ * writes at once and collects them as they complete, in any order, so
+ * dozens of requests are in flight instead of one blocking call at a
+ * time. There are two backends:
+ *   URING:   an io_uring of the kernel, set up through the raw system
+ *            calls. requests are vectored reads and writes.
+ *   THREADS: a pool of threads shared by all instances doing preadv()
+ *            and pwritev(), used when the kernel has no io_uring or
+ *            does not let us use it.
+ * An instance is not locked, so it is used by one thread at a time.
+ * forThread() gives every thread an instance of its own.
+ */
+class AsyncIO {
+ public:
+  enum Backend { URING, THREADS };
+
+  // the default # of requests in flight at once
+  static const int DEFAULT_DEPTH = 64;
+
+  // the # of threads of the THREADS backend
+  static const int IO_THREADS = 16;
+
+  // a read or a write of consecutive bytes of a file into or from
+  // a list of buffers
+  struct Request {
+    int    fd;        // the file
+    bool   write;     // true for a write, false for a read
+    off_t  offset;    // the offset of the first byte in the file
+    const struct iovec* iov;  // the buffers
+    int    iovcnt;    // # of buffers
+    ssize_t result;   // set on completion: # of bytes, or -errno
+  };
+
+  /**
+   * @param depth[IN] the maximum # of requests in flight
+   * @param backend[IN] the backend to use. URING falls back to THREADS
+   *                    if io_uring cannot be set up
+   */
+  AsyncIO(int depth = DEFAULT_DEPTH, Backend backend = URING);
+
+  /**
+   * the requests still in flight are waited for.
+   */
+  ~AsyncIO();
+
+  /**
+   * @return the instance of the calling thread, created on first use
+   *         with the default backend
+   */
+  static AsyncIO& forThread();
+
+  /**
+   * set the backend of the instances that forThread() creates from now
+   * on, such as THREADS to avoid io_uring.
+   * @param backend[IN] the backend
+   */
+  static void setDefaultBackend(Backend backend);
+
+  /**
+   * start a batch of requests. once depth requests are in flight, this
+   * waits for some of them to complete; they are returned by complete()
+   * later. the requests and their buffers must stay valid until then.
+   * on an error, the requests of the batch that were not started get
+   * their error in result and are not returned by complete().
+   * @param reqs[IN] the requests
+   * @param n[IN] # of requests
+   * @return error code. 0 if no error
+   */
+  RC submit(Request* const* reqs, int n);
+
+  /**
+   * collect completed requests.
+   * @param reqs[OUT] the completed requests
+   * @param max[IN] the maximum # of requests to return
+   * @param min[IN] # of requests to wait for, if that many are in flight
+   * @return # of requests returned
+   */
+  int complete(Request** reqs, int max, int min);
+
+  /**
+   * submit requests and wait for all of them. no other requests of this
+   * instance may be in flight. the requests started are waited for even
+   * if submitting the rest fails; those not started get -ECANCELED.
+   * @param reqs[IN] the requests
+   * @param n[IN] # of requests
+   * @return error code. 0 if no error. an error of a request is left in
+   *         its result
+   */
+  RC run(Request* reqs, int n);
+
+  Backend getBackend() const { return backend; }
+
+  // # of requests submitted and not yet returned by complete()
+  int getInFlight() const { return inFlight; }
+
+ private:
+  struct Ring;  // the io_uring. defined in AsyncIO.cc
+  friend class IOThreads;
+
+  Backend backend;
+  int     depth;
+  int     inFlight;
+  Ring*   ring;
+
+  std::vector<Request*> ready;  // completed, not returned by complete() yet
+
+  // the requests done by the I/O threads
+  std::mutex doneMutex;
+  std::condition_variable doneCond;
+  std::vector<Request*> completed;
+
+  // move the completed requests to ready, waiting for at least min.
+  // returns 0, or -errno if io_uring fails
+  int reap(int min);
+
+  // take back the requests queued but not yet seen by the kernel. their
+  // result is set to err
+  void cancelUnsubmitted(int err);
+
+  // wait until every request in flight is in ready
+  void drain();
+
+  // called by an I/O thread when a request is done
+  void finished(Request* req);
+
+  static Backend defaultBackend;
+
+  AsyncIO(const AsyncIO&);
+  AsyncIO& operator=(const AsyncIO&);
+};
+
+#endif // ASYNCIO_H
@@ -8,8 +8,10 @@
  */
 
 #include <iostream>
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <climits>
 #include "BTreeIndex.h"
 #include "BTreeNode.h"
 
@@ -19,30 +21,71 @@ using namespace std;
 
 const int RC_ADD_NEW_CHILD = 1;
 
+// Offset of the page size in the header page, after rootPid and treeHeight
+const int HEADER_PAGE_SIZE_OFFSET = sizeof(PageId) + sizeof(int);
+
+// Offset of the flags in the header page, after the page size
+const int HEADER_FLAGS_OFFSET = HEADER_PAGE_SIZE_OFFSET + sizeof(int);
+
+// Offset of the key statistics in the header page, after the flags
+const int HEADER_STATS_OFFSET = HEADER_FLAGS_OFFSET + sizeof(int);
+
+// The flag of an index whose non-leaf nodes are counted
+const int INDEX_COUNTED = 1;
+
+// The flag of an index whose header page holds the key statistics
+const int INDEX_HAS_STATS = 2;
+
+// Call the member template instantiated for the page size of the index
+#define DISPATCH_PAGE_SIZE(pageSize, func, args) \
+	switch (pageSize) { \
+	case 1024:  return func<1024> args; \
+	case 2048:  return func<2048> args; \
+	case 4096:  return func<4096> args; \
+	case 8192:  return func<8192> args; \
+	case 16384: return func<16384> args; \
+	default:    return RC_INVALID_PAGE_SIZE; \
+	}
+
 /*
  * BTreeIndex constructor
  */
 BTreeIndex::BTreeIndex() {
     rootPid = -1;
     treeHeight = 0;
+    writable = false;
+    counted = false;
+    hasStats = false;
     clearBuffer();
 }
 
 RC BTreeIndex::clearBuffer() {
-	memset(buffer, 0, PageFile::PAGE_SIZE);
+	memset(buffer, 0, PageFile::MAX_PAGE_SIZE);
 	return RC_SUCCESS;
 }
 
 void BTreeIndex::print() {
+	switch (pf.getPageSize()) {
+	case 1024:  printImpl<1024>(); break;
+	case 2048:  printImpl<2048>(); break;
+	case 4096:  printImpl<4096>(); break;
+	case 8192:  printImpl<8192>(); break;
+	case 16384: printImpl<16384>(); break;
+	}
+}
+
+template <int PageSize>
+void BTreeIndex::printImpl() {
 
 	// Print BTreeIndex information
+	cerr << "pageSize: " << PageSize << endl;
 	cerr << "endPid: " << pf.endPid() << endl;
 	cerr << "rootPid: " << rootPid << endl;
 	cerr << "treeHeight: " << treeHeight << endl;
 	cerr << endl;
 
 	// // Print root node information
-	BTNonLeafNode root(rootPid);
+	BTNonLeafNodeT<PageSize> root(rootPid);
 	root.read(rootPid, pf);
 	root.print();
 }
@@ -51,15 +94,24 @@ void BTreeIndex::print() {
  * Open the index file in read or write mode.
  * Under 'w' mode, the index file should be created if it does not exist.
  * @param indexname[IN] the name of the index file
- * @param mode[IN] 'r' for read, 'w' for write
+ * @param mode[IN] 'r' for read, 'w' for write, 'm' for read-only
+ *                 mmap, where nodes are read in place from the mapping
+ * @param pageSize[IN] the page size of a new index
+ * @param counted[IN] true if a new index keeps the entry counts of its subtrees
  * @return error code. 0 if no error
  */
-RC BTreeIndex::open(const string& indexname, char mode) {
+RC BTreeIndex::open(const string& indexname, char mode, int pageSize, bool counted) {
     
-    // Open the index file
+    // Open the index file. The header page is read with the default
+    // page size first, since it is at offset 0 with any page size
 	if (pf.open(indexname, mode))
 		return RC_PF_OPEN_ERROR;
 
+	// Remember whether we may write rootPid and treeHeight back on close
+	writable = (mode == 'w' || mode == 'W');
+	this->counted = counted;
+	hasStats = false;
+
 	// If endPid == 0, there are no disk pages currently stored,
 	// so just return, otherwise, check the disk page with pid = 0 for
 	// the rootPid and treeHeight
@@ -76,8 +128,33 @@ RC BTreeIndex::open(const string& indexname, char mode) {
 		PageId tempRootId;
 		int tempTreeHeight;
 
+		int storedPageSize;
+		int flags;
+
 		memcpy(&tempRootId, buffer, sizeof(PageId));
 		memcpy(&tempTreeHeight, buffer + sizeof(PageId), sizeof(int));
+		memcpy(&storedPageSize, buffer + HEADER_PAGE_SIZE_OFFSET, sizeof(int));
+		memcpy(&flags, buffer + HEADER_FLAGS_OFFSET, sizeof(int));
+
+		// An existing index keeps the layout it was written with
+		this->counted = (flags & INDEX_COUNTED) != 0;
+
+		// Indexes written before statistics were kept have none
+		if (flags & INDEX_HAS_STATS) {
+			memcpy(&stats, buffer + HEADER_STATS_OFFSET, sizeof(KeyStats));
+			hasStats = stats.buckets >= 0 && stats.buckets <= HISTOGRAM_BUCKETS;
+		}
+
+		// Older indexes did not store the page size, so they use the default
+		if (storedPageSize == 0)
+			storedPageSize = PageFile::PAGE_SIZE;
+
+		// Reopen the file with the page size it was written with
+		if (storedPageSize != pf.getPageSize()) {
+			pf.close();
+			if (pf.open(indexname, mode, storedPageSize))
+				return RC_PF_OPEN_ERROR;
+		}
 
 		// Store found values only if they are valid
 		// We know that tempRootId must be > 0 because we reserved pid = 0
@@ -86,6 +163,12 @@ RC BTreeIndex::open(const string& indexname, char mode) {
 			treeHeight = tempTreeHeight;
       //cerr << "treeHeight=" << treeHeight << endl;
 		}
+
+	// A new index uses the requested page size
+	} else if (pageSize != pf.getPageSize()) {
+		pf.close();
+		if (pf.open(indexname, mode, pageSize))
+			return RC_PF_OPEN_ERROR;
 	}
 
     return RC_SUCCESS;
@@ -100,13 +183,22 @@ RC BTreeIndex::close() {
   //cerr << "closing btreeindex.. "
   //     << "rootPid=" << rootPid
   //     << " treeHeight=" << treeHeight << endl;
-	// Store rootPid and treeHeight into buffer
+	// Store rootPid, treeHeight, the page size and the flags into buffer
+	int pageSize = pf.getPageSize();
+	int flags = (counted ? INDEX_COUNTED : 0) | (hasStats ? INDEX_HAS_STATS : 0);
+
 	memcpy(buffer, &rootPid, sizeof(PageId));
 	memcpy(buffer + sizeof(PageId), &treeHeight, sizeof(int));
-
-	// Write the buffer to pid = 0
-	if (pf.write(0, buffer))
+	memcpy(buffer + HEADER_PAGE_SIZE_OFFSET, &pageSize, sizeof(int));
+	memcpy(buffer + HEADER_FLAGS_OFFSET, &flags, sizeof(int));
+	if (hasStats)
+		memcpy(buffer + HEADER_STATS_OFFSET, &stats, sizeof(KeyStats));
+
+	// Write the buffer to pid = 0. A read-only index has nothing to persist
+	if (writable && pf.write(0, buffer)) {
+		pf.close();
 		return RC_PF_WRITE_ERROR;
+	}
 
 	// Close the page file
 	if (pf.close())
@@ -122,6 +214,11 @@ RC BTreeIndex::close() {
  * @return error code. 0 if no error
  */
 RC BTreeIndex::insert(int key, const RecordId& rid) {
+	DISPATCH_PAGE_SIZE(pf.getPageSize(), insertImpl, (key, rid))
+}
+
+template <int PageSize>
+RC BTreeIndex::insertImpl(int key, const RecordId& rid) {
 
 	// TODO: There are four different cases upon inserting:
 	// (COMPLETE) 1. New Root
@@ -134,7 +231,7 @@ RC BTreeIndex::insert(int key, const RecordId& rid) {
 
 		// Create a new leaf node
 		int nextPid = pf.endPid() == 0 ? 1 : pf.endPid();
-		BTLeafNode leafNode;
+		BTLeafNodeT<PageSize> leafNode;
 		leafNode.insert(key, rid);
 
 		// Create root node at next pid that is not pid = 0
@@ -161,11 +258,14 @@ RC BTreeIndex::insert(int key, const RecordId& rid) {
 
 	int newChildKey = -1;
 	PageId newChildPid = -1;
+	int entries, newChildEntries;
 
-	return insertRec(key, rid, 1, rootPid, newChildKey, newChildPid);
+	return insertRec<PageSize>(key, rid, 1, rootPid, newChildKey, newChildPid, entries, newChildEntries);
 }
 
-RC BTreeIndex::insertRec(int key, const RecordId& rid, int currTreeHeight, PageId currPid, int& newChildKey, PageId& newChildPid) {
+template <int PageSize>
+RC BTreeIndex::insertRec(int key, const RecordId& rid, int currTreeHeight, PageId currPid, int& newChildKey, PageId& newChildPid,
+                         int& entries, int& newChildEntries) {
 
 	int error;
 
@@ -173,19 +273,20 @@ RC BTreeIndex::insertRec(int key, const RecordId& rid, int currTreeHeight, PageI
 	if (currTreeHeight == treeHeight) {
 
 		// Read in leaf node
-		BTLeafNode leafNode;
+		BTLeafNodeT<PageSize> leafNode;
 		leafNode.read(currPid, pf);
 
 		// 2. No Overflow, parent node does not need to be split,
 		// so just return success
 		if (leafNode.insert(key, rid) == RC_SUCCESS) {
+			entries = leafNode.getKeyCount();
 			leafNode.write(currPid, pf);
 			return RC_SUCCESS;
 		}
 
 		// 3. Leaf Overflow
 		int newLeafNodePid = pf.endPid();
-		BTLeafNode newLeafNode;
+		BTLeafNodeT<PageSize> newLeafNode;
 		int newLeafNodeKey;
 
 		if (error = leafNode.insertAndSplit(key, rid, newLeafNode, newLeafNodeKey)) {
@@ -197,6 +298,9 @@ RC BTreeIndex::insertRec(int key, const RecordId& rid, int currTreeHeight, PageI
 		newLeafNode.setNextNodePtr(leafNode.getNextNodePtr());
 		leafNode.setNextNodePtr(newLeafNodePid);
 
+		entries = leafNode.getKeyCount();
+		newChildEntries = newLeafNode.getKeyCount();
+
 		// Write leafNode and newLeafNode out to disk
 		leafNode.write(currPid, pf);
 		newLeafNode.write(newLeafNodePid, pf);
@@ -212,9 +316,12 @@ RC BTreeIndex::insertRec(int key, const RecordId& rid, int currTreeHeight, PageI
 		else {
 			// Initialize a new root
 			int newRootPid = pf.endPid();
-			BTNonLeafNode newRoot;
+			BTNonLeafNodeT<PageSize> newRoot;
 
-			newRoot.initializeRoot(currPid, newLeafNodeKey, newLeafNodePid);
+			if (counted)
+				newRoot.initializeCountedRoot(currPid, entries, newLeafNodeKey, newLeafNodePid, newChildEntries);
+			else
+				newRoot.initializeRoot(currPid, newLeafNodeKey, newLeafNodePid);
 			newRoot.write(newRootPid, pf);
 
 			// Update BTreeIndex
@@ -230,13 +337,14 @@ RC BTreeIndex::insertRec(int key, const RecordId& rid, int currTreeHeight, PageI
 	} else {
 
 		// Read in current node
-		BTNonLeafNode currNode;
+		BTNonLeafNodeT<PageSize> currNode;
 		currNode.read(currPid, pf);
 
 		// Locate the child pointer
 		PageId childPid = -1;	
+		int childIdx;
 
-		if (currNode.locateChildPtr(key, childPid)) {
+		if (currNode.locateChildPtr(key, childPid, childIdx)) {
 			//cerr << "Could not locate childPid with key: " << key << endl;
 			return RC_INSERT_ERROR;
 		};
@@ -244,29 +352,47 @@ RC BTreeIndex::insertRec(int key, const RecordId& rid, int currTreeHeight, PageI
 		// Recursively traverse deeper into the tree.
 		// Keep note if the child split, and add the new pid to this node
 		RC addNewChild;
-		addNewChild = insertRec(key, rid, currTreeHeight + 1, childPid, newChildKey, newChildPid);
-
-		// Child did not split, so do not need to add a new child
-		if (!addNewChild)
+		int childEntries;
+		addNewChild = insertRec<PageSize>(key, rid, currTreeHeight + 1, childPid, newChildKey, newChildPid,
+		                                  childEntries, newChildEntries);
+		if (addNewChild < 0)
+			return addNewChild;
+
+		// The child holds one more entry, or fewer if it was split
+		currNode.setChildEntryCount(childIdx, childEntries);
+
+		// Child did not split, so do not need to add a new child.
+		// Only a counted node has changed
+		if (!addNewChild) {
+			if (counted) {
+				entries = currNode.getEntryCount();
+				return currNode.write(currPid, pf);
+			}
 			return RC_SUCCESS;
+		}
 		
-		// Child split, so we need to add a new child to this node
-		else if (currNode.insert(newChildKey, newChildPid) == RC_SUCCESS) {
+		// Child split, so we need to add the new child behind it
+		else if (currNode.insertChild(childIdx, newChildKey, newChildPid, newChildEntries) == RC_SUCCESS) {
+			entries = currNode.getEntryCount();
 			currNode.write(currPid, pf);
 			return RC_SUCCESS;
 		}
 
 		// Child split, but currNode is full, so split this node
 		else {
-			BTNonLeafNode newNode;
+			BTNonLeafNodeT<PageSize> newNode;
 			PageId newNodePid = pf.endPid();
 			int newNodeKey;
 
-			if (error = newNode.insertAndSplit(newChildKey, newChildPid, newNode, newNodeKey)) {
+			if (error = currNode.insertChildAndSplit(childIdx, newChildKey, newChildPid, newChildEntries,
+			                                         newNode, newNodeKey)) {
 				//cerr << "Could not insert and split non leaf node, error code: " << error << endl;
 				return error;
 			}
 
+			entries = currNode.getEntryCount();
+			newChildEntries = newNode.getEntryCount();
+
 			// Write currNode and newNode out to disk
 			currNode.write(currPid, pf);
 			newNode.write(newNodePid, pf);
@@ -282,11 +408,14 @@ RC BTreeIndex::insertRec(int key, const RecordId& rid, int currTreeHeight, PageI
 			else {
 				// Initialize a new root
 				int newRootPid = pf.endPid();
-				BTNonLeafNode newRoot;
+				BTNonLeafNodeT<PageSize> newRoot;
 
 				//cerr << "newRootPid: " << newRootPid << endl;
 
-				newRoot.initializeRoot(currPid, newNodeKey, newNodePid);
+				if (counted)
+					newRoot.initializeCountedRoot(currPid, entries, newNodeKey, newNodePid, newChildEntries);
+				else
+					newRoot.initializeRoot(currPid, newNodeKey, newNodePid);
 				newRoot.write(newRootPid, pf);
 
 				// Update BTreeIndex
@@ -324,16 +453,19 @@ RC BTreeIndex::insertRec(int key, const RecordId& rid, int currTreeHeight, PageI
  */
 RC BTreeIndex::locate(int searchKey, IndexCursor& cursor) {
 
-	// Tree is empty
+	// Tree is empty, so point the cursor at the end of the leaf chain
 	if (treeHeight <= 0) {
 		//cerr << "Tree is empty." << endl;
+		cursor.pid = 0;
+		cursor.eid = 0;
 		return RC_NO_SUCH_RECORD;
 	}
 
 	// Traverse down the tree
-    return locateRec(1, rootPid, searchKey, cursor);
+	DISPATCH_PAGE_SIZE(pf.getPageSize(), locateRec, (1, rootPid, searchKey, cursor))
 }
 
+template <int PageSize>
 RC BTreeIndex::locateRec(int currTreeHeight, PageId currPid, int searchKey, IndexCursor& cursor) {
 	
 	// We are at the leaf
@@ -341,7 +473,7 @@ RC BTreeIndex::locateRec(int currTreeHeight, PageId currPid, int searchKey, Inde
 		cursor.pid = currPid;
 
 		// Read in leaf
-		BTLeafNode leafNode;
+		BTLeafNodeT<PageSize> leafNode;
 		leafNode.read(currPid, pf);
 
 		// searchKey is not in leafNode
@@ -356,7 +488,7 @@ RC BTreeIndex::locateRec(int currTreeHeight, PageId currPid, int searchKey, Inde
 	}
 
 	// We are at a non leaf node
-	BTNonLeafNode currNode;
+	BTNonLeafNodeT<PageSize> currNode;
 	currNode.read(currPid, pf);
 
 	// Find child node to follow
@@ -364,7 +496,7 @@ RC BTreeIndex::locateRec(int currTreeHeight, PageId currPid, int searchKey, Inde
 	currNode.locateChildPtr(searchKey, childPid);
 
 	// Follow child node
-	return locateRec(currTreeHeight + 1, childPid, searchKey, cursor);
+	return locateRec<PageSize>(currTreeHeight + 1, childPid, searchKey, cursor);
 }
 
 /*
@@ -376,9 +508,18 @@ RC BTreeIndex::locateRec(int currTreeHeight, PageId currPid, int searchKey, Inde
  * @return error code. 0 if no error
  */
 RC BTreeIndex::readForward(IndexCursor& cursor, int& key, RecordId& rid) {
+	DISPATCH_PAGE_SIZE(pf.getPageSize(), readForwardImpl, (cursor, key, rid))
+}
+
+template <int PageSize>
+RC BTreeIndex::readForwardImpl(IndexCursor& cursor, int& key, RecordId& rid) {
     
     RC error;
-    BTLeafNode leafNode;
+    BTLeafNodeT<PageSize> leafNode;
+
+    // pid = 0 is the header page, so it marks the end of the leaf chain
+    if (cursor.pid <= 0)
+    	return RC_END_OF_TREE;
 
     // Read in the leaf node
     if (error = leafNode.read(cursor.pid, pf)) {
@@ -386,6 +527,19 @@ RC BTreeIndex::readForward(IndexCursor& cursor, int& key, RecordId& rid) {
     	return error;
     }
 
+    // locate() may leave the cursor just past the last entry of a leaf,
+    // so follow the leaf chain until we land on an actual entry
+    while (cursor.eid >= leafNode.getKeyCount()) {
+    	cursor.eid = 0;
+    	cursor.pid = leafNode.getNextNodePtr();
+
+    	if (cursor.pid <= 0)
+    		return RC_END_OF_TREE;
+
+    	if (error = leafNode.read(cursor.pid, pf))
+    		return error;
+    }
+
     // Get (key, rid) from eid
    	if (error = leafNode.readEntry(cursor.eid, key, rid)) {
    		//cerr << "Could not read entry cursor.eid: " << cursor.eid << endl;
@@ -407,3 +561,663 @@ RC BTreeIndex::readForward(IndexCursor& cursor, int& key, RecordId& rid) {
     return RC_SUCCESS;
 }
 
+/*
+ * Count the entries with lo <= key <= hi.
+ * @param lo[IN] the smallest key to count
+ * @param hi[IN] the largest key to count
+ * @param count[OUT] # of entries in the range
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::countRange(int lo, int hi, int& count) {
+
+	RC error;
+	int below, upTo;
+
+	count = 0;
+	if (lo > hi || treeHeight <= 0)
+		return RC_SUCCESS;
+
+	if (!counted)
+		return scanRange(lo, hi, count);
+
+	// # of entries <= hi minus # of entries < lo
+	if (error = countBefore(hi, true, upTo))
+		return error;
+	if (error = countBefore(lo, false, below))
+		return error;
+
+	count = upTo - below;
+	return RC_SUCCESS;
+}
+
+/*
+ * Count the entries with a key smaller than searchKey.
+ * @param searchKey[IN] the key to rank
+ * @param rank[OUT] # of entries with a smaller key
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::rank(int searchKey, int& rank) {
+
+	rank = 0;
+	if (treeHeight <= 0)
+		return RC_SUCCESS;
+
+	if (!counted)
+		return searchKey == INT_MIN ? RC_SUCCESS : scanRange(INT_MIN, searchKey - 1, rank);
+
+	return countBefore(searchKey, false, rank);
+}
+
+RC BTreeIndex::countBefore(int searchKey, bool inclusive, int& rank) {
+	DISPATCH_PAGE_SIZE(pf.getPageSize(), rankImpl, (searchKey, inclusive, rank))
+}
+
+template <int PageSize>
+RC BTreeIndex::rankImpl(int searchKey, bool inclusive, int& rank) {
+
+	RC error;
+	PageId pid = rootPid;
+	int before;
+
+	rank = 0;
+
+	// Add up the entries left of the path to the leaf holding the first
+	// entry ranked after searchKey
+	for (int height = 1; height < treeHeight; height++) {
+		BTNonLeafNodeT<PageSize> node;
+
+		if (error = node.read(pid, pf))
+			return error;
+		if (error = node.locateRank(searchKey, inclusive, pid, before))
+			return error;
+		rank += before;
+	}
+
+	BTLeafNodeT<PageSize> leaf;
+	int eid;
+
+	if (error = leaf.read(pid, pf))
+		return error;
+
+	// The entries of the leaf before the first key > searchKey
+	// (>= searchKey unless inclusive)
+	if (inclusive && searchKey == INT_MAX)
+		eid = leaf.getKeyCount();
+	else
+		leaf.locate(inclusive ? searchKey + 1 : searchKey, eid);
+
+	rank += eid;
+	return RC_SUCCESS;
+}
+
+RC BTreeIndex::readNth(int n, int& key, RecordId& rid) {
+
+	if (treeHeight <= 0 || n < 0)
+		return RC_END_OF_TREE;
+
+	if (counted)
+		DISPATCH_PAGE_SIZE(pf.getPageSize(), readNthImpl, (n, key, rid))
+
+	// Without counts, skip n entries of the leaf chain
+	Scanner scanner(*this);
+	const int* keys;
+	const RecordId* rids;
+	int count;
+	RC error;
+
+	if (error = scanner.open(INT_MIN))
+		return error;
+
+	while ((error = scanner.nextBatch(n + 1, keys, rids, count)) == RC_SUCCESS) {
+		if (n < count) {
+			key = keys[n];
+			rid = rids[n];
+			return RC_SUCCESS;
+		}
+		n -= count;
+	}
+
+	return error;
+}
+
+template <int PageSize>
+RC BTreeIndex::readNthImpl(int n, int& key, RecordId& rid) {
+
+	RC error;
+	PageId pid = rootPid;
+
+	// Follow the child holding the n'th entry, keeping n relative to it
+	for (int height = 1; height < treeHeight; height++) {
+		BTNonLeafNodeT<PageSize> node;
+
+		if (error = node.read(pid, pf))
+			return error;
+		if (error = node.locateByRank(n, pid))
+			return error == RC_INVALID_CURSOR ? RC_END_OF_TREE : error;
+	}
+
+	BTLeafNodeT<PageSize> leaf;
+
+	if (error = leaf.read(pid, pf))
+		return error;
+	if (leaf.readEntry(n, key, rid))
+		return RC_END_OF_TREE;
+
+	return RC_SUCCESS;
+}
+
+/*
+ * Count the entries in [lo, hi] by walking the leaves. A whole leaf is
+ * taken at a time, and the end of the range is found by binary search.
+ */
+RC BTreeIndex::scanRange(int lo, int hi, int& count) {
+
+	RC error;
+	Scanner scanner(*this);
+	const int* keys;
+	const RecordId* rids;
+	int n;
+
+	count = 0;
+	if (error = scanner.open(lo))
+		return error;
+
+	while ((error = scanner.nextBatch(INT_MAX, keys, rids, n)) == RC_SUCCESS) {
+		if (keys[n - 1] > hi) {
+			count += upper_bound(keys, keys + n, hi) - keys;
+			return RC_SUCCESS;
+		}
+		count += n;
+	}
+
+	return error == RC_END_OF_TREE ? RC_SUCCESS : error;
+}
+
+/*
+ * Compute the statistics again by walking the leaves.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::refreshStats() {
+
+	RC error;
+	Scanner scanner(*this);
+	const int* keys;
+	const RecordId* rids;
+	int n, total, seen = 0, next = 0;
+
+	// The bounds are picked by rank, so the entries are counted first.
+	// A counted index does so with two descents
+	if (error = countRange(INT_MIN, INT_MAX, total))
+		return error;
+
+	stats.entries = total;
+	stats.leaves = 0;
+	stats.buckets = total < HISTOGRAM_BUCKETS ? total : HISTOGRAM_BUCKETS;
+	hasStats = true;
+	if (total == 0)
+		return RC_SUCCESS;
+
+	// bounds[i] is the entry ranked i * (total - 1) / buckets
+	if (error = scanner.open(INT_MIN))
+		return error;
+
+	while ((error = scanner.nextBatch(INT_MAX, keys, rids, n)) == RC_SUCCESS) {
+		stats.leaves++;
+		while (next <= stats.buckets) {
+			int rank = (int) ((long long) next * (total - 1) / stats.buckets);
+			if (rank >= seen + n)
+				break;
+			stats.bounds[next++] = keys[rank - seen];
+		}
+		seen += n;
+	}
+	if (error != RC_END_OF_TREE) {
+		hasStats = false;
+		return error;
+	}
+
+	return RC_SUCCESS;
+}
+
+/*
+ * Estimate # of entries with lo <= key <= hi from the histogram.
+ * @param lo[IN] the smallest key to count
+ * @param hi[IN] the largest key to count
+ * @return the estimated # of entries
+ */
+double BTreeIndex::estimateRange(int lo, int hi) const {
+
+	double estimate = 0;
+
+	if (!hasStats || stats.buckets == 0 || lo > hi)
+		return 0;
+
+	// Take the part of every bucket its bounds share with [lo, hi]
+	double perBucket = (double) stats.entries / stats.buckets;
+	for (int i = 0; i < stats.buckets; i++) {
+		double first = max((double) lo, (double) stats.bounds[i]);
+		double last = min((double) hi, (double) stats.bounds[i + 1]);
+		if (first > last)
+			continue;
+		estimate += perBucket * (last - first + 1) /
+			((double) stats.bounds[i + 1] - stats.bounds[i] + 1);
+	}
+
+	return min(estimate, (double) stats.entries);
+}
+
+//////////////////////////////////////////////////////////////////////
+/////////// BTreeIndex::BulkLoader ///////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+// # of pairs read back from a spilled run at a time
+const int RUN_CHUNK_ENTRIES = 4096;
+
+BTreeIndex::BulkLoader::BulkLoader(BTreeIndex& index, float fillFactor, int memoryEntries)
+	: index(index) {
+
+	// Keep the fill factor in (0, 1]
+	if (fillFactor <= 0 || fillFactor > 1)
+		fillFactor = 1;
+
+	this->fillFactor = fillFactor;
+	this->memoryEntries = memoryEntries > 0 ? memoryEntries : DEFAULT_MEMORY_ENTRIES;
+	total = 0;
+	next = 0;
+}
+
+BTreeIndex::BulkLoader::~BulkLoader() {
+	for (unsigned i = 0; i < runs.size(); i++)
+		fclose(runs[i].fp);
+}
+
+bool BTreeIndex::BulkLoader::lessEntry(const Entry& a, const Entry& b) {
+	if (a.key != b.key)
+		return a.key < b.key;
+	return a.rid < b.rid;
+}
+
+/*
+ * Add a (key, RecordId) pair to the index being built.
+ * @param key[IN] the key of the pair
+ * @param rid[IN] the RecordId of the pair
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::BulkLoader::add(int key, const RecordId& rid) {
+
+	Entry e;
+	e.key = key;
+	e.rid = rid;
+	entries.push_back(e);
+	total++;
+
+	// Memory is full, so spill a sorted run
+	if ((int) entries.size() >= memoryEntries)
+		return spill();
+
+	return RC_SUCCESS;
+}
+
+RC BTreeIndex::BulkLoader::spill() {
+
+	Run run;
+
+	sort(entries.begin(), entries.end(), lessEntry);
+
+	if ((run.fp = tmpfile()) == NULL)
+		return RC_FILE_OPEN_FAILED;
+
+	if (fwrite(&entries[0], sizeof(Entry), entries.size(), run.fp) != entries.size()) {
+		fclose(run.fp);
+		return RC_FILE_WRITE_FAILED;
+	}
+
+	rewind(run.fp);
+	run.pos = 0;
+	runs.push_back(run);
+
+	entries.clear();
+	return RC_SUCCESS;
+}
+
+bool BTreeIndex::BulkLoader::fillRun(Run& run) {
+
+	run.buf.resize(RUN_CHUNK_ENTRIES);
+	size_t n = fread(&run.buf[0], sizeof(Entry), RUN_CHUNK_ENTRIES, run.fp);
+	run.buf.resize(n);
+	run.pos = 0;
+
+	return n > 0;
+}
+
+RC BTreeIndex::BulkLoader::startMerge() {
+
+	RC error;
+
+	// Everything fits in memory, so a plain sort is enough
+	if (runs.empty()) {
+		sort(entries.begin(), entries.end(), lessEntry);
+		next = 0;
+		return RC_SUCCESS;
+	}
+
+	// Otherwise spill the rest as well and merge all runs
+	if (!entries.empty() && (error = spill()))
+		return error;
+
+	heap.clear();
+	for (unsigned i = 0; i < runs.size(); i++) {
+		if (fillRun(runs[i]))
+			heap.push_back(i);
+	}
+
+	make_heap(heap.begin(), heap.end(), [this](int a, int b) {
+		return lessEntry(runs[b].buf[runs[b].pos], runs[a].buf[runs[a].pos]);
+	});
+
+	return RC_SUCCESS;
+}
+
+bool BTreeIndex::BulkLoader::nextEntry(Entry& e) {
+
+	// In-memory sort
+	if (runs.empty()) {
+		if (next >= entries.size())
+			return false;
+		e = entries[next++];
+		return true;
+	}
+
+	// k-way merge of the runs: the top of the heap has the smallest entry
+	if (heap.empty())
+		return false;
+
+	auto runAfter = [this](int a, int b) {
+		return lessEntry(runs[b].buf[runs[b].pos], runs[a].buf[runs[a].pos]);
+	};
+
+	pop_heap(heap.begin(), heap.end(), runAfter);
+	Run& run = runs[heap.back()];
+	e = run.buf[run.pos++];
+
+	if (run.pos < run.buf.size() || fillRun(run))
+		push_heap(heap.begin(), heap.end(), runAfter);
+	else
+		heap.pop_back();
+
+	return true;
+}
+
+/*
+ * Sort all pairs added so far and build the index from them.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::BulkLoader::finish() {
+
+	RC error;
+	Entry e;
+
+	if (error = startMerge())
+		return error;
+
+	// The tree already has entries, so we can't build it bottom-up.
+	// Inserting in key order still keeps the descents cache friendly
+	if (index.treeHeight > 0) {
+		while (nextEntry(e)) {
+			if (error = index.insert(e.key, e.rid))
+				return error;
+		}
+		return RC_SUCCESS;
+	}
+
+	if (total == 0)
+		return RC_SUCCESS;
+
+	DISPATCH_PAGE_SIZE(index.pf.getPageSize(), buildTree, ())
+}
+
+template <int PageSize>
+RC BTreeIndex::BulkLoader::buildTree() {
+
+	RC error;
+	Entry e;
+	PageFile& pf = index.pf;
+
+	// Nodes are written at consecutive pids after the header page
+	PageId nextPid = pf.endPid() == 0 ? 1 : pf.endPid();
+
+	//
+	// Leaf level: spread the entries evenly over the fewest leaves
+	// that are filled up to the fill factor
+	//
+	int perLeaf = (int) (BTLeafNodeT<PageSize>::getMaxKeyCount() * fillFactor);
+	if (perLeaf < 1)
+		perLeaf = 1;
+
+	int numLeaves = (total + perLeaf - 1) / perLeaf;
+
+	// (smallest key, pid) of every node on the level being built, and
+	// the # of entries under it
+	vector<pair<int, PageId> > level;
+	vector<int> levelEntries;
+	level.reserve(numLeaves);
+	levelEntries.reserve(numLeaves);
+
+	for (int i = 0; i < numLeaves; i++) {
+		int count = total / numLeaves + (i < total % numLeaves ? 1 : 0);
+		PageId pid = nextPid++;
+		BTLeafNodeT<PageSize> leaf;
+
+		for (int j = 0; j < count; j++) {
+			nextEntry(e);
+			if (j == 0)
+				level.push_back(make_pair(e.key, pid));
+			if (error = leaf.insert(e.key, e.rid))
+				return error;
+		}
+
+		levelEntries.push_back(count);
+
+		// The next leaf is written right after this one
+		if (i + 1 < numLeaves)
+			leaf.setNextNodePtr(pid + 1);
+
+		if (error = leaf.write(pid, pf))
+			return error;
+	}
+
+	int height = 1;
+
+	//
+	// Non-leaf levels: group the nodes of the level below under parents
+	// until a single root is left
+	//
+	int perNode = (int) ((BTNonLeafNodeT<PageSize>::getMaxKeyCount(index.counted) + 1) * fillFactor);
+	if (perNode < 3)
+		perNode = 3;
+
+	while (level.size() > 1) {
+		int size = (int) level.size();
+		int numNodes = (size + perNode - 1) / perNode;
+		vector<pair<int, PageId> > parents;
+		vector<int> parentEntries;
+		int c = 0;
+
+		for (int i = 0; i < numNodes; i++) {
+			int count = size / numNodes + (i < size % numNodes ? 1 : 0);
+			PageId pid = nextPid++;
+			BTNonLeafNodeT<PageSize> node;
+
+			// A parent has at least two children, see perNode above
+			if (index.counted)
+				error = node.initializeCountedRoot(level[c].second, levelEntries[c],
+				                                   level[c+1].first, level[c+1].second, levelEntries[c+1]);
+			else
+				error = node.initializeRoot(level[c].second, level[c+1].first, level[c+1].second);
+			if (error)
+				return error;
+
+			// The children are added in key order, so each goes last
+			for (int j = 2; j < count; j++) {
+				if (error = node.insertChild(j - 1, level[c+j].first, level[c+j].second, levelEntries[c+j]))
+					return error;
+			}
+
+			if (error = node.write(pid, pf))
+				return error;
+
+			parents.push_back(make_pair(level[c].first, pid));
+			parentEntries.push_back(node.getEntryCount());
+			c += count;
+		}
+
+		level.swap(parents);
+		levelEntries.swap(parentEntries);
+		height++;
+	}
+
+	index.rootPid = level[0].second;
+	index.treeHeight = height;
+
+	return RC_SUCCESS;
+}
+
+//////////////////////////////////////////////////////////////////////
+/////////// BTreeIndex::Scanner //////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+BTreeIndex::Scanner::Scanner(BTreeIndex& index) : index(index) {
+	pid = 0;
+	page = NULL;
+	eid = count = 0;
+	keys = NULL;
+	rids = NULL;
+	nextPid = 0;
+	hinted = 0;
+}
+
+BTreeIndex::Scanner::~Scanner() {
+	close();
+}
+
+/*
+ * Position the scanner at the first entry with a key >= searchKey.
+ * @param searchKey[IN] the smallest key to return
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::Scanner::open(int searchKey) {
+
+	RC error;
+	IndexCursor cursor;
+
+	close();
+
+	// Descend the tree once. The cursor may end up just past the last
+	// entry of a leaf, which skipEmpty() takes care of
+	error = index.locate(searchKey, cursor);
+	if (error != RC_SUCCESS && error != RC_NO_SUCH_RECORD)
+		return error;
+
+	if (error = fetch(cursor.pid))
+		return error;
+
+	eid = cursor.eid;
+	return RC_SUCCESS;
+}
+
+void BTreeIndex::Scanner::close() {
+	if (pid > 0)
+		index.pf.unpin(pid);
+
+	pid = 0;
+	page = NULL;
+	eid = count = 0;
+	nextPid = 0;
+}
+
+RC BTreeIndex::Scanner::fetch(PageId pid) {
+
+	RC error;
+
+	close();
+
+	// pid = 0 is the header page, so it marks the end of the leaf chain
+	if (pid <= 0)
+		return RC_SUCCESS;
+
+	if (error = index.pf.pin(pid, page))
+		return error;
+
+	this->pid = pid;
+	DISPATCH_PAGE_SIZE(index.pf.getPageSize(), viewLeaf, ())
+}
+
+template <int PageSize>
+RC BTreeIndex::Scanner::viewLeaf() {
+	count = BTLeafNodeT<PageSize>::viewPage(page, keys, rids, nextPid);
+	return RC_SUCCESS;
+}
+
+RC BTreeIndex::Scanner::skipEmpty() {
+
+	RC error;
+
+	// Follow the leaf chain until we land on an actual entry
+	while (pid > 0 && eid >= count) {
+		if (error = fetch(nextPid))
+			return error;
+		eid = 0;
+
+		// The scan goes on past its first leaf. The leaves of a bulk
+		// loaded index follow each other on disk, so the pages after
+		// the next leaf are likely the leaves after it
+		if (nextPid > 0)
+			hinted = index.pf.prefetchAhead(nextPid, index.pf.endPid(), hinted);
+	}
+
+	return pid > 0 ? RC_SUCCESS : RC_END_OF_TREE;
+}
+
+/*
+ * Read the entry at the scanner position and move to the next entry.
+ * @param key[OUT] the key of the entry
+ * @param rid[OUT] the RecordId of the entry
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::Scanner::next(int& key, RecordId& rid) {
+
+	RC error;
+
+	if (error = skipEmpty())
+		return error;
+
+	key = keys[eid];
+	rid = rids[eid];
+	eid++;
+
+	return RC_SUCCESS;
+}
+
+/*
+ * Return up to max entries at once, straight from the current leaf.
+ * @param max[IN] the maximum number of entries to return
+ * @param keys[OUT] the keys of the entries
+ * @param rids[OUT] the RecordIds of the entries
+ * @param n[OUT] the number of entries returned
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::Scanner::nextBatch(int max, const int*& keys, const RecordId*& rids, int& n) {
+
+	RC error;
+
+	n = 0;
+	if (error = skipEmpty())
+		return error;
+
+	n = count - eid < max ? count - eid : max;
+	keys = this->keys + eid;
+	rids = this->rids + eid;
+	eid += n;
+
+	return RC_SUCCESS;
+}
@@ -10,6 +10,8 @@
 #ifndef BTREEINDEX_H
 #define BTREEINDEX_H
 
+#include <cstdio>
+#include <vector>
 #include "Bruinbase.h"
 #include "PageFile.h"
 #include "RecordFile.h"
@@ -29,7 +31,11 @@ typedef struct {
 
 /**
  * Implements a B-Tree index for bruinbase.
- * 
+ * The non-leaf nodes of a counted index store the number of entries under
+ * every child, so the number of entries in a key range, the rank of a
+ * key and the n'th entry are found with root-to-leaf descents instead
+ * of leaf scans. Indexes are counted unless created otherwise; indexes
+ * written before counting existed are not.
  */
 class BTreeIndex {
  public:
@@ -44,11 +50,19 @@ class BTreeIndex {
   /**
    * Open the index file in read or write mode.
    * Under 'w' mode, the index file should be created if it does not exist.
+   * The page size of an existing index is read from its header page,
+   * so pageSize only matters when a new index is created.
    * @param indexname[IN] the name of the index file
-   * @param mode[IN] 'r' for read, 'w' for write
+   * @param mode[IN] 'r' for read, 'w' for write, 'm' for read-only
+   *                 mmap, where nodes are read in place from the mapping
+   * @param pageSize[IN] the page size of a new index: a power of two
+   *                     between PageFile::PAGE_SIZE and MAX_PAGE_SIZE
+   * @param counted[IN] true if a new index keeps the entry counts of
+   *                    the subtrees in its non-leaf nodes
    * @return error code. 0 if no error
    */
-  RC open(const std::string& indexname, char mode);
+  RC open(const std::string& indexname, char mode, int pageSize = PageFile::PAGE_SIZE,
+          bool counted = true);
 
   /**
    * Close the index file.
@@ -64,8 +78,12 @@ class BTreeIndex {
    */
   RC insert(int key, const RecordId& rid);
 
-  // Recursively insert into the BTree
-  RC insertRec(int key, const RecordId& rid, int currTreeHeight, PageId currPid, int& newChildKey, PageId& newChildPid);
+  // Recursively insert into the BTree. entries is set to the # of entries
+  // under currPid, and newChildEntries to the # under newChildPid if
+  // currPid was split
+  template <int PageSize>
+  RC insertRec(int key, const RecordId& rid, int currTreeHeight, PageId currPid, int& newChildKey, PageId& newChildPid,
+               int& entries, int& newChildEntries);
 
   /**
    * Run the standard B+Tree key search algorithm and identify the
@@ -86,33 +104,282 @@ class BTreeIndex {
    * @return 0 if searchKey is found. Othewise, an error code
    */
   RC locate(int searchKey, IndexCursor& cursor);
+  template <int PageSize>
   RC locateRec(int currTreeHeight, PageId currPid, int searchKey, IndexCursor& cursor);
 
   /**
    * Read the (key, rid) pair at the location specified by the index cursor,
    * and move foward the cursor to the next entry.
+   * If the cursor is past the last entry of its leaf, it follows the
+   * leaf chain, so a range scan only needs a single locate() call.
    * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
    * @param key[OUT] the key stored at the index cursor location
    * @param rid[OUT] the RecordId stored at the index cursor location
-   * @return error code. 0 if no error
+   * @return error code. 0 if no error. RC_END_OF_TREE past the last leaf
    */
   RC readForward(IndexCursor& cursor, int& key, RecordId& rid);
 
+  /**
+   * Count the entries with lo <= key <= hi. A counted index answers with
+   * two root-to-leaf descents, any other index by scanning the leaves.
+   * @param lo[IN] the smallest key to count
+   * @param hi[IN] the largest key to count
+   * @param count[OUT] # of entries in the range
+   * @return error code. 0 if no error
+   */
+  RC countRange(int lo, int hi, int& count);
+
+  /**
+   * Count the entries with a key smaller than searchKey, i.e., the rank
+   * of the first entry with searchKey.
+   * @param searchKey[IN] the key to rank
+   * @param rank[OUT] # of entries with a smaller key
+   * @return error code. 0 if no error
+   */
+  RC rank(int searchKey, int& rank);
+
+  /**
+   * Read the n'th entry (from 0) of the index in key order.
+   * @param n[IN] the rank of the entry to read
+   * @param key[OUT] the key of the entry
+   * @param rid[OUT] the RecordId of the entry
+   * @return error code. 0 if no error. RC_END_OF_TREE if there are not
+   *         more than n entries
+   */
+  RC readNth(int n, int& key, RecordId& rid);
+
+  /**
+   * @return true if the index keeps the entry counts of its subtrees
+   */
+  bool isCounted() const { return counted; }
+
+  // # of buckets of the key histogram
+  static const int HISTOGRAM_BUCKETS = 64;
+
+  /**
+   * Statistics of the keys, kept in the header page. The histogram is
+   * equi-depth: every bucket holds about entries/buckets entries, and
+   * the keys of bucket i are in [bounds[i], bounds[i + 1]], so bounds[0]
+   * is the smallest key and bounds[buckets] the largest.
+   */
+  struct KeyStats {
+    int entries;   // # of entries
+    int leaves;    // # of leaf nodes
+    int buckets;   // # of buckets of the histogram. 0 if there is no entry
+    int bounds[HISTOGRAM_BUCKETS + 1];
+  };
+
+  /**
+   * Compute the statistics again by walking the leaves. They are written
+   * to the header page when the index is closed. Called after a LOAD.
+   * @return error code. 0 if no error
+   */
+  RC refreshStats();
+
+  /**
+   * @return the statistics of the keys. NULL if the index was written
+   *         before statistics were kept
+   */
+  const KeyStats* getStats() const { return hasStats ? &stats : NULL; }
+
+  /**
+   * Estimate # of entries with lo <= key <= hi from the histogram,
+   * assuming the keys of a bucket are spread evenly over its bounds.
+   * @param lo[IN] the smallest key to count
+   * @param hi[IN] the largest key to count
+   * @return the estimated # of entries. 0 if there are no statistics
+   */
+  double estimateRange(int lo, int hi) const;
+
+  /**
+   * @return the height of the tree. 1 if the root is a leaf, 0 if empty
+   */
+  int getTreeHeight() const { return treeHeight; }
+
+  /**
+   * Builds an empty index bottom-up from a stream of (key, RecordId)
+   * pairs. The pairs are given to add() in any order and sorted, using
+   * an external merge sort when they do not fit in memory. finish()
+   * then packs the leaves to the fill factor and writes the non-leaf
+   * levels on top of them in one sequential pass.
+   * If the index is not empty, finish() inserts the pairs one by one.
+   */
+  class BulkLoader {
+   public:
+    /**
+     * @param index[IN] the index to build. it must be open in 'w' mode
+     * @param fillFactor[IN] the fraction of each node to fill (0, 1]
+     * @param memoryEntries[IN] # of pairs sorted in memory before a
+     *                          sorted run is spilled to a temporary file
+     */
+    BulkLoader(BTreeIndex& index, float fillFactor = 1.0,
+               int memoryEntries = DEFAULT_MEMORY_ENTRIES);
+    ~BulkLoader();
+
+    /**
+     * Add a (key, RecordId) pair to the index being built.
+     * @param key[IN] the key of the pair
+     * @param rid[IN] the RecordId of the pair
+     * @return error code. 0 if no error
+     */
+    RC add(int key, const RecordId& rid);
+
+    /**
+     * Sort all pairs added so far and build the index from them.
+     * @return error code. 0 if no error
+     */
+    RC finish();
+
+    static const int DEFAULT_MEMORY_ENTRIES = 1 << 20;
+
+   private:
+    struct Entry {
+      int      key;
+      RecordId rid;
+    };
+
+    // a sorted run spilled to a temporary file, read back in chunks
+    struct Run {
+      FILE* fp;
+      std::vector<Entry> buf;
+      unsigned pos;
+    };
+
+    BTreeIndex& index;
+    float fillFactor;
+    int   memoryEntries;
+    int   total;           // # of pairs added
+
+    std::vector<Entry> entries;   // pairs not spilled yet
+    std::vector<Run>   runs;      // spilled sorted runs
+    std::vector<int>   heap;      // runs ordered by their next entry
+    unsigned           next;      // next in-memory entry to merge
+
+    static bool lessEntry(const Entry& a, const Entry& b);
+
+    // sort the in-memory pairs and write them out as a run
+    RC spill();
+
+    // refill the read buffer of a run. returns false at its end
+    bool fillRun(Run& run);
+
+    // produce the pairs in sorted order, one by one
+    RC startMerge();
+    bool nextEntry(Entry& e);
+
+    // write the levels of the tree bottom-up
+    template <int PageSize>
+    RC buildTree();
+
+    BulkLoader(const BulkLoader&);
+    BulkLoader& operator=(const BulkLoader&);
+  };
+
+  /**
+   * Scans the leaf level of the index in key order. Unlike readForward(),
+   * the scanner keeps the current leaf pinned and reads the entries in
+   * place, so a range scan accesses every leaf page only once.
+   * The scanned index must not be modified while the scanner is open.
+   */
+  class Scanner {
+   public:
+    Scanner(BTreeIndex& index);
+    ~Scanner();
+
+    /**
+     * Position the scanner at the first entry with a key >= searchKey.
+     * @param searchKey[IN] the smallest key to return
+     * @return error code. 0 if no error, even if no such key exists
+     */
+    RC open(int searchKey);
+
+    /**
+     * Release the current leaf. Called by the destructor as well.
+     */
+    void close();
+
+    /**
+     * Read the entry at the scanner position and move to the next entry.
+     * @param key[OUT] the key of the entry
+     * @param rid[OUT] the RecordId of the entry
+     * @return error code. 0 if no error. RC_END_OF_TREE past the last leaf
+     */
+    RC next(int& key, RecordId& rid);
+
+    /**
+     * Return up to max entries at once, straight from the current leaf.
+     * The arrays point into the pinned leaf and stay valid until the
+     * next call to the scanner. A batch never crosses a leaf boundary,
+     * so fewer than max entries may be returned before the end.
+     * @param max[IN] the maximum number of entries to return
+     * @param keys[OUT] the keys of the entries
+     * @param rids[OUT] the RecordIds of the entries
+     * @param n[OUT] the number of entries returned
+     * @return error code. 0 if no error. RC_END_OF_TREE past the last leaf
+     */
+    RC nextBatch(int max, const int*& keys, const RecordId*& rids, int& n);
+
+   private:
+    BTreeIndex& index;
+    PageId      pid;      // the pinned leaf. 0 if none
+    char*       page;     // the content of the pinned leaf
+    int         eid;      // the next entry in the leaf
+    int         count;    // # of entries in the leaf
+    const int*      keys; // the keys of the leaf
+    const RecordId* rids; // the RecordIds of the leaf
+    PageId      nextPid;  // the leaf after this one
+    PageId      hinted;   // the page after the last prefetched page
+
+    // pin the leaf pid and look at it in place. pid 0 ends the scan
+    RC fetch(PageId pid);
+
+    // move to the next leaf while the current one is used up
+    RC skipEmpty();
+
+    template <int PageSize>
+    RC viewLeaf();
+
+    Scanner(const Scanner&);
+    Scanner& operator=(const Scanner&);
+  };
+
  private:
   // PageFile pf;         /// the PageFile used to store the actual b+tree in disk
 
   // NOTE: For the page with pid = 0, we will store rootPid
-  // at offset 0 and treeHeight at offset + sizeof(PageId).
+  // at offset 0, treeHeight at offset + sizeof(PageId) and the
+  // page size after them (0 in indexes written before it was stored),
+  // followed by the flags of the index (0 in older indexes) and the
+  // statistics of the keys if the flags say so.
   // Nodes start with pid = 1
 
   PageId   rootPid;    /// the PageId of the root node
   int      treeHeight; /// the height of the tree
+  bool     writable;   /// true if the index was opened in 'w' mode
+  bool     counted;    /// true if the non-leaf nodes are counted
+  bool     hasStats;   /// true if stats holds the statistics of the keys
+  KeyStats stats;      /// the statistics of the keys
   /// Note that the content of the above two variables will be gone when
   /// this class is destructed. Make sure to store the values of the two 
   /// variables in disk, so that they can be reconstructed when the index
   /// is opened again later.
 
-  char buffer[PageFile::PAGE_SIZE];
+  char buffer[PageFile::MAX_PAGE_SIZE];
+
+  // The nodes are compiled for every page size, so the public functions
+  // call these with the page size of the index file
+  template <int PageSize> RC insertImpl(int key, const RecordId& rid);
+  template <int PageSize> RC readForwardImpl(IndexCursor& cursor, int& key, RecordId& rid);
+  template <int PageSize> RC rankImpl(int searchKey, bool inclusive, int& rank);
+  template <int PageSize> RC readNthImpl(int n, int& key, RecordId& rid);
+
+  // count the entries with a key < searchKey (<= if inclusive) of a
+  // counted index
+  RC countBefore(int searchKey, bool inclusive, int& rank);
+
+  // count the entries in [lo, hi] by walking the leaves
+  RC scanRange(int lo, int hi, int& count);
+  template <int PageSize> void printImpl();
 };
 
 #endif /* BTREEINDEX_H */
@@ -1,59 +1,143 @@
 #include "BTreeNode.h"
+#include "KeyCompare.h"
 #include <algorithm>
 #include <iostream>
 #include <cstdlib>
 #include <cstring>
+#include <climits>
 
 using namespace std;
 
-// Size of (key, id) pairs
-const int RECORD_PAIR_SIZE = sizeof(int) + sizeof(RecordId);
-const int PAGE_PAIR_SIZE = sizeof(int) + sizeof(PageId);
+// Node layout. Every node starts with the header holding the key count,
+// followed by all keys in one sorted array and then all ids:
+//
+// leaf:     | count | next pid | keys[MAX_KEYS] | rids[MAX_KEYS]     |
+// non-leaf: | count | flags    | keys[MAX_KEYS] | pids[MAX_KEYS + 1] |
+// counted:  | count | flags    | keys[MAX_COUNTED_KEYS] | pids[MAX_COUNTED_KEYS + 1] |
+//                                                       | entries[MAX_COUNTED_KEYS + 1] |
+//
+// pids[i] of a non-leaf node points to the keys <= keys[i], and to the
+// keys >= keys[i - 1]. entries[i] of a counted node is the number of
+// leaf entries under pids[i]. nodes written before the flags existed
+// have 0 there and are not counted
+
+// the flag of a counted non-leaf node
+const int NODE_COUNTED = 1;
+
+static inline int& keyCount(char* node) { return *(int*) node; }
+static inline PageId& nextPtr(char* node) { return *(PageId*) (node + sizeof(int)); }
+static inline int& nodeFlags(char* node) { return *(int*) (node + sizeof(int)); }
+static inline int* nodeKeys(char* node) { return (int*) (node + BTREE_NODE_HEADER_SIZE); }
+
+template <int MaxKeys>
+static inline RecordId* leafRids(char* node)
+	{ return (RecordId*) (node + BTREE_NODE_HEADER_SIZE + MaxKeys * sizeof(int)); }
+
+static inline PageId* nonLeafPids(char* node, int maxKeys)
+	{ return (PageId*) (node + BTREE_NODE_HEADER_SIZE + maxKeys * sizeof(int)); }
+
+static inline int* childEntries(char* node, int maxKeys)
+	{ return (int*) (nonLeafPids(node, maxKeys) + maxKeys + 1); }
 
-// Max number of keys
-const int MAX_NUM_RECORD_KEYS = 85;
-const int MAX_NUM_PAGE_KEYS = 40;
-// const int MAX_NUM_PAGE_KEYS = (PageFile::PAGE_SIZE - sizeof(PageId)) / PAGE_PAIR_SIZE;
-// const int MAX_NUM_RECORD_KEYS = (PageFile::PAGE_SIZE - sizeof(PageId)) / RECORD_PAIR_SIZE;
+//////////////////////////////////////////////////////////////////////
+/////////// Key search ///////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+// Binary search stops once this many keys are left and the rest
+// is counted with a vectorized compare (see KeyCompare)
+const int SEARCH_WINDOW = 32;
+
+// Index of the first key >= key in the sorted array
+static int lowerBound(const int* keys, int n, int key) {
+	int lo = 0, hi = n;
+
+	while (hi - lo > SEARCH_WINDOW) {
+		int mid = lo + (hi - lo) / 2;
+		if (keys[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo + KeyCompare::countLess(keys + lo, hi - lo, key);
+}
+
+// Index of the first key > key in the sorted array
+static int upperBound(const int* keys, int n, int key) {
+	return key == INT_MAX ? n : lowerBound(keys, n, key + 1);
+}
 
 //////////////////////////////////////////////////////////////////////
 /////////// BTLeafNode ///////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////
 
-BTLeafNode::BTLeafNode() {
+template <int PageSize>
+BTLeafNodeT<PageSize>::BTLeafNodeT() {
+	data = buffer;
+	pinnedFile = NULL;
 	clearBuffer();
-	numKeys = 0;
 	pid_ = -1;
 }
 
-BTLeafNode::BTLeafNode(PageId pid) {
+template <int PageSize>
+BTLeafNodeT<PageSize>::BTLeafNodeT(PageId pid) {
+	data = buffer;
+	pinnedFile = NULL;
 	clearBuffer();
-	numKeys = 0;
 	pid_ = pid;
 }
 
-RC BTLeafNode::clearBuffer() {
-	//memset(buffer, 0, PageFile::PAGE_SIZE);
-  fill (buffer, buffer + PageFile::PAGE_SIZE, 0);
+template <int PageSize>
+BTLeafNodeT<PageSize>::~BTLeafNodeT() {
+	release();
+}
+
+template <int PageSize>
+RC BTLeafNodeT<PageSize>::clearBuffer() {
+	release();
+	//memset(buffer, 0, PageSize);
+  fill (buffer, buffer + PageSize, 0);
 	return RC_SUCCESS;
 }
 
+template <int PageSize>
+void BTLeafNodeT<PageSize>::release() {
+	if (pinnedFile) {
+		pinnedFile->unpin(pinnedPid);
+		pinnedFile = NULL;
+	}
+	data = buffer;
+}
+
+template <int PageSize>
+void BTLeafNodeT<PageSize>::makeWritable() {
+	if (pinnedFile) {
+		memcpy(buffer, data, PageSize);
+		release();
+	}
+}
+
 /*
  * Read the content of the node from the page pid in the PageFile pf.
  * @param pid[IN] the PageId to read
  * @param pf[IN] PageFile to read from
  * @return 0 if successful. Return an error code if there is an error.
  */
-RC BTLeafNode::read(PageId pid, const PageFile& pf){
+template <int PageSize>
+RC BTLeafNodeT<PageSize>::read(PageId pid, const PageFile& pf){
 	
 	int rc;
+	char* page;
 
-	// Read in page into memory buffer
-	if (rc = pf.read(pid, buffer)) {
+	// Pin the page and read the node directly from the frame
+	if (rc = pf.pin(pid, page)) {
 		return rc;
 	}
 
-	numKeys = getKeyCount();
+	release();
+	data = page;
+	pinnedFile = &pf;
+	pinnedPid = pid;
 
 	return RC_SUCCESS;
 }
@@ -64,11 +148,12 @@ RC BTLeafNode::read(PageId pid, const PageFile& pf){
  * @param pf[IN] PageFile to write to
  * @return 0 if successful. Return an error code if there is an error.
  */
-RC BTLeafNode::write(PageId pid, PageFile& pf){
+template <int PageSize>
+RC BTLeafNodeT<PageSize>::write(PageId pid, PageFile& pf){
 	
 	int rc;
 
-	if (rc = pf.write(pid, buffer)) {
+	if (rc = pf.write(pid, data)) {
 		return rc;
 	}
 
@@ -79,16 +164,36 @@ RC BTLeafNode::write(PageId pid, PageFile& pf){
  * Return the number of keys stored in the node.
  * @return the number of keys in the node
  */
-int BTLeafNode::getKeyCount(){
-	int count = 0;
-	char* traverse = buffer;
+template <int PageSize>
+int BTLeafNodeT<PageSize>::getKeyCount(){
+	return keyCount(data);
+}
 
-	while (count < MAX_NUM_RECORD_KEYS && *traverse) {
-		count++;
-		traverse += RECORD_PAIR_SIZE;
-	}
+/*
+ * Return the maximum number of keys a leaf node can hold.
+ * @return the capacity of a leaf node
+ */
+template <int PageSize>
+int BTLeafNodeT<PageSize>::getMaxKeyCount(){
+	return MAX_KEYS;
+}
 
-	return count;
+/*
+ * Interpret a leaf page in place without reading it into a node.
+ * @param page[IN] the content of a leaf page
+ * @param keys[OUT] the sorted keys of the leaf
+ * @param rids[OUT] the RecordIds of the keys
+ * @param next[OUT] the PageId of the next leaf
+ * @return the number of keys in the leaf
+ */
+template <int PageSize>
+int BTLeafNodeT<PageSize>::viewPage(const char* page, const int*& keys, const RecordId*& rids, PageId& next){
+	char* node = const_cast<char*>(page);
+
+	keys = nodeKeys(node);
+	rids = leafRids<MAX_KEYS>(node);
+	next = nextPtr(node);
+	return keyCount(node);
 }
 
 /*
@@ -97,45 +202,30 @@ int BTLeafNode::getKeyCount(){
  * @param rid[IN] the RecordId to insert
  * @return 0 if successful. Return an error code if the node is full.
  */
-RC BTLeafNode::insert(int key, const RecordId& rid){
+template <int PageSize>
+RC BTLeafNodeT<PageSize>::insert(int key, const RecordId& rid){
+	makeWritable();
 
-	int offset = 0;
-	char* traverse = buffer;
+	int count = keyCount(data);
+	int* keys = nodeKeys(data);
+	RecordId* rids = leafRids<MAX_KEYS>(data);
 
-	// numKeys is already at the maximum number of keys
-	if (numKeys == MAX_NUM_RECORD_KEYS)
+	// count is already at the maximum number of keys
+	if (count == MAX_KEYS)
 		return RC_NODE_FULL;
 
-	// Traverse buffer and find the correct spot to put pair in
-	// The correct spot will either be an empty spot (null)
-	// OR when the key is less than the key at traverse
-	while (*traverse) {
-		int traverseKey;
-		memcpy(&traverseKey, traverse, sizeof(int));
-
-		if (key < traverseKey)
-			break;
-
-		offset += RECORD_PAIR_SIZE;
-		traverse += RECORD_PAIR_SIZE;
-	}
-
-	// Create a new buffer with
-	// buffer[0] to buffer[offset], (key, rid), buffer[offset] to buffer[PageFile::PAGE_SIZE]
-	char newBuffer[PageFile::PAGE_SIZE] = {0};
-	memcpy(newBuffer, buffer, offset); // buffer[0] to buffer[offset]
-	memcpy(newBuffer + offset, &key, sizeof(int)); // key
-	memcpy(newBuffer + offset + sizeof(int), &rid, sizeof(RecordId)); // rid
+	// The new pair goes behind all keys that are <= key
+	int pos = upperBound(keys, count, key);
 
-	// buffer[offset] to buffer[PageFile::PAGE_SIZE]
-	memcpy(newBuffer + offset + RECORD_PAIR_SIZE, buffer + offset, numKeys * RECORD_PAIR_SIZE - offset);
-	memcpy(newBuffer + PageFile::PAGE_SIZE - sizeof(PageId), buffer + PageFile::PAGE_SIZE - sizeof(PageId), sizeof(PageId));
+	// Shift the larger entries to make room
+	memmove(keys + pos + 1, keys + pos, (count - pos) * sizeof(int));
+	memmove(rids + pos + 1, rids + pos, (count - pos) * sizeof(RecordId));
 
-	// Reassign newBuffer to buffer and free memory
-	memcpy(buffer, newBuffer, PageFile::PAGE_SIZE);
+	keys[pos] = key;
+	rids[pos] = rid;
 
 	// Success
-	numKeys++;
+	keyCount(data) = count + 1;
 	return RC_SUCCESS;
 }
 
@@ -149,51 +239,49 @@ RC BTLeafNode::insert(int key, const RecordId& rid){
  * @param siblingKey[OUT] the first key in the sibling node after split.
  * @return 0 if successful. Return an error code if there is an error.
  */
-RC BTLeafNode::insertAndSplit(int key, const RecordId& rid, 
-                              BTLeafNode& sibling, int& siblingKey) {
+template <int PageSize>
+RC BTLeafNodeT<PageSize>::insertAndSplit(int key, const RecordId& rid, 
+                              BTLeafNodeT& sibling, int& siblingKey) {
+	makeWritable();
+	sibling.makeWritable();
 
 	// Validate parameters
 	if (sibling.getKeyCount())
 		return RC_SIBLING_NOT_EMPTY;
-	else if (key < 0)
-		return RC_INVALID_KEY;
 	else if (rid.pid < 0 || rid.sid < 0)
 		return RC_INVALID_RECORD;
 
 	// Parameters are valid
 
-	// Get number of half keys
-	// And calculate the offset of the midway point
-	int numHalfKeys = (getKeyCount() + 1) / 2;
-
-	// Get number of keys in each
-	sibling.numKeys = getKeyCount() - numHalfKeys;
-	numKeys = getKeyCount() - sibling.numKeys;
+	int count = keyCount(data);
+	int* keys = nodeKeys(data);
+	RecordId* rids = leafRids<MAX_KEYS>(data);
 
-	int midOffset = numHalfKeys * RECORD_PAIR_SIZE;
+	// This node keeps the first half of the count + 1 entries
+	int numHalfKeys = (count + 2) / 2;
+	int pos = upperBound(keys, count, key);
 
-	// Copy second half of node into sibling
-	memcpy(sibling.buffer, buffer + midOffset, PageFile::PAGE_SIZE - midOffset);
+	// Lay out all entries including the new one, then cut them in two
+	int allKeys[MAX_KEYS + 1];
+	RecordId allRids[MAX_KEYS + 1];
 
-	// Erase second half of the node
-	// Will set key of this later, because it could be the newly inserted key
-	//memset(buffer + midOffset, 0, midOffset);
-	fill(buffer + midOffset, buffer + PageFile::PAGE_SIZE, 0);
+	memcpy(allKeys, keys, pos * sizeof(int));
+	memcpy(allRids, rids, pos * sizeof(RecordId));
+	allKeys[pos] = key;
+	allRids[pos] = rid;
+	memcpy(allKeys + pos + 1, keys + pos, (count - pos) * sizeof(int));
+	memcpy(allRids + pos + 1, rids + pos, (count - pos) * sizeof(RecordId));
 
-	// Choose which buffer to insert new key into
-	int siblingFirstKey;
-	int thisNodeFirstKey;
+	memcpy(keys, allKeys, numHalfKeys * sizeof(int));
+	memcpy(rids, allRids, numHalfKeys * sizeof(RecordId));
+	keyCount(data) = numHalfKeys;
 
-	memcpy(&siblingFirstKey, sibling.buffer, sizeof(int));
-	memcpy(&thisNodeFirstKey, buffer, sizeof(int));
-
-	if (key < siblingFirstKey) // Belongs in lower half
-		insert(key, rid);
-	else // Belongs in upper half
-		sibling.insert(key, rid);
+	memcpy(nodeKeys(sibling.data), allKeys + numHalfKeys, (count + 1 - numHalfKeys) * sizeof(int));
+	memcpy(leafRids<MAX_KEYS>(sibling.data), allRids + numHalfKeys, (count + 1 - numHalfKeys) * sizeof(RecordId));
+	keyCount(sibling.data) = count + 1 - numHalfKeys;
 
 	// Store first sibling key in siblingKey
-	memcpy(&siblingKey, sibling.buffer, sizeof(int));
+	siblingKey = allKeys[numHalfKeys];
 
 	// Success
 	return RC_SUCCESS;
@@ -210,33 +298,20 @@ RC BTLeafNode::insertAndSplit(int key, const RecordId& rid,
                    behind the largest key smaller than searchKey.
  * @return 0 if searchKey is found. Otherwise return an error code.
  */
-RC BTLeafNode::locate(int searchKey, int& eid){
-
-	int offset = 0;
-	char* traverse = buffer;
+template <int PageSize>
+RC BTLeafNodeT<PageSize>::locate(int searchKey, int& eid){
 
-	// Traverse buffer and find searchKey
-	// Stop when searchKey is found OR searchKey > 
-	while (*traverse) {
-		int traverseKey;
-		memcpy(&traverseKey, traverse, sizeof(int));
+	int count = keyCount(data);
+	int* keys = nodeKeys(data);
 
-		// Set eid to current index
-		eid = offset / RECORD_PAIR_SIZE;
+	// First entry with a key >= searchKey. If searchKey is greater
+	// than all keys, eid points just past the last entry
+	eid = lowerBound(keys, count, searchKey);
 
-		// Found, return Success
-		if (searchKey == traverseKey)
-			return RC_SUCCESS;
-
-		// traverseKey is greater than searchKey, thus there is no record
-		if (searchKey < traverseKey)
-			return RC_NO_SUCH_RECORD;
-
-		offset += RECORD_PAIR_SIZE;
-		traverse += RECORD_PAIR_SIZE;
-	}
+	// Found, return Success
+	if (eid < count && keys[eid] == searchKey)
+		return RC_SUCCESS;
 
-	// Reached end, searchKey is greater than all keys
 	return RC_NO_SUCH_RECORD;
 }
 
@@ -247,20 +322,16 @@ RC BTLeafNode::locate(int searchKey, int& eid){
  * @param rid[OUT] the RecordId from the entry
  * @return 0 if successful. Return an error code if there is an error.
  */
-RC BTLeafNode::readEntry(int eid, int& key, RecordId& rid){
+template <int PageSize>
+RC BTLeafNodeT<PageSize>::readEntry(int eid, int& key, RecordId& rid){
 
-	int offset = eid * RECORD_PAIR_SIZE;
-	int traverseKey;
+	// Validate eid
+	if (eid < 0 || eid >= keyCount(data))
+		return RC_INVALID_CURSOR;
 
-	// Validate key
-	memcpy(&traverseKey, buffer + offset, sizeof(int));
-
-	if (!traverseKey)
-		return RC_INVALID_KEY;
-
-	// key is valid
-	memcpy(&key, buffer + offset, sizeof(int));
-	memcpy(&rid, buffer + offset + sizeof(int), sizeof(RecordId));
+	// eid is valid
+	key = nodeKeys(data)[eid];
+	rid = leafRids<MAX_KEYS>(data)[eid];
 
 	return RC_SUCCESS;
 }
@@ -269,12 +340,9 @@ RC BTLeafNode::readEntry(int eid, int& key, RecordId& rid){
  * Return the pid of the next slibling node.
  * @return the PageId of the next sibling node 
  */
-PageId BTLeafNode::getNextNodePtr(){
-
-	PageId pid;
-	memcpy(&pid, buffer + PageFile::PAGE_SIZE - sizeof(PageId), sizeof(PageId));
-
-	return pid;
+template <int PageSize>
+PageId BTLeafNodeT<PageSize>::getNextNodePtr(){
+	return nextPtr(data);
 }
 
 /*
@@ -282,36 +350,33 @@ PageId BTLeafNode::getNextNodePtr(){
  * @param pid[IN] the PageId of the next sibling node 
  * @return 0 if successful. Return an error code if there is an error.
  */
-RC BTLeafNode::setNextNodePtr(PageId pid){
+template <int PageSize>
+RC BTLeafNodeT<PageSize>::setNextNodePtr(PageId pid){
+	makeWritable();
 
 	// Invalid pid
 	if (pid < 0)
 		return RC_INVALID_PID;
 
 	// pid is valid
-	memcpy(buffer + PageFile::PAGE_SIZE - sizeof(PageId), &pid, sizeof(PageId));
+	nextPtr(data) = pid;
 	return RC_SUCCESS;
 }
 
-void BTLeafNode::print() {
+template <int PageSize>
+void BTLeafNodeT<PageSize>::print() {
 	
-	char* traverse = buffer;
+	int count = keyCount(data);
 
-	cerr << "numKeys: " << numKeys << endl;
+	cerr << "numKeys: " << count << endl;
 
-	while (*traverse) {
-		int key;
-		RecordId recordId;
-		
-		memcpy(&key, traverse, sizeof(int));
-		memcpy(&recordId, traverse + sizeof(int), sizeof(RecordId));
+	for (int i = 0; i < count; i++) {
+		RecordId recordId = leafRids<MAX_KEYS>(data)[i];
 
-		cerr << "Key: " << key;
+		cerr << "Key: " << nodeKeys(data)[i];
 		cerr << " RecordId.pid: " << recordId.pid;
 		cerr << " RecordId.sid: " << recordId.sid;
 		cerr << endl;
-
-		traverse += RECORD_PAIR_SIZE;
 	}
 
 	cerr << "Next Node Ptr: " << getNextNodePtr() << endl;
@@ -322,40 +387,73 @@ void BTLeafNode::print() {
 /////////// BTNonLeafNode ////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////
 
-BTNonLeafNode::BTNonLeafNode() {
+template <int PageSize>
+BTNonLeafNodeT<PageSize>::BTNonLeafNodeT() {
+	data = buffer;
+	pinnedFile = NULL;
 	clearBuffer();
-	numKeys = 0;
 	pid_ = -1;
 }
 
-BTNonLeafNode::BTNonLeafNode(PageId pid) {
+template <int PageSize>
+BTNonLeafNodeT<PageSize>::BTNonLeafNodeT(PageId pid) {
+	data = buffer;
+	pinnedFile = NULL;
 	clearBuffer();
-	numKeys = 0;
 	pid_ = pid;
 }
 
-RC BTNonLeafNode::clearBuffer() {
-	//memset(buffer, 0, PageFile::PAGE_SIZE);
-  fill (buffer, buffer + PageFile::PAGE_SIZE, 0);
+template <int PageSize>
+BTNonLeafNodeT<PageSize>::~BTNonLeafNodeT() {
+	release();
+}
+
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::clearBuffer() {
+	release();
+	//memset(buffer, 0, PageSize);
+  fill (buffer, buffer + PageSize, 0);
 	return RC_SUCCESS;
 }
 
+template <int PageSize>
+void BTNonLeafNodeT<PageSize>::release() {
+	if (pinnedFile) {
+		pinnedFile->unpin(pinnedPid);
+		pinnedFile = NULL;
+	}
+	data = buffer;
+}
+
+template <int PageSize>
+void BTNonLeafNodeT<PageSize>::makeWritable() {
+	if (pinnedFile) {
+		memcpy(buffer, data, PageSize);
+		release();
+	}
+}
+
 /*
  * Read the content of the node from the page pid in the PageFile pf.
  * @param pid[IN] the PageId to read
  * @param pf[IN] PageFile to read from
  * @return 0 if successful. Return an error code if there is an error.
  */
-RC BTNonLeafNode::read(PageId pid, const PageFile& pf){
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::read(PageId pid, const PageFile& pf){
 	
 	int rc;
+	char* page;
 
-	// Read in page into memory buffer
-	if (rc = pf.read(pid, buffer)) {
+	// Pin the page and read the node directly from the frame
+	if (rc = pf.pin(pid, page)) {
 		return rc;
 	}
 
-	numKeys = getKeyCount();
+	release();
+	data = page;
+	pinnedFile = &pf;
+	pinnedPid = pid;
 
 	return RC_SUCCESS;
 }
@@ -366,11 +464,12 @@ RC BTNonLeafNode::read(PageId pid, const PageFile& pf){
  * @param pf[IN] PageFile to write to
  * @return 0 if successful. Return an error code if there is an error.
  */
-RC BTNonLeafNode::write(PageId pid, PageFile& pf) {
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::write(PageId pid, PageFile& pf) {
 	
 	int rc;
 
-	if (rc = pf.write(pid, buffer)) {
+	if (rc = pf.write(pid, data)) {
 		return rc;
 	}
 
@@ -381,18 +480,30 @@ RC BTNonLeafNode::write(PageId pid, PageFile& pf) {
  * Return the number of keys stored in the node.
  * @return the number of keys in the node
  */
-int BTNonLeafNode::getKeyCount(){
-	int count = 0;
-	char* traverse = buffer + sizeof(PageId);
+template <int PageSize>
+int BTNonLeafNodeT<PageSize>::getKeyCount(){
+	return keyCount(data);
+}
 
-	while (count < MAX_NUM_PAGE_KEYS && *traverse) {
-		count++;
-		traverse += PAGE_PAIR_SIZE;
-	}
+/*
+ * Return the maximum number of keys a non-leaf node can hold.
+ * @param counted[IN] true for the capacity of a counted node
+ * @return the capacity of a non-leaf node
+ */
+template <int PageSize>
+int BTNonLeafNodeT<PageSize>::getMaxKeyCount(bool counted){
+	return counted ? MAX_COUNTED_KEYS : MAX_KEYS;
+}
 
-	return count;
+template <int PageSize>
+int BTNonLeafNodeT<PageSize>::maxKeys(){
+	return isCounted() ? MAX_COUNTED_KEYS : MAX_KEYS;
 }
 
+template <int PageSize>
+bool BTNonLeafNodeT<PageSize>::isCounted(){
+	return (nodeFlags(data) & NODE_COUNTED) != 0;
+}
 
 /*
  * Insert a (key, pid) pair to the node.
@@ -400,48 +511,52 @@ int BTNonLeafNode::getKeyCount(){
  * @param pid[IN] the PageId to insert
  * @return 0 if successful. Return an error code if the node is full.
  */
-RC BTNonLeafNode::insert(int key, PageId pid){
-
-	// Non leaf nodes have a lone pid at the beginning
-	// i.e. pid, key, pid
-	int offset = sizeof(PageId);
-	char* traverse = buffer + offset;
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::insert(int key, PageId pid){
 
-	// numKeys is already at the maximum number of keys
-	if (numKeys == MAX_NUM_PAGE_KEYS) {
-		return RC_NODE_FULL;
-	}
+	// The new key goes behind all keys that are <= key,
+	// and pid becomes the pointer to its right
+	return insertChild(upperBound(nodeKeys(data), keyCount(data), key), key, pid, 0);
+}
 
-	// Traverse buffer and find the correct spot to put pair in
-	// The correct spot will either be an empty spot (null)
-	// OR when the key is less than the key at traverse
-	while (*traverse) {
-		int traverseKey;
-		memcpy(&traverseKey, traverse, sizeof(int));
+/*
+ * Insert the (key, pid) pair right behind the idx'th child.
+ * @param idx[IN] the child to insert behind
+ * @param key[IN] the key to insert
+ * @param pid[IN] the PageId to insert
+ * @param entries[IN] # of leaf entries under pid
+ * @return 0 if successful. Return an error code if the node is full.
+ */
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::insertChild(int idx, int key, PageId pid, int entries){
+	makeWritable();
 
-		if (key < traverseKey)
-			break;
+	int count = keyCount(data);
+	int max = maxKeys();
+	int* keys = nodeKeys(data);
+	PageId* pids = nonLeafPids(data, max);
 
-		offset += PAGE_PAIR_SIZE;
-		traverse += PAGE_PAIR_SIZE;
+	// count is already at the maximum number of keys
+	if (count == max) {
+		return RC_NODE_FULL;
 	}
+	if (idx < 0 || idx > count)
+		return RC_INVALID_CURSOR;
 
-	// Create a new buffer with
-	// buffer[0] to buffer[offset], (key, rid), buffer[offset] to buffer[PageFile::PAGE_SIZE]
-	char newBuffer[PageFile::PAGE_SIZE] = {0};
-	memcpy(newBuffer, buffer, offset); // buffer[0] to buffer[offset]
-	memcpy(newBuffer + offset, &key, sizeof(int)); // key
-	memcpy(newBuffer + offset + sizeof(int), &pid, sizeof(PageId)); // pid
+	memmove(keys + idx + 1, keys + idx, (count - idx) * sizeof(int));
+	memmove(pids + idx + 2, pids + idx + 1, (count - idx) * sizeof(PageId));
 
-	// buffer[offset] to buffer[PageFile::PAGE_SIZE]
-	memcpy(newBuffer + offset + PAGE_PAIR_SIZE, buffer + offset, numKeys * PAGE_PAIR_SIZE);
-	memcpy(newBuffer + PageFile::PAGE_SIZE - sizeof(PageId), buffer + PageFile::PAGE_SIZE - sizeof(PageId), sizeof(PageId));
+	keys[idx] = key;
+	pids[idx + 1] = pid;
 
-	// Reassign newBuffer to buffer and free memory
-	memcpy(buffer, newBuffer, PageFile::PAGE_SIZE);
+	if (isCounted()) {
+		int* counts = childEntries(data, max);
+		memmove(counts + idx + 2, counts + idx + 1, (count - idx) * sizeof(int));
+		counts[idx + 1] = entries;
+	}
 
 	// Success
-	numKeys++;
+	keyCount(data) = count + 1;
 	return RC_SUCCESS;
 }
 
@@ -455,104 +570,194 @@ RC BTNonLeafNode::insert(int key, PageId pid){
  * @param midKey[OUT] the key in the middle after the split. This key should be inserted to the parent node.
  * @return 0 if successful. Return an error code if there is an error.
  */
-RC BTNonLeafNode::insertAndSplit(int key, PageId pid, BTNonLeafNode& sibling, int& midKey)
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::insertAndSplit(int key, PageId pid, BTNonLeafNodeT& sibling, int& midKey)
+{
+	int idx = upperBound(nodeKeys(data), keyCount(data), key);
+	return insertChildAndSplit(idx, key, pid, 0, sibling, midKey);
+}
+
+/*
+ * Insert the (key, pid) pair right behind the idx'th child and split
+ * the node half and half with sibling.
+ * @param idx[IN] the child to insert behind
+ * @param key[IN] the key to insert
+ * @param pid[IN] the PageId to insert
+ * @param entries[IN] # of leaf entries under pid
+ * @param sibling[IN] the sibling node to split with. This node MUST be empty when this function is called.
+ * @param midKey[OUT] the key in the middle after the split. This key should be inserted to the parent node.
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::insertChildAndSplit(int idx, int key, PageId pid, int entries,
+                                                 BTNonLeafNodeT& sibling, int& midKey)
 {
-  // impl notes: -sean
-  // 
-  // I went with calculating left-cut (lc) and right-cut (rc) as below:
-  //     lc = sizeof(p) + (nkeys/2 * RECORD_PAIR_SIZE)
-  //     rc = lc + sizeof(k);
-  // Where p is PageId and k is key
-  // This results in cuts as shown below:
-  // 
-  // case 1: k-odd, p-even
+	makeWritable();
+	sibling.makeWritable();
+
+  // With the new pair there are count + 1 keys and count + 2 pids:
+  //
   // +-------------------------------------------+
   // | p | k | p | k | p | k | p | k | p | k | p |
   // +-------------------------------------------+
-  //                     |   |
-  //                    lc   rc
-  //  <----left node---->     <----right node--->
-  // 
-  // case 2: k-even, p-odd
-  // +---------------------------------------------------+
-  // | p | k | p | k | p | k | p | k | p | k | p | k | p |
-  // +---------------------------------------------------+
-  //                             |   |
-  //                            lc   rc
-  //  <--------left node-------->     <----right node--->
-  // 
+  //  <----left node---->  mid  <--right node--->
+  //
+  // The middle key moves up to the parent and is in neither node.
 
 	// Validate parameters
 	if (sibling.getKeyCount())
 		return RC_SIBLING_NOT_EMPTY;
-	else if (key < 0)
-		return RC_INVALID_KEY;
 	else if (pid < 0)
 		return RC_INVALID_PID;
 
 	// Parameters are valid
 
+	int count = keyCount(data);
+	int max = maxKeys();
+	bool counted = isCounted();
+	int* keys = nodeKeys(data);
+	PageId* pids = nonLeafPids(data, max);
+	int* counts = childEntries(data, max);
+
+	if (idx < 0 || idx > count)
+		return RC_INVALID_CURSOR;
+
+	// Lay out all keys, pids and counts including the new pair
+	int allKeys[MAX_KEYS + 1];
+	PageId allPids[MAX_KEYS + 2];
+	int allCounts[MAX_KEYS + 2];
+
+	memcpy(allKeys, keys, idx * sizeof(int));
+	allKeys[idx] = key;
+	memcpy(allKeys + idx + 1, keys + idx, (count - idx) * sizeof(int));
+
+	memcpy(allPids, pids, (idx + 1) * sizeof(PageId));
+	allPids[idx + 1] = pid;
+	memcpy(allPids + idx + 2, pids + idx + 1, (count - idx) * sizeof(PageId));
+
+	if (counted) {
+		memcpy(allCounts, counts, (idx + 1) * sizeof(int));
+		allCounts[idx + 1] = entries;
+		memcpy(allCounts + idx + 2, counts + idx + 1, (count - idx) * sizeof(int));
+	}
+
 	// Get number of keys to store in original
-	int numHalfKeys = (getKeyCount() + 1) / 2;
+	int numHalfKeys = (count + 1) / 2;
+	int numSiblingKeys = count - numHalfKeys;
+
+	memcpy(keys, allKeys, numHalfKeys * sizeof(int));
+	memcpy(pids, allPids, (numHalfKeys + 1) * sizeof(PageId));
+	if (counted)
+		memcpy(counts, allCounts, (numHalfKeys + 1) * sizeof(int));
+	keyCount(data) = numHalfKeys;
+
+	// The key between the halves moves up to the parent
+	midKey = allKeys[numHalfKeys];
+
+	// The sibling has the layout of this node
+	nodeFlags(sibling.data) = nodeFlags(data);
+	memcpy(nodeKeys(sibling.data), allKeys + numHalfKeys + 1, numSiblingKeys * sizeof(int));
+	memcpy(nonLeafPids(sibling.data, max), allPids + numHalfKeys + 1, (numSiblingKeys + 1) * sizeof(PageId));
+	if (counted)
+		memcpy(childEntries(sibling.data, max), allCounts + numHalfKeys + 1, (numSiblingKeys + 1) * sizeof(int));
+	keyCount(sibling.data) = numSiblingKeys;
+
+	// Success
+	return RC_SUCCESS;
+}
 
-  // leftcut and right cut are the left and right side of the key that will be 'deleted'
-  int leftcut = sizeof(PageId) + (numHalfKeys * RECORD_PAIR_SIZE);
-  int rightcut = leftcut + sizeof(int);
+/*
+ * Given the searchKey, find the child-node pointer to follow and
+ * output it in pid.
+ * @param searchKey[IN] the searchKey that is being looked up.
+ * @param pid[OUT] the pointer to the child node to follow.
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::locateChildPtr(int searchKey, PageId& pid)
+{
+	int idx;
+	return locateChildPtr(searchKey, pid, idx);
+}
 
-	// Copy second half of node into sibling
-	memcpy(sibling.buffer, buffer + rightcut, PageFile::PAGE_SIZE - rightcut);
+/*
+ * Given the searchKey, find the child-node pointer to follow and
+ * output it in pid, and its number in idx.
+ * @param searchKey[IN] the searchKey that is being looked up.
+ * @param pid[OUT] the pointer to the child node to follow.
+ * @param idx[OUT] the number of the child
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::locateChildPtr(int searchKey, PageId& pid, int& idx)
+{
+	// Follow the pointer left of the first key >= searchKey, or the
+	// last pointer if there is no such key. Entries equal to a key may
+	// be on both sides of it, so we have to start on the left
+	idx = lowerBound(nodeKeys(data), keyCount(data), searchKey);
 
-	// Erase second half of original
-	//memset(buffer + leftcut, 0, PageFile::PAGE_SIZE - leftcut);
-	fill(buffer + leftcut, buffer + PageFile::PAGE_SIZE, 0);
+	pid = nonLeafPids(data, maxKeys())[idx];
+	return RC_SUCCESS;
+}
 
-	// Choose which buffer to insert new key into
-	int siblingFirstKey;
-	int thisNodeFirstKey;
+/*
+ * Find the child holding the first entry with a key >= searchKey
+ * (> searchKey if inclusive), and count the entries before it.
+ * @param searchKey[IN] the key to rank
+ * @param inclusive[IN] true if the entries with searchKey are counted
+ * @param pid[OUT] the child to follow
+ * @param before[OUT] # of entries under the children before pid
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::locateRank(int searchKey, bool inclusive, PageId& pid, int& before)
+{
+	if (!isCounted())
+		return RC_NODE_NOT_COUNTED;
 
-  // get the first key of each node; they are one PageId offset from start of buffer
-	memcpy(&siblingFirstKey, sibling.buffer + sizeof(PageId), sizeof(int));
-	memcpy(&thisNodeFirstKey, buffer + sizeof(PageId), sizeof(int));
+	int count = keyCount(data);
+	int* keys = nodeKeys(data);
+	int* counts = childEntries(data, MAX_COUNTED_KEYS);
 
-	if (key < siblingFirstKey) // Belongs in lower half
-		insert(key, pid);
-	else // Belongs in upper half
-		sibling.insert(key, pid);
+	// The children left of the keys < searchKey (<= if inclusive) hold
+	// only entries that rank before searchKey
+	int idx = inclusive ? upperBound(keys, count, searchKey) : lowerBound(keys, count, searchKey);
 
-	// output sibling's first key in midKey
-	memcpy(&midKey, sibling.buffer + sizeof(PageId), sizeof(int));
+	before = 0;
+	for (int i = 0; i < idx; i++)
+		before += counts[i];
 
-	// Success
+	pid = nonLeafPids(data, MAX_COUNTED_KEYS)[idx];
 	return RC_SUCCESS;
 }
 
 /*
- * Given the searchKey, find the child-node pointer to follow and
- * output it in pid.
- * @param searchKey[IN] the searchKey that is being looked up.
- * @param pid[OUT] the pointer to the child node to follow.
+ * Find the child holding the rank'th entry under the node.
+ * @param rank[IN/OUT] the rank under this node, then under the child
+ * @param pid[OUT] the child to follow
  * @return 0 if successful. Return an error code if there is an error.
  */
-RC BTNonLeafNode::locateChildPtr(int searchKey, PageId& pid)
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::locateByRank(int& rank, PageId& pid)
 {
-	char *p = buffer + sizeof(PageId); // traversal pointer
-	int key; // traversal key
+	if (!isCounted())
+		return RC_NODE_NOT_COUNTED;
 
-	while (*p != 0) {
-  		memcpy(&key, p, sizeof(int));
+	int count = keyCount(data);
+	int* counts = childEntries(data, MAX_COUNTED_KEYS);
 
-		if (key > searchKey) {
-			// Return pid on left side of key
-			memcpy(&pid, p-sizeof(PageId), sizeof(PageId));
+	if (rank < 0)
+		return RC_INVALID_CURSOR;
+
+	for (int i = 0; i <= count; i++) {
+		if (rank < counts[i]) {
+			pid = nonLeafPids(data, MAX_COUNTED_KEYS)[i];
 			return RC_SUCCESS;
 		}
-
-		p += PAGE_PAIR_SIZE;
+		rank -= counts[i];
 	}
 
-	// Reached the end of the node, return the last pid
-	memcpy(&pid, p-sizeof(PageId), sizeof(PageId));
-	return RC_SUCCESS;
+	return RC_INVALID_CURSOR;
 }
 
 /*
@@ -562,48 +767,117 @@ RC BTNonLeafNode::locateChildPtr(int searchKey, PageId& pid)
  * @param pid2[IN] the PageId to insert behind the key
  * @return 0 if successful. Return an error code if there is an error.
  */
-RC BTNonLeafNode::initializeRoot(PageId pid1, int key, PageId pid2) {
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::initializeRoot(PageId pid1, int key, PageId pid2) {
 	clearBuffer();
 
 	// Validate inputs
 	if (pid1 < 0 || pid2 < 0)
 		return RC_INVALID_PID;
 
-	if (key < 0)
-		return RC_INVALID_KEY;
+	// pid1 and pid2 are valid
+	keyCount(data) = 1;
+	nodeKeys(data)[0] = key;
+	nonLeafPids(data, MAX_KEYS)[0] = pid1;
+	nonLeafPids(data, MAX_KEYS)[1] = pid2;
+
+	return RC_SUCCESS;
+}
 
-	// key, pid1, and pi2 are valid
-	memcpy(buffer, &pid1, sizeof(PageId));
-	memcpy(buffer + sizeof(PageId), &key, sizeof(int));
-	memcpy(buffer + sizeof(PageId) + sizeof(int), &pid2, sizeof(PageId));
+/*
+ * Initialize a counted root node with (pid1, key, pid2).
+ * @param pid1[IN] the first PageId to insert
+ * @param entries1[IN] # of leaf entries under pid1
+ * @param key[IN] the key that should be inserted between the two PageIds
+ * @param pid2[IN] the PageId to insert behind the key
+ * @param entries2[IN] # of leaf entries under pid2
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::initializeCountedRoot(PageId pid1, int entries1, int key,
+                                                   PageId pid2, int entries2) {
+	clearBuffer();
+
+	// Validate inputs
+	if (pid1 < 0 || pid2 < 0)
+		return RC_INVALID_PID;
+
+	nodeFlags(data) = NODE_COUNTED;
+	keyCount(data) = 1;
+	nodeKeys(data)[0] = key;
+	nonLeafPids(data, MAX_COUNTED_KEYS)[0] = pid1;
+	nonLeafPids(data, MAX_COUNTED_KEYS)[1] = pid2;
+	childEntries(data, MAX_COUNTED_KEYS)[0] = entries1;
+	childEntries(data, MAX_COUNTED_KEYS)[1] = entries2;
 
 	return RC_SUCCESS;
 }
 
-void BTNonLeafNode::print() {
+/*
+ * Set the number of leaf entries under the idx'th child.
+ * @param idx[IN] the number of the child
+ * @param entries[IN] # of leaf entries under the child
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+template <int PageSize>
+RC BTNonLeafNodeT<PageSize>::setChildEntryCount(int idx, int entries) {
 
-	char* traverse = buffer;
-	PageId initialPageId;
+	if (idx < 0 || idx > keyCount(data))
+		return RC_INVALID_CURSOR;
 
-	memcpy(&initialPageId, traverse, sizeof(PageId));
+	if (isCounted()) {
+		makeWritable();
+		childEntries(data, MAX_COUNTED_KEYS)[idx] = entries;
+	}
 
-	cerr << "Initial Page Id: " <<  initialPageId << endl;
+	return RC_SUCCESS;
+}
+
+/*
+ * Return the number of leaf entries under the node.
+ * @return the sum of the entry counts of the children
+ */
+template <int PageSize>
+int BTNonLeafNodeT<PageSize>::getEntryCount() {
+
+	if (!isCounted())
+		return 0;
+
+	int count = keyCount(data);
+	int* counts = childEntries(data, MAX_COUNTED_KEYS);
+	int sum = 0;
+
+	for (int i = 0; i <= count; i++)
+		sum += counts[i];
+
+	return sum;
+}
 
-	traverse += sizeof(PageId);
+template <int PageSize>
+void BTNonLeafNodeT<PageSize>::print() {
 
-	while (*traverse) {
-		int key;
-		PageId pageId;
-		
-		memcpy(&key, traverse, sizeof(int));
-		memcpy(&pageId, traverse + sizeof(int), sizeof(PageId));
+	int count = keyCount(data);
+	PageId* pids = nonLeafPids(data, maxKeys());
 
-		cerr << "Key: " << key << endl;
-		cerr << "Page Id: " << pageId << endl;
+	cerr << "Initial Page Id: " << pids[0] << endl;
 
-		traverse += PAGE_PAIR_SIZE;
+	for (int i = 0; i < count; i++) {
+		cerr << "Key: " << nodeKeys(data)[i] << endl;
+		cerr << "Page Id: " << pids[i + 1] << endl;
 	}
 
 	cerr << endl;
 }
 
+// instantiate the nodes for every supported page size
+template class BTLeafNodeT<1024>;
+template class BTLeafNodeT<2048>;
+template class BTLeafNodeT<4096>;
+template class BTLeafNodeT<8192>;
+template class BTLeafNodeT<16384>;
+
+template class BTNonLeafNodeT<1024>;
+template class BTNonLeafNodeT<2048>;
+template class BTNonLeafNodeT<4096>;
+template class BTNonLeafNodeT<8192>;
+template class BTNonLeafNodeT<16384>;
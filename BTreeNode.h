@@ -14,12 +14,26 @@
 #include "PageFile.h"
 
 /**
- * BTLeafNode: The class representing a B+tree leaf node.
+ * Every node page starts with a header holding the key count (and the
+ * next sibling pointer of a leaf). The node capacities below are derived
+ * from the page size and this header at compile time.
  */
-class BTLeafNode {
+const int BTREE_NODE_HEADER_SIZE = sizeof(int) + sizeof(PageId);
+
+/**
+ * BTLeafNodeT: The class representing a B+tree leaf node stored in
+ * a page of PageSize bytes. BTLeafNode is the node of the default page size.
+ */
+template <int PageSize>
+class BTLeafNodeT {
   public:
-    BTLeafNode();
-    BTLeafNode(PageId pid);
+    // the number of (key, rid) pairs that fit into a page
+    static constexpr int MAX_KEYS =
+      (PageSize - BTREE_NODE_HEADER_SIZE) / (sizeof(int) + sizeof(RecordId));
+
+    BTLeafNodeT();
+    BTLeafNodeT(PageId pid);
+    ~BTLeafNodeT();
 
    /**
     * Insert the (key, rid) pair to the node.
@@ -41,7 +55,7 @@ class BTLeafNode {
     * @param siblingKey[OUT] the first key in the sibling node after split.
     * @return 0 if successful. Return an error code if there is an error.
     */
-    RC insertAndSplit(int key, const RecordId& rid, BTLeafNode& sibling, int& siblingKey);
+    RC insertAndSplit(int key, const RecordId& rid, BTLeafNodeT& sibling, int& siblingKey);
 
    /**
     * If searchKey exists in the node, set eid to the index entry
@@ -84,9 +98,28 @@ class BTLeafNode {
     * @return the number of keys in the node
     */
     int getKeyCount();
+
+   /**
+    * Return the maximum number of keys a leaf node can hold.
+    * @return the capacity of a leaf node
+    */
+    static int getMaxKeyCount();
+
+   /**
+    * Interpret a leaf page in place, e.g., a page pinned by a scan,
+    * without reading it into a node.
+    * @param page[IN] the content of a leaf page
+    * @param keys[OUT] the sorted keys of the leaf
+    * @param rids[OUT] the RecordIds of the keys
+    * @param next[OUT] the PageId of the next leaf. 0 at the last leaf
+    * @return the number of keys in the leaf
+    */
+    static int viewPage(const char* page, const int*& keys, const RecordId*& rids, PageId& next);
  
    /**
     * Read the content of the node from the page pid in the PageFile pf.
+    * The page stays pinned in the buffer pool and is read in place
+    * until the node is modified or destroyed.
     * @param pid[IN] the PageId to read
     * @param pf[IN] PageFile to read from
     * @return 0 if successful. Return an error code if there is an error.
@@ -105,28 +138,61 @@ class BTLeafNode {
 
 
   private:
-    // number of keys in the node
-    int numKeys;
-
     // page id of this node in the tree's PageFile
     PageId pid_;
    /**
     * The main memory buffer for loading the content of the disk page 
     * that contains the node.
     */
-    char buffer[PageFile::PAGE_SIZE];
+    char buffer[PageSize];
+
+   /**
+    * The content of the node. Points either to buffer or to the
+    * buffer pool frame of pinnedPid while the node is only read.
+    */
+    char* data;
+    const PageFile* pinnedFile;
+    PageId pinnedPid;
 
     RC clearBuffer();
+
+    // copy a pinned frame into buffer before the node is modified
+    void makeWritable();
+
+    // unpin the frame the node points to, if any
+    void release();
+
+    // nodes may point to pinned frames, so they cannot be copied
+    BTLeafNodeT(const BTLeafNodeT&);
+    BTLeafNodeT& operator=(const BTLeafNodeT&);
 }; 
 
 
 /**
- * BTNonLeafNode: The class representing a B+tree nonleaf node.
+ * BTNonLeafNodeT: The class representing a B+tree nonleaf node stored in
+ * a page of PageSize bytes. BTNonLeafNode is the node of the default page size.
+ * A counted node also stores the number of leaf entries in the subtree
+ * of every child, so ranks can be found in a single descent. It holds
+ * fewer keys than a plain node. The children of a node are numbered
+ * from 0, left to right.
  */
-class BTNonLeafNode {
+template <int PageSize>
+class BTNonLeafNodeT {
   public:
-    BTNonLeafNode();
-    BTNonLeafNode(PageId pid);
+    // the number of keys that fit into a page together with one more
+    // PageId than keys
+    static constexpr int MAX_KEYS =
+      (PageSize - BTREE_NODE_HEADER_SIZE - sizeof(PageId)) / (sizeof(int) + sizeof(PageId));
+
+    // the number of keys of a counted node, which also has an entry
+    // count for every PageId
+    static constexpr int MAX_COUNTED_KEYS =
+      (PageSize - BTREE_NODE_HEADER_SIZE - sizeof(PageId) - sizeof(int)) /
+      (sizeof(int) + sizeof(PageId) + sizeof(int));
+
+    BTNonLeafNodeT();
+    BTNonLeafNodeT(PageId pid);
+    ~BTNonLeafNodeT();
 
    /**
     * Insert a (key, pid) pair to the node.
@@ -149,11 +215,41 @@ class BTNonLeafNode {
     * @param midKey[OUT] the key in the middle after the split. This key should be inserted to the parent node.
     * @return 0 if successful. Return an error code if there is an error.
     */
-    RC insertAndSplit(int key, PageId pid, BTNonLeafNode& sibling, int& midKey);
+    RC insertAndSplit(int key, PageId pid, BTNonLeafNodeT& sibling, int& midKey);
+
+   /**
+    * Insert the (key, pid) pair right behind the idx'th child, e.g., when
+    * that child was split and pid is its right half. Unlike insert(),
+    * this puts the pair in the right place even if other keys equal key.
+    * @param idx[IN] the child to insert behind
+    * @param key[IN] the key to insert
+    * @param pid[IN] the PageId to insert
+    * @param entries[IN] # of leaf entries under pid. ignored if the
+    *                    node is not counted
+    * @return 0 if successful. Return an error code if the node is full.
+    */
+    RC insertChild(int idx, int key, PageId pid, int entries);
+
+   /**
+    * Insert the (key, pid) pair right behind the idx'th child and split
+    * the node half and half with sibling, like insertAndSplit().
+    * The sibling is counted if this node is.
+    * @param idx[IN] the child to insert behind
+    * @param key[IN] the key to insert
+    * @param pid[IN] the PageId to insert
+    * @param entries[IN] # of leaf entries under pid
+    * @param sibling[IN] the sibling node to split with. This node MUST be empty when this function is called.
+    * @param midKey[OUT] the key in the middle after the split. This key should be inserted to the parent node.
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC insertChildAndSplit(int idx, int key, PageId pid, int entries,
+                           BTNonLeafNodeT& sibling, int& midKey);
 
    /**
     * Given the searchKey, find the child-node pointer to follow and
-    * output it in pid.
+    * output it in pid. This is the leftmost child that may hold
+    * searchKey, so a scan from there sees all entries with searchKey
+    * even if they span several children.
     * Remember that the keys inside a B+tree node are sorted.
     * @param searchKey[IN] the searchKey that is being looked up.
     * @param pid[OUT] the pointer to the child node to follow.
@@ -161,6 +257,38 @@ class BTNonLeafNode {
     */
     RC locateChildPtr(int searchKey, PageId& pid);
 
+   /**
+    * Same as above, but also output the number of the child.
+    * @param searchKey[IN] the searchKey that is being looked up.
+    * @param pid[OUT] the pointer to the child node to follow.
+    * @param idx[OUT] the number of the child
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC locateChildPtr(int searchKey, PageId& pid, int& idx);
+
+   /**
+    * Find the child holding the first entry with a key >= searchKey
+    * (> searchKey if inclusive) of a counted node, and count the
+    * entries under the children before it.
+    * @param searchKey[IN] the key to rank
+    * @param inclusive[IN] true if the entries with searchKey are counted
+    * @param pid[OUT] the child to follow
+    * @param before[OUT] # of entries under the children before pid
+    * @return 0 if successful. RC_NODE_NOT_COUNTED if the node has no counts
+    */
+    RC locateRank(int searchKey, bool inclusive, PageId& pid, int& before);
+
+   /**
+    * Find the child holding the rank'th entry (from 0) under a counted
+    * node.
+    * @param rank[IN/OUT] the rank under this node. on return, the rank
+    *                     under the child
+    * @param pid[OUT] the child to follow
+    * @return 0 if successful. RC_NODE_NOT_COUNTED if the node has no
+    *         counts, RC_INVALID_CURSOR if the rank is out of range
+    */
+    RC locateByRank(int& rank, PageId& pid);
+
    /**
     * Initialize the root node with (pid1, key, pid2).
     * @param pid1[IN] the first PageId to insert
@@ -170,14 +298,55 @@ class BTNonLeafNode {
     */
     RC initializeRoot(PageId pid1, int key, PageId pid2);
 
+   /**
+    * Initialize a counted root node with (pid1, key, pid2).
+    * @param pid1[IN] the first PageId to insert
+    * @param entries1[IN] # of leaf entries under pid1
+    * @param key[IN] the key that should be inserted between the two PageIds
+    * @param pid2[IN] the PageId to insert behind the key
+    * @param entries2[IN] # of leaf entries under pid2
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC initializeCountedRoot(PageId pid1, int entries1, int key, PageId pid2, int entries2);
+
+   /**
+    * @return true if the node stores the entry counts of its children
+    */
+    bool isCounted();
+
+   /**
+    * Set the number of leaf entries under the idx'th child. Nothing
+    * happens if the node is not counted.
+    * @param idx[IN] the number of the child
+    * @param entries[IN] # of leaf entries under the child
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC setChildEntryCount(int idx, int entries);
+
+   /**
+    * Return the number of leaf entries under the node.
+    * @return the sum of the entry counts of the children. 0 if the
+    *         node is not counted
+    */
+    int getEntryCount();
+
    /**
     * Return the number of keys stored in the node.
     * @return the number of keys in the node
     */
     int getKeyCount();
 
+   /**
+    * Return the maximum number of keys a non-leaf node can hold.
+    * @param counted[IN] true for the capacity of a counted node
+    * @return the capacity of a non-leaf node
+    */
+    static int getMaxKeyCount(bool counted = false);
+
    /**
     * Read the content of the node from the page pid in the PageFile pf.
+    * The page stays pinned in the buffer pool and is read in place
+    * until the node is modified or destroyed.
     * @param pid[IN] the PageId to read
     * @param pf[IN] PageFile to read from
     * @return 0 if successful. Return an error code if there is an error.
@@ -195,18 +364,41 @@ class BTNonLeafNode {
     void print();
 
   private:
-    // number of keys in the node
-    int numKeys;
-
     // page id of this node in the tree's PageFile
     PageId pid_;
    /**
     * The main memory buffer for loading the content of the disk page 
     * that contains the node.
     */
-    char buffer[PageFile::PAGE_SIZE];
+    char buffer[PageSize];
+
+   /**
+    * The content of the node. Points either to buffer or to the
+    * buffer pool frame of pinnedPid while the node is only read.
+    */
+    char* data;
+    const PageFile* pinnedFile;
+    PageId pinnedPid;
 
     RC clearBuffer();
+
+    // the capacity of this node, which depends on whether it is counted
+    int maxKeys();
+
+    // copy a pinned frame into buffer before the node is modified
+    void makeWritable();
+
+    // unpin the frame the node points to, if any
+    void release();
+
+    // nodes may point to pinned frames, so they cannot be copied
+    BTNonLeafNodeT(const BTNonLeafNodeT&);
+    BTNonLeafNodeT& operator=(const BTNonLeafNodeT&);
 }; 
 
+// nodes of the default page size. BTreeNode.cc instantiates the
+// templates for every page size a PageFile supports
+typedef BTLeafNodeT<PageFile::PAGE_SIZE> BTLeafNode;
+typedef BTNonLeafNodeT<PageFile::PAGE_SIZE> BTNonLeafNode;
+
 #endif /* BTREENODE_H */
\ No newline at end of file
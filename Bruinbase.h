@@ -39,4 +39,10 @@ const int RC_INVALID_KEY         = -1021;
 const int RC_INVALID_RECORD      = -1022;
 const int RC_SIBLING_NOT_EMPTY   = -1023;
 
+const int RC_NO_FREE_FRAME       = -1024;
+const int RC_INVALID_CAPACITY    = -1025;
+const int RC_INVALID_PAGE_SIZE   = -1026;
+const int RC_SOCKET_FAILED       = -1027;
+const int RC_NODE_NOT_COUNTED    = -1028;
+
 #endif // BRUINBASE_H
@@ -0,0 +1,547 @@
+#include "BufferPool.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+// default size of a shared pool: 4096 frames with 1KB pages
+static const int DEFAULT_POOL_BYTES = 4096 * PageFile::PAGE_SIZE;
+
+BufferPool::BufferPool(int capacity, int pageSize, int numShards)
+{
+  this->capacity = capacity > 0 ? capacity : 1;
+  this->pageSize = pageSize;
+  this->maxShards = numShards > 0 ? numShards : 1;
+
+  int n = shardCount(this->capacity);
+  for (int i = 0; i < n; i++) {
+    shards.push_back(new Shard(0, pageSize));
+  }
+  for (int i = 0; i < n; i++) {
+    shards[i]->capacity = shardCapacity(i, this->capacity);
+  }
+}
+
+BufferPool::~BufferPool()
+{
+  for (unsigned i = 0; i < shards.size(); i++) {
+    delete shards[i];
+  }
+}
+
+BufferPool& BufferPool::getDefault(int pageSize)
+{
+  // one shared pool per page size, indexed by log2(pageSize / PAGE_SIZE)
+  static BufferPool* pools[8];
+  static mutex poolsMutex;
+
+  int i = 0;
+  while ((PageFile::PAGE_SIZE << i) < pageSize && i < 7) i++;
+
+  lock_guard<mutex> lock(poolsMutex);
+  if (pools[i] == NULL) {
+    pools[i] = new BufferPool(DEFAULT_POOL_BYTES / pageSize, pageSize);
+  }
+  return *pools[i];
+}
+
+unsigned long long BufferPool::makeKey(int file, PageId pid)
+{
+  return ((unsigned long long) (unsigned) file << 32) | (unsigned) pid;
+}
+
+BufferPool::Shard& BufferPool::shardOf(int file, PageId pid) const
+{
+  // mix the key so that consecutive pages land in different shards
+  unsigned long long h = makeKey(file, pid) * 0x9E3779B97F4A7C15ULL;
+  return *shards[(h >> 32) % shards.size()];
+}
+
+int BufferPool::shardCount(int capacity) const
+{
+  int n = capacity / MIN_SHARD_FRAMES;
+  if (n > maxShards) n = maxShards;
+  return n > 0 ? n : 1;
+}
+
+int BufferPool::shardCapacity(int i, int capacity) const
+{
+  int n = (int) shards.size();
+  int c = capacity / n + (i < capacity % n ? 1 : 0);
+  return c > 0 ? c : 1;
+}
+
+int BufferPool::getFrameCount() const
+{
+  int count = 0;
+  for (unsigned i = 0; i < shards.size(); i++) {
+    lock_guard<mutex> lock(shards[i]->mutex);
+    count += (int) shards[i]->frames.size();
+  }
+  return count;
+}
+
+RC BufferPool::setCapacity(int capacity)
+{
+  RC rc = 0;
+
+  if (capacity <= 0) return RC_INVALID_CAPACITY;
+
+  // pages move to other shards when their number changes, so we hold
+  // all locks and rebuild the pool if nothing is pinned
+  for (unsigned i = 0; i < shards.size(); i++) shards[i]->mutex.lock();
+
+  this->capacity = capacity;
+  int n = shardCount(capacity);
+  bool pinned = false;
+  for (unsigned i = 0; i < shards.size(); i++) {
+    for (unsigned f = 0; f < shards[i]->frames.size(); f++) {
+      if (shards[i]->frames[f].pinCount > 0) pinned = true;
+    }
+  }
+
+  vector<Shard*> locked(shards);
+  if (n != (int) shards.size() && !pinned) {
+    rc = reshard(n);
+  } else {
+    // evict unpinned pages until every shard fits into its new capacity
+    for (unsigned i = 0; i < shards.size(); i++) {
+      shards[i]->capacity = shardCapacity(i, capacity);
+
+      RC src = shards[i]->shrink();
+      if (src < 0) rc = src;
+    }
+  }
+
+  // shards replaced by reshard() can only be deleted once unlocked
+  for (unsigned i = locked.size(); i-- > 0; ) locked[i]->mutex.unlock();
+  if (locked != shards) {
+    for (unsigned i = 0; i < locked.size(); i++) delete locked[i];
+  }
+  return rc;
+}
+
+RC BufferPool::reshard(int n)
+{
+  // write back all dirty pages, since the frames are about to go away
+  for (unsigned i = 0; i < shards.size(); i++) {
+    Shard& s = *shards[i];
+    for (unsigned f = 0; f < s.frames.size(); f++) {
+      RC rc;
+      if ((rc = s.writeBack(f)) < 0) return rc;
+    }
+  }
+
+  vector<Shard*> fresh;
+  for (int i = 0; i < n; i++) {
+    fresh.push_back(new Shard(0, pageSize));
+  }
+  shards.swap(fresh);
+  for (int i = 0; i < n; i++) {
+    shards[i]->capacity = shardCapacity(i, capacity);
+  }
+  return 0;
+}
+
+RC BufferPool::pin(const PageFile& pf, PageId pid, char*& page)
+{
+  RC rc;
+  int f;
+  Shard& s = shardOf(pf.fileId, pid);
+  unordered_map<unsigned long long, int>::iterator it;
+
+  unique_lock<mutex> lock(s.mutex);
+
+  // if the page is in the pool, pin it there
+  it = s.table.find(makeKey(pf.fileId, pid));
+  if (it != s.table.end()) {
+    f = it->second;
+    if (s.frames[f].pinCount++ == 0) s.lruRemove(f);
+
+    // another thread is reading the page in. the frames may move while
+    // we wait, so the frame is looked up by its index again
+    while (s.frames[f].loading) s.loaded.wait(lock);
+    if (s.frames[f].failed) {
+      s.release(f);
+      return RC_FILE_READ_FAILED;
+    }
+
+    page = s.frames[f].data;
+    return 0;
+  }
+
+  // otherwise claim a free frame for it. the frame is pinned and marked
+  // as loading, so it stays ours while the lock is released
+  if ((rc = s.allocFrame(f)) < 0) return rc;
+
+  s.frames[f].file = pf.fileId;
+  s.frames[f].pid = pid;
+  s.frames[f].pinCount = 1;
+  s.frames[f].dirty = false;
+  s.frames[f].closed = false;
+  s.frames[f].loading = true;
+  s.frames[f].failed = false;
+  s.frames[f].owner = &pf;
+  s.table[makeKey(pf.fileId, pid)] = f;
+
+  // read the page from the disk without the lock, so the other pages of
+  // the shard can be used meanwhile
+  char* data = s.frames[f].data;
+  lock.unlock();
+  rc = pf.readPage(pid, data);
+  lock.lock();
+
+  s.frames[f].loading = false;
+  s.loaded.notify_all();
+
+  if (rc < 0) {
+    // the threads waiting for the page fail as well. the next pin()
+    // tries to read it again
+    s.table.erase(makeKey(pf.fileId, pid));
+    s.frames[f].failed = true;
+    s.release(f);
+    return rc;
+  }
+
+  page = data;
+  return 0;
+}
+
+RC BufferPool::fetch(const PageFile& pf, const PageId* pids, int n)
+{
+  RC rc;
+  vector<PageId> missing;
+
+  // find the pages that are not in the pool
+  for (int i = 0; i < n; i++) {
+    if (pids[i] < 0 || pids[i] >= pf.epid) continue;
+
+    Shard& s = shardOf(pf.fileId, pids[i]);
+    lock_guard<mutex> lock(s.mutex);
+    if (s.table.find(makeKey(pf.fileId, pids[i])) == s.table.end()) missing.push_back(pids[i]);
+  }
+  if (missing.empty()) return 0;
+
+  // in pid order, so that consecutive pages are read by one request
+  sort(missing.begin(), missing.end());
+  missing.erase(unique(missing.begin(), missing.end()), missing.end());
+
+  // read them without holding any lock, so other threads can use the
+  // pool while the reads are in flight
+  vector<char> data((size_t) missing.size() * pageSize);
+  vector<char*> buffers(missing.size());
+  for (unsigned i = 0; i < missing.size(); i++) buffers[i] = &data[(size_t) i * pageSize];
+  if ((rc = pf.readPages(&missing[0], (int) missing.size(), &buffers[0])) < 0) return rc;
+
+  for (unsigned i = 0; i < missing.size(); i++) {
+    Shard& s = shardOf(pf.fileId, missing[i]);
+    unsigned long long key = makeKey(pf.fileId, missing[i]);
+    int f;
+
+    lock_guard<mutex> lock(s.mutex);
+    if (s.table.find(key) != s.table.end()) continue;
+    if (s.allocFrame(f) < 0) continue;
+
+    memcpy(s.frames[f].data, buffers[i], pageSize);
+    s.frames[f].file = pf.fileId;
+    s.frames[f].pid = missing[i];
+    s.frames[f].pinCount = 0;
+    s.frames[f].closed = false;
+    s.frames[f].loading = false;
+    s.frames[f].failed = false;
+    s.frames[f].dirty = false;
+    s.frames[f].owner = &pf;
+    s.table[key] = f;
+    s.lruPushBack(f);
+  }
+
+  return 0;
+}
+
+void BufferPool::unpin(const PageFile& pf, PageId pid)
+{
+  Shard& s = shardOf(pf.fileId, pid);
+  unordered_map<unsigned long long, int>::iterator it;
+
+  lock_guard<mutex> lock(s.mutex);
+
+  it = s.table.find(makeKey(pf.fileId, pid));
+  if (it == s.table.end()) return;
+
+  if (s.frames[it->second].pinCount > 0) s.release(it->second);
+}
+
+RC BufferPool::write(const PageFile& pf, PageId pid, const void* buffer)
+{
+  RC rc;
+  int f;
+  Shard& s = shardOf(pf.fileId, pid);
+  unordered_map<unsigned long long, int>::iterator it;
+
+  lock_guard<mutex> lock(s.mutex);
+
+  // the whole page is overwritten, so a missing page is never read in
+  it = s.table.find(makeKey(pf.fileId, pid));
+  if (it != s.table.end()) {
+    f = it->second;
+    if (s.frames[f].pinCount == 0) {
+      // touch the page in LRU order
+      s.lruRemove(f);
+      s.lruPushBack(f);
+    }
+  } else {
+    if ((rc = s.allocFrame(f)) < 0) return rc;
+    s.frames[f].file = pf.fileId;
+    s.frames[f].pid = pid;
+    s.frames[f].pinCount = 0;
+    s.frames[f].closed = false;
+    s.frames[f].loading = false;
+    s.frames[f].failed = false;
+    s.frames[f].owner = &pf;
+    s.frames[f].dirty = false;
+    s.table[makeKey(pf.fileId, pid)] = f;
+    s.lruPushBack(f);
+  }
+
+  if (s.frames[f].data != buffer) memcpy(s.frames[f].data, buffer, pageSize);
+  if (!s.frames[f].dirty) {
+    s.frames[f].dirty = true;
+    s.dirtyFrames.push_back(f);
+
+    // frames written back on eviction leave stale entries behind
+    if (s.dirtyFrames.size() > 2 * s.frames.size()) s.compactDirtyFrames();
+  }
+  return 0;
+}
+
+RC BufferPool::flushFile(const PageFile& pf)
+{
+  RC  rc = 0;
+
+  // (pid, shard, frame) of every dirty page of this file
+  struct DirtyPage {
+    PageId pid;
+    Shard* shard;
+    int    f;
+  };
+  vector<DirtyPage> mine;
+
+  // take the dirty pages of the file from every shard. they are pinned,
+  // so they stay in their frames while they are written without a lock,
+  // and the other files can use the pool meanwhile
+  for (unsigned i = 0; i < shards.size(); i++) {
+    Shard& s = *shards[i];
+    vector<int> others;
+
+    lock_guard<mutex> lock(s.mutex);
+    s.compactDirtyFrames();
+    for (unsigned j = 0; j < s.dirtyFrames.size(); j++) {
+      int f = s.dirtyFrames[j];
+      if (s.frames[f].file == pf.fileId) {
+        DirtyPage d = { s.frames[f].pid, &s, f };
+        mine.push_back(d);
+        if (s.frames[f].pinCount++ == 0) s.lruRemove(f);
+        s.frames[f].dirty = false;
+      } else {
+        others.push_back(f);
+      }
+    }
+    s.dirtyFrames.swap(others);
+  }
+
+  sort(mine.begin(), mine.end(),
+       [](const DirtyPage& a, const DirtyPage& b) { return a.pid < b.pid; });
+
+  // write all pages as one batch. the runs of consecutive pages are
+  // written by concurrent vectored writes
+  vector<PageId> pids;
+  vector<char*> pages;
+  for (unsigned i = 0; i < mine.size(); i++) {
+    pids.push_back(mine[i].pid);
+    pages.push_back(mine[i].shard->frames[mine[i].f].data);
+  }
+
+  if (!mine.empty()) rc = pf.writePages(&pids[0], (int) pids.size(), &pages[0]);
+
+  // a page that was not written stays dirty
+  for (unsigned i = 0; i < mine.size(); i++) {
+    Shard& s = *mine[i].shard;
+    lock_guard<mutex> lock(s.mutex);
+    if (rc < 0) {
+      s.frames[mine[i].f].dirty = true;
+      s.dirtyFrames.push_back(mine[i].f);
+    }
+    s.release(mine[i].f);
+  }
+
+  return rc;
+}
+
+void BufferPool::update(const PageFile& pf, PageId pid, const void* buffer)
+{
+  Shard& s = shardOf(pf.fileId, pid);
+  unordered_map<unsigned long long, int>::iterator it;
+
+  lock_guard<mutex> lock(s.mutex);
+
+  it = s.table.find(makeKey(pf.fileId, pid));
+  if (it == s.table.end()) return;
+
+  Frame& fr = s.frames[it->second];
+  if (fr.data != buffer) memcpy(fr.data, buffer, pageSize);
+}
+
+void BufferPool::evictFile(const PageFile& pf)
+{
+  for (unsigned i = 0; i < shards.size(); i++) {
+    Shard& s = *shards[i];
+    lock_guard<mutex> lock(s.mutex);
+
+    for (unsigned f = 0; f < s.frames.size(); f++) {
+      if (s.frames[f].file != pf.fileId || s.frames[f].closed) continue;
+
+      // a pinned page may still be read through its frame, so it is
+      // dropped on its last unpin. no other file uses its id, and it
+      // is never written back
+      if (s.frames[f].pinCount > 0) {
+        s.frames[f].closed = true;
+        s.frames[f].dirty = false;
+        continue;
+      }
+      s.lruRemove(f);
+      s.dropFrame(f);
+    }
+  }
+}
+
+//
+// BufferPool::Shard
+//
+
+BufferPool::Shard::Shard(int capacity, int pageSize)
+{
+  this->capacity = capacity;
+  this->pageSize = pageSize;
+  lruHead = lruTail = -1;
+}
+
+BufferPool::Shard::~Shard()
+{
+  for (unsigned i = 0; i < frames.size(); i++) {
+    delete [] frames[i].data;
+  }
+}
+
+RC BufferPool::Shard::shrink()
+{
+  while ((int) (frames.size() - freeFrames.size()) > capacity && lruHead >= 0) {
+    int f = lruHead;
+    RC  rc;
+    if ((rc = writeBack(f)) < 0) return rc;
+    lruRemove(f);
+    dropFrame(f);
+  }
+  return 0;
+}
+
+void BufferPool::Shard::lruRemove(int f)
+{
+  Frame& fr = frames[f];
+  if (fr.prev >= 0) frames[fr.prev].next = fr.next; else lruHead = fr.next;
+  if (fr.next >= 0) frames[fr.next].prev = fr.prev; else lruTail = fr.prev;
+  fr.prev = fr.next = -1;
+}
+
+void BufferPool::Shard::lruPushBack(int f)
+{
+  Frame& fr = frames[f];
+  fr.prev = lruTail;
+  fr.next = -1;
+  if (lruTail >= 0) frames[lruTail].next = f; else lruHead = f;
+  lruTail = f;
+}
+
+void BufferPool::Shard::release(int f)
+{
+  if (--frames[f].pinCount > 0) return;
+
+  // the last pin of a page whose file was closed or whose read failed
+  // drops the page
+  if (frames[f].closed || frames[f].failed) dropFrame(f); else lruPushBack(f);
+}
+
+void BufferPool::Shard::dropFrame(int f)
+{
+  // the frame must not be linked in the LRU list when it is dropped. a
+  // page whose read failed may be in another frame by now
+  unordered_map<unsigned long long, int>::iterator it = table.find(makeKey(frames[f].file, frames[f].pid));
+  if (it != table.end() && it->second == f) table.erase(it);
+  frames[f].file = -1;
+  frames[f].pid = -1;
+  frames[f].dirty = false;
+  frames[f].closed = false;
+  frames[f].failed = false;
+  frames[f].owner = NULL;
+  freeFrames.push_back(f);
+}
+
+RC BufferPool::Shard::writeBack(int f)
+{
+  RC rc;
+  Frame& fr = frames[f];
+
+  if (!fr.dirty) return 0;
+  if ((rc = fr.owner->writeRun(fr.pid, &fr.data, 1)) < 0) return rc;
+  fr.dirty = false;
+  return 0;
+}
+
+RC BufferPool::Shard::allocFrame(int& f)
+{
+  RC rc;
+
+  // reuse a frame that holds no page
+  if (!freeFrames.empty()) {
+    f = freeFrames.back();
+    freeFrames.pop_back();
+    return 0;
+  }
+
+  // grow the shard until we reach the capacity
+  if ((int) frames.size() < capacity) {
+    Frame fr;
+    fr.file = -1;
+    fr.pid = -1;
+    fr.pinCount = 0;
+    fr.dirty = false;
+    fr.closed = false;
+    fr.loading = false;
+    fr.failed = false;
+    fr.owner = NULL;
+    fr.prev = fr.next = -1;
+    fr.data = new char[pageSize];
+    frames.push_back(fr);
+    f = (int) frames.size() - 1;
+    return 0;
+  }
+
+  // evict the least recently used unpinned page
+  if (lruHead < 0) return RC_NO_FREE_FRAME;
+  f = lruHead;
+  if ((rc = writeBack(f)) < 0) return rc;
+  lruRemove(f);
+  table.erase(makeKey(frames[f].file, frames[f].pid));
+  return 0;
+}
+
+void BufferPool::Shard::compactDirtyFrames()
+{
+  // drop the entries of frames that were written back or listed twice
+  vector<int> dirty;
+  sort(dirtyFrames.begin(), dirtyFrames.end());
+  for (unsigned i = 0; i < dirtyFrames.size(); i++) {
+    int f = dirtyFrames[i];
+    if (frames[f].dirty && (dirty.empty() || dirty.back() != f)) dirty.push_back(f);
+  }
+  dirtyFrames.swap(dirty);
+}
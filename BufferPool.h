@@ -0,0 +1,221 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include "Bruinbase.h"
+#include "PageFile.h"
+
+/**
+ * A buffer manager that caches disk pages of PageFiles in memory frames.
+ * Pages are looked up by (file, pid) through a hash table and replaced
+ * in LRU order. A pinned frame is never evicted, so callers can work
+ * directly on the frame memory between pin() and unpin().
+ * Pages written in write-back mode stay dirty in the pool and reach
+ * the disk when they are evicted or their file is flushed.
+ * The pool is safe to use from several threads. Pages are spread over
+ * shards by their (file, pid), and every shard has its own lock, hash
+ * table and LRU list, so threads working on different pages rarely
+ * wait for each other. A page is read in or flushed while its frame is
+ * pinned and the lock is released, so a slow disk stalls only the
+ * threads that need that page.
+ */
+class BufferPool {
+ public:
+
+  // the default # of shards of a pool
+  static const int DEFAULT_SHARDS = 16;
+
+  // the least # of frames of a shard. smaller pools get fewer shards, so
+  // that a few pinned pages cannot use up a whole shard
+  static const int MIN_SHARD_FRAMES = 64;
+
+  /**
+   * create a pool that holds up to capacity pages of pageSize bytes.
+   * frame memory is allocated lazily as pages are brought in.
+   * the capacity is split evenly among the shards, and every shard
+   * gets at least MIN_SHARD_FRAMES frames if the capacity allows.
+   * @param capacity[IN] the maximum number of frames in the pool
+   * @param pageSize[IN] the size of each frame in bytes
+   * @param numShards[IN] the number of independently locked shards
+   */
+  BufferPool(int capacity, int pageSize = PageFile::PAGE_SIZE,
+             int numShards = DEFAULT_SHARDS);
+  ~BufferPool();
+
+  /**
+   * @param pageSize[IN] the page size of the files using the pool
+   * @return the pool shared by all PageFiles of that page size that were
+   *         not given their own
+   */
+  static BufferPool& getDefault(int pageSize = PageFile::PAGE_SIZE);
+
+  /**
+   * change the capacity of the pool. unpinned frames beyond the new
+   * capacity are evicted. if the new capacity calls for a different
+   * number of shards and no page is pinned, the pool is written back,
+   * emptied and split again. must not be called while other threads
+   * use the pool.
+   * @param capacity[IN] the new maximum number of frames
+   * @return error code. 0 if no error
+   */
+  RC setCapacity(int capacity);
+
+  /**
+   * bring the page into the pool (if it is not already there) and pin it.
+   * @param pf[IN] the file the page belongs to
+   * @param pid[IN] the page to pin
+   * @param page[OUT] pointer to the frame holding the page
+   * @return error code. 0 if no error
+   */
+  RC pin(const PageFile& pf, PageId pid, char*& page);
+
+  /**
+   * bring a batch of pages into the pool without pinning them. the pages
+   * that are not in the pool yet are read from the disk with one batch
+   * of asynchronous requests (see PageFile::readPages()), and each is
+   * put into a free or LRU frame. a page another thread brought in
+   * meanwhile is kept as it is, and when every frame of a shard is
+   * pinned, its pages are left to be read on pin().
+   * @param pf[IN] the file the pages belong to
+   * @param pids[IN] the pages to bring in
+   * @param n[IN] # of pages
+   * @return error code. 0 if no error
+   */
+  RC fetch(const PageFile& pf, const PageId* pids, int n);
+
+  /**
+   * release a pin obtained by pin(). once the pin count of a frame
+   * drops to zero, the frame becomes a candidate for eviction.
+   * @param pf[IN] the file the page belongs to
+   * @param pid[IN] the page to unpin
+   */
+  void unpin(const PageFile& pf, PageId pid);
+
+  /**
+   * store a page in the pool and mark it dirty, without writing it to
+   * the disk. a later write of the same page simply replaces the frame.
+   * @param pf[IN] the file the page belongs to
+   * @param pid[IN] the page to write
+   * @param buffer[IN] the new content of the page
+   * @return error code. RC_NO_FREE_FRAME if every frame is pinned
+   */
+  RC write(const PageFile& pf, PageId pid, const void* buffer);
+
+  /**
+   * write all dirty pages of a file to the disk. the pages are sorted
+   * by pid, every run of consecutive pages becomes one vectored write,
+   * and the writes of all runs are in flight at once.
+   * @param pf[IN] the file to flush
+   * @return error code. 0 if no error
+   */
+  RC flushFile(const PageFile& pf);
+
+  /**
+   * refresh the cached copy of a page after it has been written to disk.
+   * nothing happens if the page is not in the pool.
+   * @param pf[IN] the file the page belongs to
+   * @param pid[IN] the page that was written
+   * @param buffer[IN] the new content of the page
+   */
+  void update(const PageFile& pf, PageId pid, const void* buffer);
+
+  /**
+   * drop all cached pages of a file. called when the file is closed.
+   * a page that is still pinned stays in its frame until it is unpinned
+   * through the same PageFile, and then it is dropped.
+   * @param pf[IN] the file whose pages are dropped
+   */
+  void evictFile(const PageFile& pf);
+
+  int getCapacity() const   { return capacity; }
+  int getPageSize() const   { return pageSize; }
+  int getShardCount() const { return (int) shards.size(); }
+  int getFrameCount() const;
+
+ private:
+  struct Frame {
+    int    file;      // the file id of the cached page (-1 if free)
+    PageId pid;       // page id of the cached page
+    int    pinCount;  // # of outstanding pins
+    bool   dirty;     // true if the page has to be written back
+    bool   closed;    // the file was closed while the page was pinned
+    bool   loading;   // the page is being read in by a pin() without the lock
+    bool   failed;    // the read of the page failed
+    const PageFile* owner; // the file to write a dirty page back to
+    int    prev;      // LRU list links among unpinned frames
+    int    next;
+    char*  data;      // the page content
+  };
+
+  // a part of the pool with its own lock. all fields are protected
+  // by the mutex. no disk I/O is done while it is held, except for the
+  // write-back of an evicted dirty page
+  struct Shard {
+    std::mutex mutex;
+    std::condition_variable loaded; // signaled when a page was read in
+    int capacity;     // maximum # of frames of the shard
+    int pageSize;     // size of each frame
+
+    std::vector<Frame> frames;
+    std::unordered_map<unsigned long long, int> table; // (file, pid) -> frame
+
+    int lruHead;      // least recently used unpinned frame
+    int lruTail;      // most recently used unpinned frame
+    std::vector<int> freeFrames; // frames that hold no page
+    std::vector<int> dirtyFrames; // frames that were marked dirty
+
+    Shard(int capacity, int pageSize);
+    ~Shard();
+
+    void lruRemove(int f);
+    void lruPushBack(int f);
+    void dropFrame(int f);
+
+    // drop a pin of a frame. the frame goes back to the LRU list or is
+    // dropped once no pin is left
+    void release(int f);
+
+    // find a frame for a new page: a free one, a new one or an LRU victim.
+    // a dirty victim is written back first.
+    RC allocFrame(int& f);
+
+    // write a dirty frame back to its file
+    RC writeBack(int f);
+
+    // remove clean and duplicate entries from dirtyFrames
+    void compactDirtyFrames();
+
+    // evict unpinned frames until the shard fits into its capacity
+    RC shrink();
+  };
+
+  int capacity;     // maximum # of frames
+  int pageSize;     // size of each frame
+
+  int maxShards;    // # of shards requested on construction
+  std::vector<Shard*> shards;
+
+  static unsigned long long makeKey(int file, PageId pid);
+
+  // the shard holding a page
+  Shard& shardOf(int file, PageId pid) const;
+
+  // the # of shards for a pool of capacity frames
+  int shardCount(int capacity) const;
+
+  // the capacity of the i'th shard when the pool holds capacity frames
+  int shardCapacity(int i, int capacity) const;
+
+  // replace the shards with n empty shards. all shards must be locked,
+  // and no page may be pinned
+  RC reshard(int n);
+
+  // forbid copying
+  BufferPool(const BufferPool&);
+  BufferPool& operator=(const BufferPool&);
+};
+
+#endif // BUFFERPOOL_H
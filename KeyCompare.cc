@@ -0,0 +1,97 @@
+#include "KeyCompare.h"
+#include <cstddef>
+
+typedef KeyCompare::Word Word;
+
+static const int WORD_BITS = KeyCompare::WORD_BITS;
+
+// set the bits of keys[from..n-1] that are less than and equal to val
+static void compareScalar(const int* keys, int from, int n, int val, Word* lt, Word* eq)
+{
+  for (int i = from; i < n; i++) {
+    lt[i / WORD_BITS] |= (Word) (keys[i] < val) << (i % WORD_BITS);
+    if (eq != NULL) eq[i / WORD_BITS] |= (Word) (keys[i] == val) << (i % WORD_BITS);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static void compareAVX2(const int* keys, int n, int val, Word* lt, Word* eq)
+{
+  __m256i v = _mm256_set1_epi32(val);
+  int i = 0;
+
+  // 8 keys per compare. 8 divides 64, so a step never crosses a word
+  for (; i + 8 <= n; i += 8) {
+    __m256i k = _mm256_loadu_si256((const __m256i*) (keys + i));
+    Word l = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, k)));
+    lt[i / WORD_BITS] |= l << (i % WORD_BITS);
+    if (eq != NULL) {
+      Word e = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, k)));
+      eq[i / WORD_BITS] |= e << (i % WORD_BITS);
+    }
+  }
+
+  compareScalar(keys, i, n, val, lt, eq);
+}
+
+__attribute__((target("sse2")))
+static void compareSSE2(const int* keys, int n, int val, Word* lt, Word* eq)
+{
+  __m128i v = _mm_set1_epi32(val);
+  int i = 0;
+
+  // 4 keys per compare
+  for (; i + 4 <= n; i += 4) {
+    __m128i k = _mm_loadu_si128((const __m128i*) (keys + i));
+    Word l = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, k)));
+    lt[i / WORD_BITS] |= l << (i % WORD_BITS);
+    if (eq != NULL) {
+      Word e = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, k)));
+      eq[i / WORD_BITS] |= e << (i % WORD_BITS);
+    }
+  }
+
+  compareScalar(keys, i, n, val, lt, eq);
+}
+#endif
+
+static void comparePlain(const int* keys, int n, int val, Word* lt, Word* eq)
+{
+  compareScalar(keys, 0, n, val, lt, eq);
+}
+
+// pick the widest compare the CPU supports
+static void (*chooseCompare())(const int*, int, int, Word*, Word*)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return compareAVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return compareSSE2;
+#endif
+  return comparePlain;
+}
+
+static void (*const compareKeys)(const int*, int, int, Word*, Word*) = chooseCompare();
+
+void KeyCompare::compare(const int* keys, int n, int val, Word* lt, Word* eq)
+{
+  compareKeys(keys, n, val, lt, eq);
+}
+
+int KeyCompare::countLess(const int* keys, int n, int key)
+{
+  int count = 0;
+
+  // compare a word of keys at a time and count its bits
+  for (int i = 0; i < n; i += WORD_BITS) {
+    Word lt = 0;
+    compareKeys(keys + i, n - i < WORD_BITS ? n - i : WORD_BITS, key, &lt, NULL);
+    count += __builtin_popcountll(lt);
+  }
+  return count;
+}
@@ -0,0 +1,38 @@
+#ifndef KEYCOMPARE_H
+#define KEYCOMPARE_H
+
+/**
+ * Vectorized comparisons of an array of int keys against one value,
+ * shared by the key search in B+tree nodes and the batch filters of
+ * table scans. The widest compare the CPU supports (AVX2, SSE2 or plain
+ * C++) is picked once at startup.
+ */
+class KeyCompare {
+ public:
+  // a word of a bitmap. bit i of word i / WORD_BITS stands for keys[i]
+  typedef unsigned long long Word;
+
+  static const int WORD_BITS = 64;
+
+  /**
+   * compare keys against a value. the bits of the keys that are less
+   * than or equal to it are set; the other bits are left alone, so the
+   * caller clears the words first.
+   * @param keys[IN] the keys
+   * @param n[IN] # of keys
+   * @param val[IN] the value to compare with
+   * @param lt[IN/OUT] the bitmap of the keys less than val
+   * @param eq[IN/OUT] the bitmap of the keys equal to val. NULL if not needed
+   */
+  static void compare(const int* keys, int n, int val, Word* lt, Word* eq);
+
+  /**
+   * @param keys[IN] the keys
+   * @param n[IN] # of keys
+   * @param key[IN] the key to compare with
+   * @return # of keys less than key
+   */
+  static int countLess(const int* keys, int n, int key);
+};
+
+#endif // KEYCOMPARE_H
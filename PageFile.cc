@@ -9,39 +9,85 @@
 
 #include "Bruinbase.h"
 #include "PageFile.h"
+#include "BufferPool.h"
+#include "AsyncIO.h"
 #include <cstring>
+#include <climits>
+#include <vector>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 using std::string;
+using std::vector;
 
-int PageFile::readCount = 0;
-int PageFile::writeCount = 0;
-int PageFile::cacheClock = 1;
-struct PageFile::cacheStruct PageFile::readCache[PageFile::CACHE_COUNT];
+std::atomic<int> PageFile::readCount(0);
+std::atomic<int> PageFile::writeCount(0);
+std::atomic<int> PageFile::prefetchWindow(PageFile::DEFAULT_PREFETCH_WINDOW);
+std::atomic<int> PageFile::nextFileId(0);
 
 PageFile::PageFile() 
 { 
   fd = -1; 
+  fileId = -1;
   epid = 0; 
+  pageSize = PAGE_SIZE;
+  pool = &BufferPool::getDefault();
+  writeBack = true;
+  writable = false;
+  map = NULL;
+  mapSize = 0;
 }
 
 PageFile::PageFile(const string& filename, char mode)
 {
   fd = -1;
+  fileId = -1;
   epid = 0;
+  pageSize = PAGE_SIZE;
+  pool = &BufferPool::getDefault();
+  writeBack = true;
+  writable = false;
+  map = NULL;
+  mapSize = 0;
   open(filename.c_str(), mode);
 }
 
-RC PageFile::open(const string& filename, char mode)
+PageFile::~PageFile()
+{
+  // make sure that dirty pages are not lost
+  if (fd >= 0) close();
+}
+
+RC PageFile::setWriteBack(bool on)
+{
+  writeBack = on;
+  return (on || fd < 0) ? 0 : flush();
+}
+
+void PageFile::setBufferPool(BufferPool* pool)
+{
+  if (fd < 0 && pool != NULL) this->pool = pool;
+}
+
+RC PageFile::open(const string& filename, char mode, int pageSize)
 {
   RC   rc;
   int  oflag;
+  bool mmapMode = false;
   struct stat statbuf;
 
   if (fd > 0) return RC_FILE_OPEN_FAILED;
 
+  // the page size must be a power of two in [PAGE_SIZE, MAX_PAGE_SIZE]
+  if (pageSize < PAGE_SIZE || pageSize > MAX_PAGE_SIZE || (pageSize & (pageSize - 1))) {
+    return RC_INVALID_PAGE_SIZE;
+  }
+  this->pageSize = pageSize;
+  if (pool->getPageSize() != pageSize) pool = &BufferPool::getDefault(pageSize);
+
   // set the unix file flag depending on the file mode
   switch (mode) {
   case 'r':
@@ -52,6 +98,11 @@ RC PageFile::open(const string& filename, char mode)
   case 'W':
     oflag = (O_RDWR|O_CREAT);
     break;
+  case 'm':
+  case 'M':
+    oflag = O_RDONLY;
+    mmapMode = true;
+    break;
   default:
     return RC_INVALID_FILE_MODE;
   }
@@ -63,7 +114,24 @@ RC PageFile::open(const string& filename, char mode)
   // get the size of the file to set the end pid
   rc = ::fstat(fd, &statbuf);
   if (rc < 0) { ::close(fd); fd = -1; return RC_FILE_OPEN_FAILED; }
-  epid = statbuf.st_size / PAGE_SIZE;
+  epid = statbuf.st_size / pageSize;
+  writable = (oflag != O_RDONLY);
+
+  // the pool tells files apart by an id that is never used again, since
+  // a descriptor is reused by the next file opened after a close
+  fileId = nextFileId++;
+
+  // map the whole pages of the file. if the file cannot be mapped,
+  // we simply read it through the buffer pool as in 'r' mode
+  if (mmapMode && epid > 0) {
+    mapSize = (size_t) epid * pageSize;
+    void* addr = ::mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      mapSize = 0;
+    } else {
+      map = (char*) addr;
+    }
+  }
 
   return 0;
 }
@@ -72,22 +140,24 @@ RC PageFile::close()
 {
   if (fd <= 0) return RC_FILE_CLOSE_FAILED;
 
-  // close the file
-  if (::close(fd) < 0) return RC_FILE_CLOSE_FAILED;
-
-  // evict all cached pages for this file
-  for (int i = 0; i < CACHE_COUNT; i++) {
-    if (readCache[i].fd == fd && readCache[i].lastAccessed != 0) {
-       readCache[i].fd = 0;
-       readCache[i].pid = 0;
-       readCache[i].lastAccessed = 0;
-    }
+  // write the dirty pages and evict all cached pages for this file
+  RC rc = writable ? flush() : 0;
+  pool->evictFile(*this);
+
+  // a mapped file has no pages in the pool, only the mapping
+  if (map != NULL) {
+    ::munmap(map, mapSize);
+    map = NULL;
+    mapSize = 0;
   }
 
+  // close the file
+  if (::close(fd) < 0 && rc == 0) rc = RC_FILE_CLOSE_FAILED;
+
   // set the fd and epid to the initial state
   fd = -1; 
   epid = 0;
-  return 0;
+  return rc;
 }
 
 PageId PageFile::endPid() const 
@@ -95,32 +165,25 @@ PageId PageFile::endPid() const
   return epid;
 }
 
-RC PageFile::seek(PageId pid) const
-{
-  return (::lseek(fd, pid * PAGE_SIZE, SEEK_SET) < 0) ? RC_FILE_SEEK_FAILED : 0;
-}
-
 RC PageFile::write(PageId pid, const void* buffer)
 {
   RC rc;
   if (pid < 0) return RC_INVALID_PID; 
+  if (!writable) return RC_FILE_WRITE_FAILED;
 
-  // seek to the location of the page
-  if ((rc = seek(pid)) < 0) return rc;
+  // in write-back mode, keep the page in the buffer pool. if every frame
+  // is pinned, fall through and write the page to the disk directly
+  if (writeBack && (rc = pool->write(*this, pid, buffer)) == 0) {
+    if (pid >= epid) epid = pid + 1;
+    return 0;
+  }
 
-  // write the buffer to the disk page
-  if (::write(fd, buffer, PAGE_SIZE) < 0) return RC_FILE_WRITE_FAILED;
+  // write the buffer to the disk page. pwrite leaves the file offset
+  // alone, so concurrent readers are not affected
+  if (::pwrite(fd, buffer, pageSize, (off_t) pid * pageSize) < 0) return RC_FILE_WRITE_FAILED;
 
-  // if the page is in read cache, invalidate it
-  for (int i = 0; i < CACHE_COUNT; i++) {
-    if (readCache[i].fd == fd && readCache[i].pid == pid &&
-        readCache[i].lastAccessed != 0) {
-       readCache[i].fd = 0;
-       readCache[i].pid = 0;
-       readCache[i].lastAccessed = 0;
-       break;
-    }
-  }
+  // if the page is in the buffer pool, refresh the cached copy
+  pool->update(*this, pid, buffer);
 
   // if the written pid >= end pid, update the end pid
   if (pid >= epid) epid = pid + 1;
@@ -131,50 +194,211 @@ RC PageFile::write(PageId pid, const void* buffer)
   return 0;
 }
 
+RC PageFile::flush()
+{
+  if (fd < 0) return RC_FILE_WRITE_FAILED;
+
+  return pool->flushFile(*this);
+}
+
+RC PageFile::writeRun(PageId pid, char* const* pages, int n) const
+{
+  struct iovec iov[IOV_MAX];
+
+  while (n > 0) {
+    int cnt = n < IOV_MAX ? n : IOV_MAX;
+    for (int i = 0; i < cnt; i++) {
+      iov[i].iov_base = pages[i];
+      iov[i].iov_len = pageSize;
+    }
+
+    // write the run of pages with one vectored write
+    if (::pwritev(fd, iov, cnt, (off_t) pid * pageSize) != (ssize_t) cnt * pageSize) {
+      return RC_FILE_WRITE_FAILED;
+    }
+
+    writeCount += cnt;
+    pid += cnt;
+    pages += cnt;
+    n -= cnt;
+  }
+
+  return 0;
+}
+
 RC PageFile::read(PageId pid, void* buffer) const
 {
   RC rc;
+  char* page;
 
+  // bring the page into the buffer pool and copy it to the buffer
+  if ((rc = pin(pid, page)) < 0) return rc;
+  memcpy(buffer, page, pageSize);
+  unpin(pid);
+
+  return 0;
+}
+
+RC PageFile::pin(PageId pid, char*& page) const
+{
   if (pid < 0 || pid >= epid) return RC_INVALID_PID; 
 
-  //
-  // if the page is in cache, read it from there
-  //
-  for (int i = 0; i < CACHE_COUNT; i++) {
-    if (readCache[i].fd == fd && readCache[i].pid == pid && 
-        readCache[i].lastAccessed != 0) {
-       memcpy(buffer, readCache[i].buffer, PAGE_SIZE);
-       readCache[i].lastAccessed = ++cacheClock;
-       return 0;
-    }
+  // the page is always "pinned" in the mapping. whether it comes from
+  // the disk is up to the OS, so every page access counts as a read
+  if (map != NULL) {
+    page = map + (size_t) pid * pageSize;
+    readCount++;
+    return 0;
   }
 
-  // seek to the page
-  if ((rc = seek(pid)) < 0) return rc;
-  
-  // find the cache slot to evict
-  int toEvict = 0; 
-  for (int i = 0; i < CACHE_COUNT; i++) {
-    if (readCache[i].lastAccessed == 0) {
-      toEvict = i;
-      break;
-    }
-    if (readCache[i].lastAccessed < readCache[toEvict].lastAccessed) {
-      toEvict = i;
-    }
+  return pool->pin(*this, pid, page);
+}
+
+void PageFile::unpin(PageId pid) const
+{
+  if (map != NULL) return;
+  pool->unpin(*this, pid);
+}
+
+void PageFile::prefetch(PageId begin, PageId end) const
+{
+  if (fd < 0) return;
+  if (begin < 0) begin = 0;
+  if (end > epid) end = epid;
+  if (begin >= end) return;
+
+  off_t offset = (off_t) begin * pageSize;
+  off_t length = (off_t) (end - begin) * pageSize;
+
+  // the pages of a mapped file are faulted in from the page cache, and
+  // the pages of any other file are read into the pool through it, so
+  // both are hinted to the page cache. failures are ignored, since the
+  // pages are read anyway
+  if (map != NULL) {
+    // madvise() takes an address aligned to the memory pages
+    off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+    ::madvise(map + start, length + (offset - start), MADV_WILLNEED);
+  } else {
+    ::posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
   }
-  readCache[toEvict].fd = fd;
-  readCache[toEvict].pid = pid;
-  readCache[toEvict].lastAccessed = ++cacheClock;
- 
-  // read the page to cache first and copy it to the buffer
-  if (::read(fd, readCache[toEvict].buffer, PAGE_SIZE) < 0) {
+}
+
+PageId PageFile::prefetchAhead(PageId pid, PageId end, PageId hinted) const
+{
+  int window = prefetchWindow;
+
+  if (window <= 0 || hinted > pid + window / 2) return hinted;
+
+  PageId from = hinted > pid ? hinted : pid;
+  PageId to = pid + window < end ? pid + window : end;
+  if (from < to) prefetch(from, to);
+
+  return to > hinted ? to : hinted;
+}
+
+RC PageFile::fetchPages(const PageId* pids, int n) const
+{
+  if (fd < 0) return RC_FILE_READ_FAILED;
+  if (map == NULL) return pool->fetch(*this, pids, n);
+
+  // a mapped file has no pool, so the runs of consecutive pages are
+  // hinted to the OS, which reads them in the background
+  for (int i = 0; i < n; ) {
+    int j = i + 1;
+    while (j < n && pids[j] == pids[j - 1] + 1) j++;
+    prefetch(pids[i], pids[j - 1] + 1);
+    i = j;
+  }
+  return 0;
+}
+
+void PageFile::setPrefetchWindow(int pages)
+{
+  prefetchWindow = pages > 0 ? pages : 0;
+}
+
+RC PageFile::readPage(PageId pid, void* buffer) const
+{
+  // read the page from the disk at its offset. pread does not move the
+  // shared file offset, so threads can read the same file at once
+  if (::pread(fd, buffer, pageSize, (off_t) pid * pageSize) < 0) {
     return RC_FILE_READ_FAILED;
   }
-  memcpy(buffer, readCache[toEvict].buffer, PAGE_SIZE);
 
   // increase the page read count
   readCount++;
 
   return 0;
 }
+
+RC PageFile::readPages(const PageId* pids, int n, char* const* buffers) const
+{
+  return transferPages(false, pids, n, buffers);
+}
+
+RC PageFile::writePages(const PageId* pids, int n, char* const* pages) const
+{
+  return transferPages(true, pids, n, pages);
+}
+
+RC PageFile::transferPages(bool write, const PageId* pids, int n, char* const* pages) const
+{
+  RC failed = write ? RC_FILE_WRITE_FAILED : RC_FILE_READ_FAILED;
+  vector<struct iovec> iov(n);
+  vector<AsyncIO::Request> reqs;
+
+  if (n <= 0) return 0;
+
+  // a run of consecutive pages becomes one vectored request
+  for (int i = 0; i < n; i++) {
+    iov[i].iov_base = pages[i];
+    iov[i].iov_len = pageSize;
+    if (i > 0 && pids[i] == pids[i - 1] + 1 && reqs.back().iovcnt < IOV_MAX) {
+      reqs.back().iovcnt++;
+      continue;
+    }
+
+    AsyncIO::Request req;
+    req.fd = fd;
+    req.write = write;
+    req.offset = (off_t) pids[i] * pageSize;
+    req.iov = &iov[i];
+    req.iovcnt = 1;
+    req.result = 0;
+    reqs.push_back(req);
+  }
+
+  // like preadv() and pwritev(), a request may move fewer bytes than it
+  // asks for. the rest is asked for again until it is done, or a read
+  // gets nothing because it is at the end of the file
+  vector<AsyncIO::Request> rest;
+  while (!reqs.empty()) {
+    if (AsyncIO::forThread().run(&reqs[0], (int) reqs.size()) < 0) return failed;
+
+    rest.clear();
+    for (unsigned i = 0; i < reqs.size(); i++) {
+      AsyncIO::Request req = reqs[i];
+      if (req.result < 0 || (write && req.result == 0)) return failed;
+      if (req.result == 0) continue;
+
+      // skip the buffers done and trim the one done in part
+      size_t done = req.result;
+      int k = req.iov - &iov[0];
+      int end = k + req.iovcnt;
+      while (k < end && done >= iov[k].iov_len) done -= iov[k++].iov_len;
+      if (k == end) continue;
+
+      iov[k].iov_base = (char*) iov[k].iov_base + done;
+      iov[k].iov_len -= done;
+      req.offset += req.result;
+      req.iov = &iov[k];
+      req.iovcnt = end - k;
+      req.result = 0;
+      rest.push_back(req);
+    }
+    reqs.swap(rest);
+  }
+
+  if (write) writeCount += n; else readCount += n;
+  return 0;
+}
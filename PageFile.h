@@ -11,36 +11,73 @@
 #define PAGEFILE_H
 
 #include <string>
+#include <atomic>
 #include "Bruinbase.h"
 
 typedef int PageId;
 
+class BufferPool;
+
 /**
- * read/write a file in the unit of a page
+ * read/write a file in the unit of a page.
+ * all disk I/O is positional (pread/pwrite), so several threads may read
+ * the same PageFile at once. writes to a file must not run concurrently
+ * with other accesses to the same file.
  */
 class PageFile {
  public:
 
-  static const int PAGE_SIZE = 1024;    // the size of a page is 1KB
+  static const int PAGE_SIZE = 1024;    // the default size of a page is 1KB
+  static const int MAX_PAGE_SIZE = 16384; // the largest page size of a file
 
   PageFile();
   PageFile(const std::string& filename, char mode);
+  ~PageFile();
 
   /**
-   * open a file in read or write mode.
+   * open a file in read, write or mmap mode.
    * when opened in 'w' mode, if the file does not exist, it is created.
+   * 'm' mode is read-only and maps the whole file into memory. pages are
+   * then served from the OS page cache instead of the buffer pool, and
+   * pin() returns a pointer into the mapping without any system call.
    * @param filename[IN] the name of the file to open
-   * @param mode[IN] 'r' for read, 'w' for write
+   * @param mode[IN] 'r' for read, 'w' for write, 'm' for mmap
+   * @param pageSize[IN] the size of the pages of the file. a power of two
+   *                     between PAGE_SIZE and MAX_PAGE_SIZE
    * @return error code. 0 if no error
    */
-  RC open(const std::string& filename, char mode);
+  RC open(const std::string& filename, char mode, int pageSize = PAGE_SIZE);
 
   /**
-   * close the file.
+   * close the file. dirty pages in the buffer pool are written first.
    * @return error code. 0 if no error
    */
   RC close();
+
+  /**
+   * write all dirty pages of this file that are held in the buffer pool
+   * to the disk. consecutive pages are written with a single call.
+   * @return error code. 0 if no error
+   */
+  RC flush();
   
+  /**
+   * pin a page in the buffer pool and return a pointer to the frame
+   * holding it, so the page can be read without copying.
+   * the frame stays valid until the matching unpin() call.
+   * in 'm' mode the pointer points into the read-only mapping instead.
+   * @param pid[IN] the page to pin
+   * @param page[OUT] pointer to the frame holding the page
+   * @return error code. 0 if no error
+   */
+  RC pin(PageId pid, char*& page) const;
+
+  /**
+   * release a page pinned by pin().
+   * @param pid[IN] the page to unpin
+   */
+  void unpin(PageId pid) const;
+
   /**
    * read a disk page into memory buffer.
    * @param pid[IN] the page to read
@@ -53,6 +90,8 @@ class PageFile {
    * write the memory buffer to the disk page.
    * if (pid >= endPid()), the file is expanded such that
    * endPid() becomes (pid + 1).
+   * in write-back mode the page is only stored in the buffer pool and
+   * reaches the disk on eviction, flush() or close().
    * @param pid[IN] page to write to
    * @param buffer[IN] the content to write
    * @return error code. 0 if no error
@@ -67,7 +106,85 @@ class PageFile {
   PageId endPid() const;
 
   /**
-   * @return the total # of disk reads
+   * @return the size of the pages of this file in bytes
+   */
+  int getPageSize() const { return pageSize; }
+
+  /**
+   * @return true if the file was opened in 'm' mode and is mapped
+   */
+  bool isMapped() const { return map != NULL; }
+
+  // the default # of pages a sequential scan keeps prefetched ahead of it
+  static const int DEFAULT_PREFETCH_WINDOW = 64;
+
+  /**
+   * hint that the pages [begin, end) will be read soon. the OS starts
+   * reading them in the background (posix_fadvise(), or madvise() for a
+   * mapped file), so a scan over cold data does not wait for every page
+   * in turn. pages past the end of the file are ignored.
+   * @param begin[IN] the first page to prefetch
+   * @param end[IN] the page after the last page to prefetch
+   */
+  void prefetch(PageId begin, PageId end) const;
+
+  /**
+   * keep the prefetch window ahead of a sequential scan. a scan calls
+   * this before it reads a page; the next window is hinted once half of
+   * the pages hinted before were read, so there is one hint per half
+   * window rather than one per page.
+   * @param pid[IN] the page the scan reads next
+   * @param end[IN] the page after the last page of the scan
+   * @param hinted[IN] the page after the last page hinted so far. 0 at
+   *                   the start of the scan
+   * @return the page after the last page hinted now
+   */
+  PageId prefetchAhead(PageId pid, PageId end, PageId hinted) const;
+
+  /**
+   * bring a batch of pages into the buffer pool, such as the pages an
+   * index lookup reads next. the pages missing from the pool are read
+   * with all requests in flight at once (see AsyncIO) rather than one
+   * miss after another. the pages of a mapped file are prefetched
+   * instead. the pages are not pinned, so they may be evicted again
+   * before they are read if the pool is small.
+   * @param pids[IN] the pages, in any order
+   * @param n[IN] # of pages
+   * @return error code. 0 if no error
+   */
+  RC fetchPages(const PageId* pids, int n) const;
+
+  /**
+   * set the # of pages a sequential scan keeps prefetched ahead of it.
+   * @param pages[IN] # of pages. 0 turns prefetching off
+   */
+  static void setPrefetchWindow(int pages);
+
+  /**
+   * @return the # of pages a sequential scan keeps prefetched
+   */
+  static int getPrefetchWindow() { return prefetchWindow; }
+
+  /**
+   * cache the pages of this file in the given buffer pool instead of
+   * the default one. must be called while the file is closed.
+   * a pool whose frames do not match the page size of the file is
+   * replaced by the default pool for that page size on open().
+   * @param pool[IN] the buffer pool to use
+   */
+  void setBufferPool(BufferPool* pool);
+
+  /**
+   * turn write-back caching on or off. it is on by default.
+   * turning it off flushes the dirty pages of this file.
+   * @param on[IN] true for write-back, false for write-through
+   * @return error code. 0 if no error
+   */
+  RC setWriteBack(bool on);
+
+  /**
+   * @return the total # of disk reads. for a mapped file, every page
+   *         access is counted
    */
   static int getPageReadCount()  { return readCount; }
   
@@ -78,35 +195,69 @@ class PageFile {
 
  protected:
   /**
-   * move the file cursor to the beginning of a page.
-   * this is an internal function not exposed to public.
-   * @param pid[IN] page to seek to
+   * read a disk page directly from the disk, bypassing the buffer pool.
+   * called by the buffer pool on a cache miss.
+   * @param pid[IN] the page to read
+   * @param buffer[OUT] pointer to memory buffer
+   * @return error code. 0 if no error
+   */
+  RC readPage(PageId pid, void *buffer) const;
+
+  /**
+   * write n consecutive pages starting at pid directly to the disk,
+   * bypassing the buffer pool. called by the buffer pool to write
+   * back dirty pages.
+   * @param pid[IN] the first page to write
+   * @param pages[IN] pointers to the content of the n pages
+   * @param n[IN] the number of pages
+   * @return error code. 0 if no error
+   */
+  RC writeRun(PageId pid, char* const* pages, int n) const;
+
+  /**
+   * read a batch of pages directly from the disk, bypassing the buffer
+   * pool. runs of consecutive pages are read with one vectored request,
+   * and all requests are in flight at once.
+   * @param pids[IN] the pages to read
+   * @param n[IN] # of pages
+   * @param buffers[OUT] the buffers the n pages are read into
    * @return error code. 0 if no error
    */
-  RC seek(PageId pid) const;
+  RC readPages(const PageId* pids, int n, char* const* buffers) const;
+
+  /**
+   * write a batch of pages directly to the disk, bypassing the buffer
+   * pool, like readPages().
+   * @param pids[IN] the pages to write
+   * @param n[IN] # of pages
+   * @param pages[IN] pointers to the content of the n pages
+   * @return error code. 0 if no error
+   */
+  RC writePages(const PageId* pids, int n, char* const* pages) const;
+
+  friend class BufferPool;
 
  private:
   int     fd;     // file descriptor of the associated unix file
+  int     fileId; // identifies this opening of the file in the buffer pool.
+                  // a closed file keeps it until it is opened again
   PageId  epid;   // (last page id + 1) of the file
+  int     pageSize; // the size of the pages of the file
 
-  //
-  // the following set of members implement LRU caching 
-  //
-  static const int CACHE_COUNT = 10;
+  BufferPool* pool; // the buffer pool caching the pages of this file
+  bool writeBack;   // true if writes are kept in the buffer pool
+  bool writable;    // false if the file was opened in 'r' or 'm' mode
 
-  static int cacheClock; // clock tick counter for LRU policy
+  char*  map;       // the mapping of the file in 'm' mode, NULL otherwise
+  size_t mapSize;   // the length of the mapping
 
-  // the actual cache data structure
-  static struct cacheStruct {
-    int    fd;              // file id of the cached page
-    PageId pid;             // page id of the cached page
-    int    lastAccessed;    // the last time the cached page was accessed
-                            //   (lastAccessed == 0) means that the buffer is empty
-    char buffer[PAGE_SIZE]; // the buffer used for caching
-  } readCache[CACHE_COUNT];
+  // read or write a batch of pages through AsyncIO
+  RC transferPages(bool write, const PageId* pids, int n, char* const* pages) const;
 
-  static int readCount;  // total # of page reads 
-  static int writeCount; // total # of page writes 
+  static std::atomic<int> readCount;  // total # of page reads 
+  static std::atomic<int> writeCount; // total # of page writes 
+  static std::atomic<int> prefetchWindow; // # of pages prefetched by scans
+  static std::atomic<int> nextFileId;     // the id of the next file opened
 };
   
 #endif // PAGEFILE_H
@@ -9,10 +9,25 @@
 
 #include "Bruinbase.h"
 #include "RecordFile.h"
+#include <cassert>
 #include <cstring>
 
 using std::string;
 
+// the first int of the header page of a SLOTTED file. the first int of
+// a FIXED page is # records in the page, which is never this large
+static const int RECORD_FILE_MAGIC = 0x46524242;
+
+// the location of the format in the header page
+static const int HEADER_FORMAT_OFFSET = sizeof(int);
+
+// a SLOTTED page starts with # records and the start of the record area
+static const int SLOTTED_HEADER_SIZE = 2 * sizeof(int);
+
+// the most records a SLOTTED page can hold: records with empty values
+static const int MAX_SLOTTED_RECORDS =
+  (PageFile::PAGE_SIZE - SLOTTED_HEADER_SIZE) / (sizeof(unsigned short) + sizeof(int) + 1);
+
 //
 // helper functions for page manipultation
 //
@@ -20,11 +35,8 @@ using std::string;
 // compute the pointer to the n'th slot in a page
 static char* slotPtr(char* page, int n);
 
-// read the record in the n'th slot in the page
-static void readSlot(const char* page, int n, int& key, std::string& value);
-
 // write the record to the n'th slot in the page
-static void writeSlot(char* page, int n, int key, const std::string& value);
+static void writeSlot(char* page, int n, int key, const char* value, int len);
 
 // get # records stored in the page
 static int getRecordCount(const char* page);
@@ -32,6 +44,21 @@ static int getRecordCount(const char* page);
 // update # records stored in the page
 static void setRecordCount(char* page, int count);
 
+// initialize an empty page of the given format
+static void initPage(char* page, RecordFile::Format format);
+
+// compute the pointer to the n'th record in a page of the given format
+static char* recordPtr(char* page, int n, RecordFile::Format format);
+
+// write the record as the n'th record of a SLOTTED page holding n records.
+// returns false if the page does not have enough free space
+static bool writeSlottedRecord(char* page, int n, int key, const char* value, int len);
+
+// write the record as the n'th record of a page of the given format.
+// returns false if the page does not have enough free space
+static bool writeRecord(char* page, int n, int key, const char* value, int len,
+                        RecordFile::Format format);
+
 
 //
 // helper functions for RecordId manipulation
@@ -42,6 +69,10 @@ RecordId operator++ (RecordId& rid, int)
 {
   RecordId prid(rid);
 
+  // a FIXED page has RECORDS_PER_PAGE slots. a SLOTTED page may hold
+  // more, so its rids cannot be advanced without the page
+  assert(rid.sid < RecordFile::RECORDS_PER_PAGE);
+
   // if the end of a page is reached, move to the next page
   if (++rid.sid >= RecordFile::RECORDS_PER_PAGE) {
     rid.pid++;
@@ -54,6 +85,10 @@ RecordId operator++ (RecordId& rid, int)
 // prefix record id iterator
 RecordId& operator++ (RecordId& rid)
 {
+  // a FIXED page has RECORDS_PER_PAGE slots. a SLOTTED page may hold
+  // more, so its rids cannot be advanced without the page
+  assert(rid.sid < RecordFile::RECORDS_PER_PAGE);
+
   // if the end of a page is reached, move to the next page
   if (++rid.sid >= RecordFile::RECORDS_PER_PAGE) {
     rid.pid++;
@@ -107,20 +142,64 @@ RecordFile::RecordFile()
 {
   erid.pid = 0;
   erid.sid = 0;
+  format = FIXED;
 }
 
-RecordFile::RecordFile(const string& filename, char mode)
+RecordFile::RecordFile(const string& filename, char mode, Format format)
 {
-  open(filename, mode);
+  // the file stays empty if it cannot be opened
+  erid.pid = 0;
+  erid.sid = 0;
+  this->format = FIXED;
+  open(filename, mode, format);
 }
 
-RC RecordFile::open(const string& filename, char mode)
+RC RecordFile::open(const string& filename, char mode, Format format)
 {
   RC   rc;
-  char page[PageFile::PAGE_SIZE];
+  char *page;
 
   // open the page file
   if ((rc = pf.open(filename, mode)) < 0) return rc;
+
+  //
+  // find out the format of the file
+  //
+
+  this->format = FIXED;
+  if (pf.endPid() == 0) {
+    // a new SLOTTED file starts with its header page
+    if (format == SLOTTED && (mode == 'w' || mode == 'W')) {
+      char header[PageFile::PAGE_SIZE];
+      memset(header, 0, PageFile::PAGE_SIZE);
+      int stored = SLOTTED;
+      memcpy(header, &RECORD_FILE_MAGIC, sizeof(int));
+      memcpy(header + HEADER_FORMAT_OFFSET, &stored, sizeof(int));
+      if ((rc = pf.write(0, header)) < 0) {
+        pf.close();
+        return rc;
+      }
+      this->format = SLOTTED;
+    }
+  } else {
+    // files without the header page are FIXED files
+    int magic, stored;
+    if ((rc = pf.pin(0, page)) < 0) {
+      pf.close();
+      return rc;
+    }
+    memcpy(&magic, page, sizeof(int));
+    memcpy(&stored, page + HEADER_FORMAT_OFFSET, sizeof(int));
+    pf.unpin(0);
+
+    if (magic == RECORD_FILE_MAGIC) {
+      if (stored != SLOTTED) {
+        pf.close();
+        return RC_INVALID_FILE_FORMAT;
+      }
+      this->format = SLOTTED;
+    }
+  }
   
   //
   // in the rest of this function, we set the end record id
@@ -129,17 +208,17 @@ RC RecordFile::open(const string& filename, char mode)
   // get the end pid of the file
   erid.pid = pf.endPid();
 
-  // if the end pid is zero, the file is empty.
-  // set the end record id to (0, 0).
-  if (erid.pid == 0) {
-    erid.sid = 0;
+  // if the file holds no record page, the file is empty.
+  // set the end record id to the first record id.
+  if (erid.pid <= beginRid().pid) {
+    erid = beginRid();
     return 0;
   }
 
   // obtain # records in the last page to set sid of the end record id.
   // read the last page of the file and get # records in the page.
   // remeber that the id of the last page is endPid()-1 not endPid().
-  if ((rc = pf.read(--erid.pid, page)) < 0) {
+  if ((rc = pf.pin(--erid.pid, page)) < 0) {
     // an error occurred during page read
     erid.pid = erid.sid = 0;
     pf.close();
@@ -148,7 +227,8 @@ RC RecordFile::open(const string& filename, char mode)
 
   // get # records in the last page
   erid.sid = getRecordCount(page);
-  if (erid.sid >= RECORDS_PER_PAGE) {
+  pf.unpin(erid.pid);
+  if (format == FIXED && erid.sid >= RECORDS_PER_PAGE) {
     // the last page is full. advance the end record id to the next page.
     erid.pid++;
     erid.sid = 0;
@@ -168,22 +248,79 @@ RC RecordFile::close()
 RC RecordFile::read(const RecordId& rid, int& key, string& value) const
 {
   RC   rc;
-  char page[PageFile::PAGE_SIZE];
-  
+  const char *ptr;
+
+  // the record is read directly from the buffer pool frame
+  if ((rc = pin(rid, key, ptr)) < 0) return rc;
+
+  // read the value from the page
+  value.assign(ptr);
+  unpin(rid);
+
+  return 0;
+}
+
+RC RecordFile::pin(const RecordId& rid, int& key, const char*& value) const
+{
+  RC   rc;
+  char *page;
+
   // check whether the rid is in the valid range
-  if (rid.pid < 0 || rid.pid > erid.pid) return RC_INVALID_RID;
-  if (rid.sid < 0 || rid.sid >= RecordFile::RECORDS_PER_PAGE) return RC_INVALID_RID;
+  if (rid.pid < beginRid().pid || rid.sid < 0) return RC_INVALID_RID;
+  if (format == FIXED && rid.sid >= RecordFile::RECORDS_PER_PAGE) return RC_INVALID_RID;
   if (rid >= erid) return RC_INVALID_RID;
-  
-  // read the page containing the record
-  if ((rc = pf.read(rid.pid, page)) < 0) return rc;
 
-  // read the record from the slot in the page
-  readSlot(page, rid.sid, key, value);
+  // the page stays pinned, so the value can be used in place
+  if ((rc = pf.pin(rid.pid, page)) < 0) return rc;
+
+  // a SLOTTED page holds as many records as fit into it
+  if (rid.sid >= getRecordCount(page)) {
+    pf.unpin(rid.pid);
+    return RC_INVALID_RID;
+  }
+
+  char *ptr = recordPtr(page, rid.sid, format);
+  memcpy(&key, ptr, sizeof(int));
+  value = ptr + sizeof(int);
 
   return 0;
 }
 
+void RecordFile::unpin(const RecordId& rid) const
+{
+  pf.unpin(rid.pid);
+}
+
+RC RecordFile::pinPage(PageId pid, const int* sids, int n, int* keys, const char** values) const
+{
+  RC   rc;
+  char *page;
+  int  count;
+
+  if (pid < beginRid().pid || pid > erid.pid) return RC_INVALID_RID;
+  if ((rc = pf.pin(pid, page)) < 0) return rc;
+
+  // the count of the last page is kept in the end record id
+  count = (pid == erid.pid) ? erid.sid : getRecordCount(page);
+
+  for (int i = 0; i < n; i++) {
+    if (sids[i] < 0 || sids[i] >= count) {
+      pf.unpin(pid);
+      return RC_INVALID_RID;
+    }
+    char *ptr = recordPtr(page, sids[i], format);
+    memcpy(&keys[i], ptr, sizeof(int));
+    values[i] = ptr + sizeof(int);
+  }
+
+  return 0;
+}
+
+void RecordFile::unpinPage(PageId pid) const
+{
+  pf.unpin(pid);
+}
+
 RC RecordFile::append(int key, const std::string& value, RecordId& rid)
 {
   RC   rc;
@@ -195,12 +332,18 @@ RC RecordFile::append(int key, const std::string& value, RecordId& rid)
     if ((rc = pf.read(erid.pid, page)) < 0) return rc;
   } else {
     // if this is the first slot of an empty page
-    // we can simply initialize the page with zeros
-    memset(page, 0, PageFile::PAGE_SIZE);
+    // we can simply initialize the page
+    initPage(page, format);
   }
     
-  // write the record to the first empty slot 
-  writeSlot(page, erid.sid, key, value);
+  // write the record to the first empty slot. if a SLOTTED page is too
+  // full for the record, the record goes to the next page
+  if (!writeRecord(page, erid.sid, key, value.data(), value.size(), format)) {
+    erid.pid++;
+    erid.sid = 0;
+    initPage(page, format);
+    writeRecord(page, erid.sid, key, value.data(), value.size(), format);
+  }
 
   // the first four bytes in the page stores # records in the page.
   // update this number.
@@ -212,17 +355,217 @@ RC RecordFile::append(int key, const std::string& value, RecordId& rid)
   // we need to output the rid of the record slot
   rid = erid;
 
+  // advance the end record id by one to the next empty slot.
+  // a SLOTTED page is left only when a record does not fit
+  if (format == FIXED) ++erid;
+  else erid.sid++;
+
+  return 0;
+}
+
+RC RecordFile::appendBatch(const std::vector<int>& keys, const std::vector<std::string>& values,
+                           std::vector<RecordId>& rids)
+{
+  RC rc;
+  RecordId rid;
+  BulkWriter writer(*this);
+
+  if (keys.size() != values.size()) return RC_INVALID_RECORD;
+
+  rids.clear();
+  rids.reserve(keys.size());
+  for (unsigned i = 0; i < keys.size(); i++) {
+    if ((rc = writer.append(keys[i], values[i], rid)) < 0) return rc;
+    rids.push_back(rid);
+  }
+
+  return writer.finish();
+}
+
+RecordFile::BulkWriter::BulkWriter(RecordFile& rf) : rf(rf)
+{
+  loaded = false;
+}
+
+RecordFile::BulkWriter::~BulkWriter()
+{
+  finish();
+}
+
+RC RecordFile::BulkWriter::append(int key, const std::string& value, RecordId& rid)
+{
+  return append(key, value.data(), value.size(), rid);
+}
+
+RC RecordFile::BulkWriter::append(int key, const char* value, int len, RecordId& rid)
+{
+  RC rc;
+
+  // bring in the tail page once. unless we start at the first slot of
+  // an empty page, it already holds some records
+  if (!loaded) {
+    if (rf.erid.sid > 0) {
+      if ((rc = rf.pf.read(rf.erid.pid, page)) < 0) return rc;
+    } else {
+      initPage(page, rf.format);
+    }
+    loaded = true;
+  }
+
+  // write the record to the first empty slot. a SLOTTED page that is
+  // too full for the record is written out and a new one is started
+  if (!writeRecord(page, rf.erid.sid, key, value, len, rf.format)) {
+    if ((rc = rf.pf.write(rf.erid.pid, page)) < 0) return rc;
+    rf.erid.pid++;
+    rf.erid.sid = 0;
+    initPage(page, rf.format);
+    writeRecord(page, rf.erid.sid, key, value, len, rf.format);
+  }
+  setRecordCount(page, rf.erid.sid + 1);
+
+  // the FIXED page is full, so write it out and start a new one
+  if (rf.format == FIXED && rf.erid.sid + 1 >= RECORDS_PER_PAGE) {
+    if ((rc = rf.pf.write(rf.erid.pid, page)) < 0) return rc;
+    loaded = false;
+  }
+
+  // we need to output the rid of the record slot
+  rid = rf.erid;
+
   // advance the end record id by one to the next empty slot
-  ++erid;
+  if (rf.format == FIXED) ++rf.erid;
+  else rf.erid.sid++;
 
   return 0;
 }
 
+RC RecordFile::BulkWriter::finish()
+{
+  RC rc;
+
+  // write the partially filled page
+  if (loaded) {
+    if ((rc = rf.pf.write(rf.erid.pid, page)) < 0) return rc;
+    loaded = false;
+  }
+
+  return 0;
+}
+
+RecordFile::Scanner::Scanner(const RecordFile& rf) : rf(rf)
+{
+  pid = rf.beginRid().pid;
+  endPid = rf.erid.pid + 1;
+  hinted = 0;
+  numPages = 0;
+}
+
+RecordFile::Scanner::Scanner(const RecordFile& rf, PageId begin, PageId end) : rf(rf)
+{
+  // the header page of a SLOTTED file holds no record
+  pid = begin > rf.beginRid().pid ? begin : rf.beginRid().pid;
+  endPid = end;
+  hinted = 0;
+  numPages = 0;
+}
+
+RecordFile::Scanner::~Scanner()
+{
+  unpinPages();
+}
+
+void RecordFile::Scanner::unpinPages()
+{
+  for (int i = 0; i < numPages; i++) {
+    rf.pf.unpin(pages[i]);
+  }
+  numPages = 0;
+}
+
+RC RecordFile::Scanner::nextBatch(const int*& keys, const char* const*& values, int& n)
+{
+  RC   rc;
+  char *page;
+  int  count;
+
+  // the values of the last batch are not used anymore
+  unpinPages();
+
+  // a batch takes whole pages, as long as the next page surely fits
+  int maxCount = (rf.format == FIXED) ? RECORDS_PER_PAGE : MAX_SLOTTED_RECORDS;
+
+  n = 0;
+  while (numPages < MAX_BATCH_PAGES && n + maxCount <= BATCH_SIZE) {
+    // stop at the end of the file. # records in the last page is
+    // kept in the end record id
+    if (pid >= endPid || pid > rf.erid.pid || (pid == rf.erid.pid && rf.erid.sid == 0)) break;
+
+    // have the pages ahead read in the background
+    hinted = rf.pf.prefetchAhead(pid, endPid, hinted);
+
+    if ((rc = rf.pf.pin(pid, page)) < 0) {
+      // a small pool may not hold all pages of a batch. the pages
+      // pinned so far make a shorter batch
+      if (rc == RC_NO_FREE_FRAME && n > 0) break;
+      return rc;
+    }
+    pages[numPages++] = pid;
+
+    // decode the keys and locate the values of the page
+    count = (pid == rf.erid.pid) ? rf.erid.sid : getRecordCount(page);
+    for (int i = 0; i < count; i++) {
+      char *ptr = recordPtr(page, i, rf.format);
+      memcpy(&this->keys[n], ptr, sizeof(int));
+      this->values[n] = ptr + sizeof(int);
+      n++;
+    }
+    pid++;
+  }
+
+  keys = this->keys;
+  values = this->values;
+  return 0;
+}
+
+RecordId RecordFile::beginRid() const
+{
+  RecordId rid;
+
+  // the header page of a SLOTTED file holds no record
+  rid.pid = (format == SLOTTED) ? 1 : 0;
+  rid.sid = 0;
+  return rid;
+}
+
 const RecordId& RecordFile::endRid() const
 {
   return erid;
 }
 
+RC RecordFile::getPageRecordCount(PageId pid, int& count) const
+{
+  RC   rc;
+  char *page;
+
+  // the count of the last page is kept in the end record id
+  if (pid < beginRid().pid || pid >= erid.pid) {
+    count = (pid == erid.pid) ? erid.sid : 0;
+    return 0;
+  }
+
+  // every FIXED page but the last one is full
+  if (format == FIXED) {
+    count = RECORDS_PER_PAGE;
+    return 0;
+  }
+
+  if ((rc = pf.pin(pid, page)) < 0) return rc;
+  count = getRecordCount(page);
+  pf.unpin(pid);
+
+  return 0;
+}
+
 static int getRecordCount(const char* page)
 {
   int count;
@@ -247,32 +590,98 @@ static char* slotPtr(char* page, int n)
   return (page+sizeof(int)) + (sizeof(int)+RecordFile::MAX_VALUE_LENGTH)*n;
 }
 
-static void readSlot(const char* page, int n, int& key, std::string& value)
+static void writeSlot(char* page, int n, int key, const char* value, int len)
 {
   // compute the location of the record
-  char *ptr = slotPtr(const_cast<char*>(page), n);
+  char *ptr = slotPtr(page, n);
 
-  // read the key 
-  memcpy(&key, ptr, sizeof(int));
+  // store the key
+  memcpy(ptr, &key, sizeof(int));
 
-  // read the value
-  value.assign(ptr + sizeof(int));
+  // store the value. 
+  // when the string is longer than MAX_VALUE_LENGTH, truncate it.
+  if (len >= RecordFile::MAX_VALUE_LENGTH) len = RecordFile::MAX_VALUE_LENGTH - 1;
+  memcpy(ptr + sizeof(int), value, len);
+  *(ptr + sizeof(int) + len) = 0;
 }
 
-static void writeSlot(char* page, int n, int key, const std::string& value)
+//
+// a SLOTTED page looks like this:
+//   [# records][start of the record area][slot 0][slot 1]...
+//   ... free space ... [record n-1]...[record 1][record 0]
+// a slot is the unsigned short offset of its record in the page. the
+// records are stored from the end of the page towards the slots, each as
+// the key followed by the null-terminated value
+//
+
+// get the offset of the first byte of the record area
+static int getRecordStart(const char* page)
 {
-  // compute the location of the record
-  char *ptr = slotPtr(page, n);
+  int start;
 
-  // store the key
-  memcpy(ptr, &key, sizeof(int));
+  memcpy(&start, page + sizeof(int), sizeof(int));
+  return start;
+}
 
-  // store the value. 
-  if ((int)value.size() >= RecordFile::MAX_VALUE_LENGTH) {
-    // when the string is longer than MAX_VALUE_LENGTH, truncate it.
-    memcpy(ptr + sizeof(int), value.c_str(), RecordFile::MAX_VALUE_LENGTH -1);
-    *(ptr + sizeof(int) + RecordFile::MAX_VALUE_LENGTH - 1) = 0;
-  } else {
-    strcpy(ptr + sizeof(int), value.c_str());
+// update the offset of the first byte of the record area
+static void setRecordStart(char* page, int start)
+{
+  memcpy(page + sizeof(int), &start, sizeof(int));
+}
+
+static void initPage(char* page, RecordFile::Format format)
+{
+  memset(page, 0, PageFile::PAGE_SIZE);
+
+  // a SLOTTED page has no record yet, so its record area is empty
+  if (format == RecordFile::SLOTTED) {
+    setRecordStart(page, PageFile::PAGE_SIZE);
+  }
+}
+
+static char* recordPtr(char* page, int n, RecordFile::Format format)
+{
+  unsigned short offset;
+
+  if (format == RecordFile::FIXED) return slotPtr(page, n);
+
+  // look up the offset of the record in the n'th slot
+  memcpy(&offset, page + SLOTTED_HEADER_SIZE + n * sizeof(unsigned short), sizeof(offset));
+  return page + offset;
+}
+
+static bool writeSlottedRecord(char* page, int n, int key, const char* value, int len)
+{
+  // when the string does not fit into an empty page, truncate it
+  if (len > RecordFile::MAX_SLOTTED_VALUE_LENGTH) {
+    len = RecordFile::MAX_SLOTTED_VALUE_LENGTH;
+  }
+
+  // the record and its slot have to fit between the slots and the records
+  int start = getRecordStart(page) - (sizeof(int) + len + 1);
+  if (start < SLOTTED_HEADER_SIZE + (int) ((n + 1) * sizeof(unsigned short))) {
+    return false;
   }
+
+  // store the key and the null-terminated value
+  memcpy(page + start, &key, sizeof(int));
+  memcpy(page + start + sizeof(int), value, len);
+  page[start + sizeof(int) + len] = 0;
+
+  // point the n'th slot to the record
+  unsigned short offset = start;
+  memcpy(page + SLOTTED_HEADER_SIZE + n * sizeof(unsigned short), &offset, sizeof(offset));
+  setRecordStart(page, start);
+
+  return true;
+}
+
+static bool writeRecord(char* page, int n, int key, const char* value, int len,
+                        RecordFile::Format format)
+{
+  if (format == RecordFile::SLOTTED) return writeSlottedRecord(page, n, key, value, len);
+
+  // a FIXED page always has a free slot for the record
+  writeSlot(page, n, key, value, len);
+  return true;
 }
@@ -11,6 +11,7 @@
 #define RECORDFILE_H
 
 #include <string>
+#include <vector>
 #include "PageFile.h"
 
 /**
@@ -26,7 +27,10 @@ typedef struct {
 // helper functions for RecordId
 // 
 
-// RecordId iterators
+// RecordId iterators. they step through the slots of a FIXED file,
+// where every page has RECORDS_PER_PAGE slots, and must not be used on
+// the rids of a SLOTTED file, whose pages hold as many records as fit.
+// the records of any page are counted by getPageRecordCount()
 RecordId& operator++ (RecordId& rid);
 RecordId  operator++ (RecordId& rid, int);
 
@@ -39,30 +43,51 @@ bool operator== (const RecordId& r1, const RecordId& r2);
 bool operator!= (const RecordId& r1, const RecordId& r2);
 
 /**
- * read/write a record to a file
+ * read/write a record to a file.
+ * a RecordFile stores its records in one of two page formats:
+ * - FIXED: every record takes a slot of sizeof(int) + MAX_VALUE_LENGTH
+ *   bytes. the records start at page 0. this is the format of the files
+ *   written by earlier versions, which have no header page.
+ * - SLOTTED: every page has a slot directory that points to records of
+ *   variable length, so short values take less space and long values
+ *   are not cut at MAX_VALUE_LENGTH. page 0 is a header page that
+ *   records the format, and the records start at page 1.
+ * in both formats a record is identified by its (pid, sid).
  */
 class RecordFile {
  public:
 
-  // maximum length of the value field
+  // the page format of a file
+  enum Format { FIXED, SLOTTED };
+
+  // maximum length of the value field in the FIXED format
   static const int MAX_VALUE_LENGTH = 100;  
 
-  // number of record slots per page
+  // maximum length of the value field in the SLOTTED format. a record
+  // with the key, the value, its null terminator and its slot has to
+  // fit into an empty page
+  static const int MAX_SLOTTED_VALUE_LENGTH = PageFile::PAGE_SIZE
+    - 2 * sizeof(int) - sizeof(unsigned short) - sizeof(int) - 1;
+
+  // number of record slots per page in the FIXED format
   static const int RECORDS_PER_PAGE = (PageFile::PAGE_SIZE - sizeof(int))/ (sizeof(int) + MAX_VALUE_LENGTH);  
     // Note that we subtract sizeof(int) from PAGE_SIZE because the first
     // four bytes in the page is used to store # records in the page.
 
   RecordFile();
-  RecordFile(const std::string& filename, char mode);
+  RecordFile(const std::string& filename, char mode, Format format = SLOTTED);
   
   /**
-   * open a file in read or write mode.
+   * open a file in read, write or mmap mode.
    * when opened in 'w' mode, if the file does not exist, it is created.
+   * 'm' mode is read-only and maps the file into memory (see PageFile).
+   * an existing file keeps the format it was created with.
    * @param filename[IN] the name of the file to open
-   * @param mode[IN] 'r' for read, 'w' for write
+   * @param mode[IN] 'r' for read, 'w' for write, 'm' for mmap
+   * @param format[IN] the page format of the file if it is created
    * @return error code. 0 if no error
    */
-  RC open(const std::string& filename, char mode);
+  RC open(const std::string& filename, char mode, Format format = SLOTTED);
 
   /**
    * close the file.
@@ -79,6 +104,51 @@ class RecordFile {
    */
   RC read(const RecordId& rid, int& key, std::string& value) const;
 
+  /**
+   * read a record without copying its value. the page holding the record
+   * is pinned and value points to the null-terminated value in the page.
+   * the pointer stays valid until the matching unpin() call.
+   * @param rid[IN] the id of the record to read
+   * @param key[OUT] the record key
+   * @param value[OUT] the record value inside the page
+   * @return error code. 0 if no error
+   */
+  RC pin(const RecordId& rid, int& key, const char*& value) const;
+
+  /**
+   * release a record pinned by pin().
+   * @param rid[IN] the id of the pinned record
+   */
+  void unpin(const RecordId& rid) const;
+
+  /**
+   * read several records of one page with a single pin, such as the
+   * tuples of a page that an index lookup found. the page stays pinned
+   * and the values point into it until the matching unpinPage() call.
+   * @param pid[IN] the page holding the records
+   * @param sids[IN] the slots of the records to read
+   * @param n[IN] # of slots
+   * @param keys[OUT] the keys of the records. n of them
+   * @param values[OUT] the values of the records inside the page
+   * @return error code. 0 if no error
+   */
+  RC pinPage(PageId pid, const int* sids, int n, int* keys, const char** values) const;
+
+  /**
+   * release a page pinned by pinPage().
+   * @param pid[IN] the pinned page
+   */
+  void unpinPage(PageId pid) const;
+
+  /**
+   * bring a batch of pages into the buffer pool at once, ahead of the
+   * pinPage() calls that read them (see PageFile::fetchPages()).
+   * @param pids[IN] the pages
+   * @param n[IN] # of pages
+   * @return error code. 0 if no error
+   */
+  RC fetchPages(const PageId* pids, int n) const { return pf.fetchPages(pids, n); }
+
   /**
    * append a new record at the end of the file.
    * note that RecordFile does not have write() function.
@@ -90,15 +160,163 @@ class RecordFile {
    */
   RC append(int key, const std::string& value, RecordId& rid);
 
+  /**
+   * append a batch of records at the end of the file. the records are
+   * packed into pages in memory and every page is written only once.
+   * @param keys[IN] the record keys
+   * @param values[IN] the record values. as many as keys
+   * @param rids[OUT] the locations of the stored records, in order
+   * @return error code. 0 if no error
+   */
+  RC appendBatch(const std::vector<int>& keys, const std::vector<std::string>& values,
+                 std::vector<RecordId>& rids);
+
+  /**
+   * appends a stream of records to a RecordFile a page at a time.
+   * the page being filled is kept in memory and written once it is full
+   * or when finish() is called, so the file must not be read or appended
+   * to by other means until then.
+   */
+  class BulkWriter {
+   public:
+    /**
+     * @param rf[IN] the file to append to. it must be open in 'w' mode
+     */
+    BulkWriter(RecordFile& rf);
+
+    /**
+     * the page being filled is written if finish() was not called.
+     */
+    ~BulkWriter();
+
+    /**
+     * append a record at the end of the file.
+     * @param key[IN] the record key
+     * @param value[IN] the record value
+     * @param rid[OUT] the location of the stored record
+     * @return error code. 0 if no error
+     */
+    RC append(int key, const std::string& value, RecordId& rid);
+
+    /**
+     * append a record whose value is given as a pointer and a length.
+     * the value does not have to be null-terminated.
+     * @param key[IN] the record key
+     * @param value[IN] the first byte of the record value
+     * @param len[IN] the length of the value in bytes
+     * @param rid[OUT] the location of the stored record
+     * @return error code. 0 if no error
+     */
+    RC append(int key, const char* value, int len, RecordId& rid);
+
+    /**
+     * write the page being filled.
+     * @return error code. 0 if no error
+     */
+    RC finish();
+
+   private:
+    RecordFile& rf;
+    char page[PageFile::PAGE_SIZE];  // the page being filled
+    bool loaded;                     // true once page holds the tail page
+
+    BulkWriter(const BulkWriter&);
+    BulkWriter& operator=(const BulkWriter&);
+  };
+
+  /**
+   * reads all records of a file in batches. a batch holds the records of
+   * several whole pages, decoded into an array of keys and an array of
+   * values. the values point into the pages, which stay pinned until the
+   * next batch is read or the scanner is destroyed. the pages ahead of
+   * the scan are prefetched (see PageFile::prefetchAhead()).
+   */
+  class Scanner {
+   public:
+    // the maximum # of records in a batch
+    static const int BATCH_SIZE = 1024;
+
+    // the maximum # of pages pinned for a batch
+    static const int MAX_BATCH_PAGES = 32;
+
+    /**
+     * @param rf[IN] the file to scan. the scan starts at its first record
+     */
+    Scanner(const RecordFile& rf);
+
+    /**
+     * scan only the records of a range of pages, such as a part of a
+     * file scanned by several threads.
+     * @param rf[IN] the file to scan
+     * @param begin[IN] the first page to scan
+     * @param end[IN] the page after the last page to scan
+     */
+    Scanner(const RecordFile& rf, PageId begin, PageId end);
+
+    /**
+     * the pages of the last batch are unpinned.
+     */
+    ~Scanner();
+
+    /**
+     * read the next batch of records. the arrays stay valid until the
+     * next call to the scanner.
+     * @param keys[OUT] the keys of the records
+     * @param values[OUT] the null-terminated values of the records
+     * @param n[OUT] # records in the batch. 0 once all records were read
+     * @return error code. 0 if no error
+     */
+    RC nextBatch(const int*& keys, const char* const*& values, int& n);
+
+   private:
+    const RecordFile& rf;
+    PageId pid;                     // the next page to read
+    PageId endPid;                  // the page after the last page to read
+    PageId hinted;                  // the page after the last prefetched page
+    PageId pages[MAX_BATCH_PAGES];  // the pages pinned for the batch
+    int    numPages;                // # pinned pages
+    int    keys[BATCH_SIZE];        // the keys of the batch
+    const char* values[BATCH_SIZE]; // the values of the batch
+
+    // unpin the pages of the last batch
+    void unpinPages();
+
+    Scanner(const Scanner&);
+    Scanner& operator=(const Scanner&);
+  };
+
+  /**
+   * @return the page format of the file
+   */
+  Format getFormat() const { return format; }
+
+  /**
+   * @return the record id of the first record of the RecordFile.
+   *         equal to endRid() if the file is empty
+   */
+  RecordId beginRid() const;
+
   /**
    * note the +1 part. The rid of the last record is endRid()-1.
    * @return (last record id + 1) of the RecordFile
    */
   const RecordId& endRid() const;
 
+  /**
+   * get # records in a page. the records of page pid have the sids from 0
+   * to count-1. unlike the FIXED format, where every page but the last
+   * one is full, a SLOTTED page holds as many records as fit into it, so
+   * its count is read from the page.
+   * @param pid[IN] the page to count
+   * @param count[OUT] # records in the page. 0 if the page holds none
+   * @return error code. 0 if no error
+   */
+  RC getPageRecordCount(PageId pid, int& count) const;
+
  private:
   PageFile pf;     // the PageFile used to store the records
   RecordId erid;   // the last record id of the file + 1
+  Format format;   // the page format of the file
 };
 
 #endif // RECORDFILE_H
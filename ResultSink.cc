@@ -0,0 +1,165 @@
+#include "ResultSink.h"
+#include <cstring>
+#include <strings.h>
+
+using namespace std;
+
+// the length of the row that ends a BINARY result
+static const unsigned END_OF_RESULT = 0xffffffff;
+
+// "00" "01" ... "99", so that an integer is formatted two digits at a time
+static const char DIGIT_PAIRS[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+// append the decimal form of n to buf. unlike printf(), this does not
+// look at the locale or parse a format string
+static void appendInt(int n, string& buf)
+{
+  char digits[16];
+  char* p = digits + sizeof(digits);
+  unsigned v = n < 0 ? 0u - (unsigned) n : (unsigned) n;
+
+  while (v >= 100) {
+    p -= 2;
+    memcpy(p, DIGIT_PAIRS + 2 * (v % 100), 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    p -= 2;
+    memcpy(p, DIGIT_PAIRS + 2 * v, 2);
+  } else {
+    *--p = '0' + v;
+  }
+  if (n < 0) *--p = '-';
+
+  buf.append(p, digits + sizeof(digits) - p);
+}
+
+// append n as 4 little-endian bytes to buf
+static void appendInt32(unsigned n, string& buf)
+{
+  char b[4] = { (char) n, (char) (n >> 8), (char) (n >> 16), (char) (n >> 24) };
+  buf.append(b, 4);
+}
+
+// append a value to buf with the TSV escapes
+static void appendEscaped(const char* value, string& buf)
+{
+  const char* s = value;
+
+  while (1) {
+    // copy the run of characters that need no escape at once
+    size_t n = strcspn(s, "\\\t\n\r");
+    buf.append(s, n);
+    s += n;
+
+    switch (*s) {
+    case 0:    return;
+    case '\\': buf.append("\\\\"); break;
+    case '\t': buf.append("\\t"); break;
+    case '\n': buf.append("\\n"); break;
+    case '\r': buf.append("\\r"); break;
+    }
+    s++;
+  }
+}
+
+ResultSink::ResultSink(FILE* out, Format format) : out(out), format(format)
+{
+  buf.reserve(BUFFER_SIZE);
+}
+
+ResultSink::~ResultSink()
+{
+  flush();
+}
+
+void ResultSink::formatRow(Format format, int attr, int key, const char* value, string& buf)
+{
+  switch (format) {
+  case TEXT:
+    switch (attr) {
+    case 1:  // SELECT key
+      appendInt(key, buf);
+      break;
+    case 2:  // SELECT value
+      buf.append(value);
+      break;
+    case 3:  // SELECT *
+      appendInt(key, buf);
+      buf.append(" '");
+      buf.append(value);
+      buf += '\'';
+      break;
+    }
+    buf += '\n';
+    break;
+
+  case TSV:
+    if (attr != 2) appendInt(key, buf);
+    if (attr == 3) buf += '\t';
+    if (attr != 1) appendEscaped(value, buf);
+    buf += '\n';
+    break;
+
+  case BINARY: {
+    int len = attr == 1 ? 0 : strlen(value);
+    if (attr != 2) len += 4;
+
+    appendInt32(len, buf);
+    if (attr != 2) appendInt32(key, buf);
+    if (attr != 1) buf.append(value, attr == 2 ? len : len - 4);
+    break;
+  }
+  }
+}
+
+void ResultSink::addRows(const string& rows)
+{
+  // a large block of rows is written as is instead of being copied
+  if (buf.size() + rows.size() > BUFFER_SIZE) {
+    flush();
+    if ((int) rows.size() >= BUFFER_SIZE) {
+      fwrite(rows.data(), 1, rows.size(), out);
+      return;
+    }
+  }
+  buf.append(rows);
+}
+
+void ResultSink::addCount(int count)
+{
+  if (format == BINARY) {
+    appendInt32(4, buf);
+    appendInt32(count, buf);
+  } else {
+    appendInt(count, buf);
+    buf += '\n';
+  }
+}
+
+void ResultSink::finish()
+{
+  if (format == BINARY) appendInt32(END_OF_RESULT, buf);
+  flush();
+}
+
+void ResultSink::flush()
+{
+  if (!buf.empty()) {
+    fwrite(buf.data(), 1, buf.size(), out);
+    buf.clear();
+  }
+}
+
+bool ResultSink::parseFormat(const char* name, Format& format)
+{
+  if (strcasecmp(name, "text") == 0) format = TEXT;
+  else if (strcasecmp(name, "tsv") == 0) format = TSV;
+  else if (strcasecmp(name, "binary") == 0) format = BINARY;
+  else return false;
+
+  return true;
+}
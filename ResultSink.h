@@ -0,0 +1,109 @@
+#ifndef RESULTSINK_H
+#define RESULTSINK_H
+
+#include <cstdio>
+#include <string>
+
+/**
+ * The destination of the tuples selected by a SELECT. Rows are formatted
+ * into a large memory buffer, which is written to the output stream
+ * only when it fills up and when the result is finished.
+ * There are three formats of rows:
+ *   TEXT:   the console format. "key", "value" or "key 'value'" per line.
+ *   TSV:    tab-separated fields, one row per line. a backslash, tab,
+ *           newline or carriage return in a value is escaped as \\, \t,
+ *           \n or \r.
+ *   BINARY: every row is a 4-byte length followed by that many bytes of
+ *           fields. a key is 4 bytes, a value is the rest of the row.
+ *           integers are little-endian. the result ends with the length
+ *           0xffffffff.
+ * A COUNT(*) result is a single row holding the count.
+ */
+class ResultSink {
+ public:
+  enum Format { TEXT, TSV, BINARY };
+
+  // the # of bytes buffered before they are written out
+  static const int BUFFER_SIZE = 1 << 16;
+
+  /**
+   * @param out[IN] the stream the rows are written to
+   * @param format[IN] the format of the rows
+   */
+  ResultSink(FILE* out, Format format = TEXT);
+
+  /**
+   * the rows not written yet are written, but the result is not finished.
+   */
+  ~ResultSink();
+
+  /**
+   * add a selected tuple.
+   * @param attr[IN] the attribute in the SELECT clause (1: key,
+   *                 2: value, 3: *)
+   * @param key[IN] the key of the tuple
+   * @param value[IN] the null-terminated value of the tuple. it is not
+   *                  looked at for attr 1, so it may be NULL then
+   */
+  void add(int attr, int key, const char* value)
+  {
+    formatRow(format, attr, key, value, buf);
+    if ((int) buf.size() >= BUFFER_SIZE) flush();
+  }
+
+  /**
+   * add rows that were formatted by formatRow() in the format of this
+   * sink, such as the rows of a part of the table scanned by another
+   * thread.
+   * @param rows[IN] the formatted rows
+   */
+  void addRows(const std::string& rows);
+
+  /**
+   * add the result of a COUNT(*).
+   * @param count[IN] the # of matching tuples
+   */
+  void addCount(int count);
+
+  /**
+   * write out the buffered rows and end the result.
+   */
+  void finish();
+
+  /**
+   * write out the buffered rows.
+   */
+  void flush();
+
+  Format getFormat() const { return format; }
+
+  /**
+   * format a selected tuple as a row and append it to a buffer.
+   * @param format[IN] the format of the row
+   * @param attr[IN] the attribute in the SELECT clause
+   * @param key[IN] the key of the tuple
+   * @param value[IN] the null-terminated value of the tuple
+   * @param buf[IN/OUT] the buffer the row is appended to
+   */
+  static void formatRow(Format format, int attr, int key, const char* value,
+                        std::string& buf);
+
+  /**
+   * parse the name of a format ("text", "tsv" or "binary").
+   * @param name[IN] the name of the format
+   * @param format[OUT] the format
+   * @return true if the name is known
+   */
+  static bool parseFormat(const char* name, Format& format);
+
+ private:
+  FILE* out;
+  Format format;
+  std::string buf;  // the rows not written yet
+
+  // forbid copying
+  ResultSink(const ResultSink&);
+  ResultSink& operator=(const ResultSink&);
+};
+
+#endif // RESULTSINK_H
@@ -10,229 +10,1311 @@
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <cerrno>
 #include <iostream>
-#include <fstream>
 #include <climits>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "Bruinbase.h"
 #include "SqlEngine.h"
 #include "BTreeIndex.h"
+#include "KeyCompare.h"
 
 using namespace std;
 
-// external functions and variables for load file and sql command parsing 
-extern FILE* sqlin;
-int sqlparse(void);
+// external functions for sql command parsing. the scanner generated by
+// flex from SqlParser.l and the parser generated by bison from
+// SqlParser.y are re-entrant and keep their state in `scanner'
+struct yy_buffer_state;
+int  sqllex_init(void** scanner);
+int  sqllex_destroy(void* scanner);
+void sqlset_in(FILE* in, void* scanner);
+yy_buffer_state* sql_scan_string(const char* str, void* scanner);
+void sql_delete_buffer(yy_buffer_state* buffer, void* scanner);
+int  sqlparse(void* scanner, SqlSession* session);
 
+// full table scans and LOADs use all cores unless told otherwise
+atomic<int> SqlEngine::threads(thread::hardware_concurrency() > 0 ? thread::hardware_concurrency() : 1);
+
+// tuples are printed in the console format unless told otherwise
+atomic<ResultSink::Format> SqlEngine::outputFormat(ResultSink::TEXT);
+
+
+RC SqlSession::select(int attr, const string& table, const vector<SelCond>& conds)
+{
+  return SqlEngine::select(attr, table, conds, out);
+}
+
+RC SqlSession::load(const string& table, const string& loadfile, bool index)
+{
+  return SqlEngine::load(table, loadfile, index);
+}
 
 RC SqlEngine::run(FILE* commandline)
 {
+  SqlSession session(stdout);
+  void* scanner;
+
   fprintf(stdout, "Bruinbase> ");
 
   // set the command line input and start parsing user input
-  sqlin = commandline;
-  sqlparse();  // sqlparse() is defined in SqlParser.tab.c generated from
-               // SqlParser.y by bison (bison is GNU equivalent of yacc)
+  if (sqllex_init(&scanner)) return RC_FILE_OPEN_FAILED;
+  sqlset_in(commandline, scanner);
+  sqlparse(scanner, &session);  // sqlparse() is defined in SqlParser.tab.c generated from
+                                // SqlParser.y by bison (bison is GNU equivalent of yacc)
+  sqllex_destroy(scanner);
 
   return 0;
 }
 
-RC SqlEngine::select(int attr, const string& table, const vector<SelCond>& cond)
+RC SqlEngine::execute(const string& commands, SqlSession& session)
 {
-  RecordFile rf;   // RecordFile containing the table
-  RecordId   rid;  // record cursor for table scanning
+  void* scanner;
+  yy_buffer_state* buffer;
 
-  RC     rc;
-  int    key;     
-  string value;
-  int    count;
-  int    diff;
-  int    tmp;
+  // scan the commands from the string instead of a file
+  if (sqllex_init(&scanner)) return RC_FILE_OPEN_FAILED;
+  buffer = sql_scan_string(commands.c_str(), scanner);
+  sqlparse(scanner, &session);
+  sql_delete_buffer(buffer, scanner);
+  sqllex_destroy(scanner);
 
-  // open the table file
-  if ((rc = rf.open(table + ".tbl", 'r')) < 0) {
-    fprintf(stderr, "Error: table %s does not exist\n", table.c_str());
-    return rc;
+  return 0;
+}
+
+void SqlEngine::setThreads(int n)
+{
+  threads = n > 0 ? n : 1;
+}
+
+int SqlEngine::getThreads()
+{
+  return threads;
+}
+
+void SqlEngine::setOutputFormat(ResultSink::Format format)
+{
+  outputFormat = format;
+}
+
+ResultSink::Format SqlEngine::getOutputFormat()
+{
+  return outputFormat;
+}
+
+//
+// batch evaluation of the conditions of a full table scan.
+// the tuples of a batch that still qualify are marked in a selection
+// bitmap: bit i of word i/64 stands for the i'th tuple of the batch.
+//
+
+typedef KeyCompare::Word SelWord;
+
+const int SEL_WORD_BITS = KeyCompare::WORD_BITS;
+const int SEL_WORDS = RecordFile::Scanner::BATCH_SIZE / SEL_WORD_BITS;
+
+// whether a comparison result diff (<0, 0 or >0) meets the comparator.
+// C is known at compile time, so the switch folds away
+template <SelCond::Comparator C>
+static inline bool meets(int diff)
+{
+  switch (C) {
+  case SelCond::EQ: return diff == 0;
+  case SelCond::NE: return diff != 0;
+  case SelCond::LT: return diff < 0;
+  case SelCond::GT: return diff > 0;
+  case SelCond::LE: return diff <= 0;
+  case SelCond::GE: return diff >= 0;
   }
+  return false;
+}
 
-  // open index file, if it exists and is needed
-  bool using_index = false; // flag for index searching
-  bool read_tuple = attr == 2 || attr == 3;  // flag for whether to read in tuple from disk
-  BTreeIndex bti;
-  for (int i = 0; i < cond.size(); ++i) {
-    // we only use the index when we have a condition on key attribute that
-    // isn't "SelCond::NE"
-    if (!using_index && cond[i].attr == 1 && cond[i].comp != SelCond::NE) {
-      // we want to use the index
-      //fprintf(stderr, "select: using index\n");
-      if (rc = bti.open(table + ".idx", 'r')) { // error opening
-        // error opening
-        fprintf(stderr, "Error opening index file\n");
-      } else { // open successful
-        //fprintf(stderr, "open index file successful\n");
-        using_index = true;
-      }
-    }
+// the bits of the keys that meet the comparator, given the bits of the
+// keys that are less than and equal to the condition value
+template <SelCond::Comparator C>
+static inline SelWord keyMask(SelWord lt, SelWord eq)
+{
+  switch (C) {
+  case SelCond::EQ: return eq;
+  case SelCond::NE: return ~eq;
+  case SelCond::LT: return lt;
+  case SelCond::GT: return ~(lt | eq);
+  case SelCond::LE: return lt | eq;
+  case SelCond::GE: return ~lt;
+  }
+  return 0;
+}
 
-    if (!read_tuple && (cond[i].attr == 2)) {
-      read_tuple = true;
-    }
+// clear the bits of the tuples whose key does not meet the condition
+template <SelCond::Comparator C>
+static void filterKeys(const int* keys, int n, int val, SelWord* sel)
+{
+  SelWord lt[SEL_WORDS], eq[SEL_WORDS];
+  int words = (n + SEL_WORD_BITS - 1) / SEL_WORD_BITS;
+
+  memset(lt, 0, words * sizeof(SelWord));
+  memset(eq, 0, words * sizeof(SelWord));
+  KeyCompare::compare(keys, n, val, lt, eq);
+
+  // the bits past the n'th tuple are already clear in sel
+  for (int w = 0; w < words; w++) {
+    sel[w] &= keyMask<C>(lt[w], eq[w]);
   }
+}
 
-  // if we're using index, then get key range from conditions
-  int startkey = -1, endkey = INT_MAX, condval;
-  if (using_index) {
-    for (int i = 0; i < cond.size(); ++i) {
-      // skip conditions not on key
-      if (cond[i].attr != 1)
-        continue;
+// check the key of a single tuple
+template <SelCond::Comparator C>
+static bool testKey(int key, int val)
+{
+  return meets<C>(key < val ? -1 : (key > val ? 1 : 0));
+}
 
-      condval = atoi(cond[i].value);
-      switch (cond[i].comp) {
-      case SelCond::EQ:
-        startkey = endkey = condval;
-        break;
-      case SelCond::GT: // >n is equiv to >=n+1
-        condval++;
-      case SelCond::GE:
-        startkey = condval > startkey ? condval : startkey;
-        break;
-      case SelCond::LT: // <n is equiv to <=n-1
-        condval--;
-      case SelCond::LE:
-        endkey = condval < endkey ? condval : endkey;
-        break;
-      }
+// clear the bits of the tuples whose value does not meet the condition.
+// only the tuples that are still selected are compared
+template <SelCond::Comparator C>
+static void filterValues(const char* const* values, int n, const char* val, SelWord* sel)
+{
+  int words = (n + SEL_WORD_BITS - 1) / SEL_WORD_BITS;
+
+  for (int w = 0; w < words; w++) {
+    for (SelWord m = sel[w]; m; m &= m - 1) {
+      int i = w * SEL_WORD_BITS + __builtin_ctzll(m);
+      if (!meets<C>(strcmp(values[i], val))) sel[w] &= ~(m & -m);
     }
   }
-  if (startkey == -1)
-    startkey = 0;
-  if (endkey == INT_MAX)
-    endkey = 14000; // lol TODO: set this to highest key?
+}
 
-  //fprintf(stderr, "select: starting select loop. startkey=%d, endkey=%d\n", startkey, endkey);
-  // start searching tuples
-  IndexCursor cursor;
-  rid.pid = rid.sid = 0; // rid traversal
-  count = 0;
-  key = startkey;
-  while (1) {
-    // 0. check exit conditions
-    if (!(rid < rf.endRid()))
+// check the value of a single tuple
+template <SelCond::Comparator C>
+static bool testValue(const char* value, const char* val)
+{
+  return meets<C>(strcmp(value, val));
+}
+
+//
+// the conditions of a query, compiled once before any tuple is read.
+// the key conditions are merged into a range of keys and the value
+// conditions into a range of values, each with the constants to skip.
+// contradicting conditions are found here, so such a query reads
+// nothing. what is left becomes a list of tests, each specialized for
+// its comparator, with the most selective tests first.
+//
+
+// a compiled condition on the key
+struct KeyTest {
+  int val;  // the constant to compare with
+  void (*filter)(const int* keys, int n, int val, SelWord* sel);  // for a batch
+  bool (*test)(int key, int val);                                // for a tuple
+};
+
+// a compiled condition on the value
+struct ValueTest {
+  const char* val;  // the constant to compare with
+  void (*filter)(const char* const* values, int n, const char* val, SelWord* sel);
+  bool (*test)(const char* value, const char* val);
+};
+
+template <SelCond::Comparator C>
+static KeyTest makeKeyTest(int val)
+{
+  KeyTest t = { val, filterKeys<C>, testKey<C> };
+  return t;
+}
+
+template <SelCond::Comparator C>
+static ValueTest makeValueTest(const char* val)
+{
+  ValueTest t = { val, filterValues<C>, testValue<C> };
+  return t;
+}
+
+struct SelPlan {
+  bool empty;       // the conditions contradict each other. nothing matches
+  bool keyRange;    // there is a key condition the index can be used for
+  int  keyLo;       // every matching key is in [keyLo, keyHi]
+  int  keyHi;
+  vector<int>       skipKeys;    // the keys inside [keyLo, keyHi] that do
+                                 // not match, sorted
+  bool valueRange;  // there is a value condition the value index can be used for
+  const char* valueLo;  // every matching value is in [valueLo, valueHi].
+  const char* valueHi;  // NULL for no bound. equal for a single value
+  vector<KeyTest>   keyTests;    // the tests on the key, cheap ones first
+  vector<ValueTest> valueTests;  // the tests on the value, selective ones first
+
+  void compile(const vector<SelCond>& cond);
+  void compileKeys(const vector<SelCond>& cond);
+  void compileValues(const vector<SelCond>& cond);
+
+  // check all conditions on a single tuple
+  bool matches(int key, const char* value) const { return matchesKey(key) && matchesValue(value); }
+
+  // check the conditions on the key or on the value alone
+  bool matchesKey(int key) const;
+  bool matchesValue(const char* value) const;
+};
+
+void SelPlan::compile(const vector<SelCond>& cond)
+{
+  empty = false;
+  skipKeys.clear();
+  valueRange = false;
+  valueLo = valueHi = NULL;
+  keyTests.clear();
+  valueTests.clear();
+
+  compileKeys(cond);
+  if (!empty) compileValues(cond);
+}
+
+void SelPlan::compileKeys(const vector<SelCond>& cond)
+{
+  vector<int> ne;  // the keys to skip
+  int condval;
+
+  // merge the key conditions into [keyLo, keyHi]
+  keyRange = false;
+  keyLo = INT_MIN;
+  keyHi = INT_MAX;
+  for (unsigned i = 0; i < cond.size(); ++i) {
+    // skip conditions not on key
+    if (cond[i].attr != 1)
+      continue;
+
+    condval = atoi(cond[i].value);
+    if (cond[i].comp != SelCond::NE)
+      keyRange = true;
+
+    switch (cond[i].comp) {
+    case SelCond::EQ:
+      keyLo = condval > keyLo ? condval : keyLo;
+      keyHi = condval < keyHi ? condval : keyHi;
+      break;
+    case SelCond::NE:
+      ne.push_back(condval);
       break;
-    if (!(key <= endkey)) {
-      //fprintf(stderr, "select: key == endkey. breaking out of loop\n");
+    case SelCond::GT: // >n is equiv to >=n+1
+      if (condval == INT_MAX) { empty = true; return; }
+      condval++;
+    case SelCond::GE:
+      keyLo = condval > keyLo ? condval : keyLo;
+      break;
+    case SelCond::LT: // <n is equiv to <=n-1
+      if (condval == INT_MIN) { empty = true; return; }
+      condval--;
+    case SelCond::LE:
+      keyHi = condval < keyHi ? condval : keyHi;
       break;
     }
-    //fprintf(stderr, "select: loop iter. key=%d\n", key);
-
-    // 1. fetch tuple, by key or by rid depending on `using_index`
-    if (using_index) {
-      if (rc = bti.locate(key, cursor)) { // not found or error
-        // check if record not found or actual error
-        if (rc == RC_NO_SUCH_RECORD) {
-          goto next_tuple; // not sure if this is the best thing to do
-        } else { // actual error
-          fprintf(stderr, "bti.locate returned actual error\n");
-          return rc; // unrecoverable so just panic and return?
-        }
+  }
+
+  // a skipped key at either end narrows the range
+  bool narrowed = true;
+  while (narrowed && keyLo <= keyHi) {
+    narrowed = false;
+    for (unsigned i = 0; i < ne.size(); i++) {
+      if (ne[i] == keyLo) {
+        if (keyLo == keyHi) { empty = true; return; }
+        keyLo++;
+        narrowed = true;
+      } else if (ne[i] == keyHi) {
+        keyHi--;
+        narrowed = true;
       }
+    }
+  }
+  if (keyLo > keyHi) {
+    empty = true;
+    return;
+  }
+
+  // the range needs one test per bound, a single key only one
+  if (keyLo == keyHi) {
+    keyTests.push_back(makeKeyTest<SelCond::EQ>(keyLo));
+    return;
+  }
+  if (keyLo > INT_MIN) keyTests.push_back(makeKeyTest<SelCond::GE>(keyLo));
+  if (keyHi < INT_MAX) keyTests.push_back(makeKeyTest<SelCond::LE>(keyHi));
+
+  // the keys to skip outside of the range are already skipped
+  for (unsigned i = 0; i < ne.size(); i++) {
+    if (ne[i] > keyLo && ne[i] < keyHi) skipKeys.push_back(ne[i]);
+  }
+  sort(skipKeys.begin(), skipKeys.end());
+  skipKeys.erase(unique(skipKeys.begin(), skipKeys.end()), skipKeys.end());
+  for (unsigned i = 0; i < skipKeys.size(); i++) {
+    keyTests.push_back(makeKeyTest<SelCond::NE>(skipKeys[i]));
+  }
+}
+
+void SelPlan::compileValues(const vector<SelCond>& cond)
+{
+  const char* eq = NULL;     // the only value to match, if any
+  const char* lo = NULL;     // the lower bound of the values, if any
+  const char* hi = NULL;     // the upper bound of the values, if any
+  bool loStrict = false;     // true if lo itself does not match
+  bool hiStrict = false;     // true if hi itself does not match
+  vector<const char*> ne;    // the values to skip
+  int c;
 
-      // record was found
+  // merge the value conditions into the tightest bounds
+  for (unsigned i = 0; i < cond.size(); ++i) {
+    if (cond[i].attr != 2)
+      continue;
 
-      if (rc = bti.readForward(cursor, tmp, rid)) { // error
-        fprintf(stderr, "bti.readForward returned nonzero\n");
-        return rc; //exit? lol
+    const char* v = cond[i].value;
+    switch (cond[i].comp) {
+    case SelCond::EQ:
+      if (eq != NULL && strcmp(eq, v) != 0) { empty = true; return; }
+      eq = v;
+      break;
+    case SelCond::NE:
+      ne.push_back(v);
+      break;
+    case SelCond::GT:
+    case SelCond::GE:
+      if (lo == NULL || (c = strcmp(v, lo)) > 0 || (c == 0 && cond[i].comp == SelCond::GT)) {
+        lo = v;
+        loStrict = cond[i].comp == SelCond::GT;
       }
+      break;
+    case SelCond::LT:
+    case SelCond::LE:
+      if (hi == NULL || (c = strcmp(v, hi)) < 0 || (c == 0 && cond[i].comp == SelCond::LT)) {
+        hi = v;
+        hiStrict = cond[i].comp == SelCond::LT;
+      }
+      break;
     }
+  }
 
-    // read the tuple
-    // TODO: only read tuple if we need to
-    if (read_tuple) {
-      if ((rc = rf.read(rid, key, value)) < 0) {
-        fprintf(stderr, "Error: while reading a tuple from table %s\n", table.c_str());
-        goto exit_select;
-      }
+  // bounds that meet in one point leave a single value
+  if (eq == NULL && lo != NULL && hi != NULL && strcmp(lo, hi) == 0 && !loStrict && !hiStrict)
+    eq = lo;
+
+  if (eq != NULL) {
+    // a single value matches. the other conditions are checked on it
+    // right here, so a tuple only needs one comparison
+    if (lo != NULL && (c = strcmp(eq, lo)) < (loStrict ? 1 : 0)) { empty = true; return; }
+    if (hi != NULL && (c = strcmp(eq, hi)) > (hiStrict ? -1 : 0)) { empty = true; return; }
+    for (unsigned i = 0; i < ne.size(); i++) {
+      if (strcmp(eq, ne[i]) == 0) { empty = true; return; }
     }
+    valueTests.push_back(makeValueTest<SelCond::EQ>(eq));
+    valueRange = true;
+    valueLo = valueHi = eq;
+    return;
+  }
 
-    // 2. check the conditions on the tuple
-    for (unsigned i = 0; i < cond.size(); i++) {
-      // compute the difference between the tuple value and the condition value
-      switch (cond[i].attr) {
-      case 1:
-        diff = key - atoi(cond[i].value);
-        break;
-      case 2:
-        diff = strcmp(value.c_str(), cond[i].value);
-        break;
+  if (lo != NULL && hi != NULL && ((c = strcmp(lo, hi)) > 0 || (c == 0 && (loStrict || hiStrict)))) {
+    empty = true;
+    return;
+  }
+
+  valueRange = lo != NULL || hi != NULL;
+  valueLo = lo;
+  valueHi = hi;
+
+  // the bounds go before the values to skip, which rarely reject a tuple
+  if (lo != NULL) valueTests.push_back(loStrict ? makeValueTest<SelCond::GT>(lo) : makeValueTest<SelCond::GE>(lo));
+  if (hi != NULL) valueTests.push_back(hiStrict ? makeValueTest<SelCond::LT>(hi) : makeValueTest<SelCond::LE>(hi));
+  for (unsigned i = 0; i < ne.size(); i++) {
+    valueTests.push_back(makeValueTest<SelCond::NE>(ne[i]));
+  }
+}
+
+bool SelPlan::matchesKey(int key) const
+{
+  for (unsigned i = 0; i < keyTests.size(); i++) {
+    if (!keyTests[i].test(key, keyTests[i].val)) return false;
+  }
+  return true;
+}
+
+bool SelPlan::matchesValue(const char* value) const
+{
+  for (unsigned i = 0; i < valueTests.size(); i++) {
+    if (!valueTests[i].test(value, valueTests[i].val)) return false;
+  }
+  return true;
+}
+
+//
+// parallel full table scan. the pages of the table are split into
+// morsels, which the scan threads take from work-stealing queues.
+// the rows of every morsel are formatted into its own buffer, and the
+// buffers are added to the result in page order.
+//
+
+// the # of pages in a morsel
+const int MORSEL_PAGES = 64;
+
+// scan the pages [begin, end) of the table, format the tuples that meet
+// all conditions into buf and count them
+static RC scanPages(int attr, ResultSink::Format format, const RecordFile& rf,
+                    const SelPlan& plan, PageId begin, PageId end, string& buf, int& count)
+{
+  RC   rc;
+  RecordFile::Scanner scanner(rf, begin, end);
+  const int* keys;
+  const char* const* values;
+  int  n;
+  SelWord sel[SEL_WORDS];
+
+  count = 0;
+  while ((rc = scanner.nextBatch(keys, values, n)) == 0 && n > 0) {
+    int words = (n + SEL_WORD_BITS - 1) / SEL_WORD_BITS;
+
+    // select the n tuples of the batch
+    memset(sel, 0, words * sizeof(SelWord));
+    for (int i = 0; i < n / SEL_WORD_BITS; i++) sel[i] = ~(SelWord) 0;
+    if (n % SEL_WORD_BITS) sel[n / SEL_WORD_BITS] = ((SelWord) 1 << (n % SEL_WORD_BITS)) - 1;
+
+    // the key tests go first. they are cheap, and the value tests then
+    // only look at the tuples that are left
+    for (unsigned i = 0; i < plan.keyTests.size(); i++) {
+      plan.keyTests[i].filter(keys, n, plan.keyTests[i].val, sel);
+    }
+    for (unsigned i = 0; i < plan.valueTests.size(); i++) {
+      plan.valueTests[i].filter(values, n, plan.valueTests[i].val, sel);
+    }
+
+    // print the selected tuples
+    for (int w = 0; w < words; w++) {
+      count += __builtin_popcountll(sel[w]);
+      if (attr == 4) continue;
+
+      for (SelWord m = sel[w]; m; m &= m - 1) {
+        int i = w * SEL_WORD_BITS + __builtin_ctzll(m);
+        ResultSink::formatRow(format, attr, keys[i], values[i], buf);
       }
+    }
+  }
 
-      // skip the tuple if any condition is not met
-      switch (cond[i].comp) {
-      case SelCond::EQ:
-        if (diff != 0) goto next_tuple;
-        break;
-      case SelCond::NE:
-        if (diff == 0) goto next_tuple;
-        break;
-      case SelCond::GT:
-        if (diff <= 0) goto next_tuple;
-        break;
-      case SelCond::LT:
-        if (diff >= 0) goto next_tuple;
-          break;
-      case SelCond::GE:
-        if (diff < 0) goto next_tuple;
-        break;
-      case SelCond::LE:
-        if (diff > 0) goto next_tuple;
-        break;
+  return rc;
+}
+
+/**
+ * hands out the morsels of a scan. every thread has a queue of morsels,
+ * dealt round-robin, and takes the lowest one from its own queue. a
+ * thread whose queue is empty steals the highest morsel of another
+ * queue. so the morsels are mostly done in page order and the buffers
+ * waiting to be written stay few.
+ */
+class MorselQueue {
+ public:
+  MorselQueue(int numMorsels, int numThreads) : queues(numThreads)
+  {
+    for (int i = 0; i < numMorsels; i++) {
+      queues[i % numThreads].morsels.push_back(i);
+    }
+  }
+
+  // get the next morsel for a thread. false if all morsels are taken
+  bool next(int thread, int& morsel)
+  {
+    int n = queues.size();
+
+    for (int i = 0; i < n; i++) {
+      Queue& q = queues[(thread + i) % n];
+      lock_guard<mutex> lock(q.mutex);
+      if (q.morsels.empty()) continue;
+
+      if (i == 0) {
+        morsel = q.morsels.front();
+        q.morsels.pop_front();
+      } else {
+        morsel = q.morsels.back();
+        q.morsels.pop_back();
       }
+      return true;
     }
+    return false;
+  }
 
-    // the condition is met for the tuple. 
+ private:
+  struct Queue {
+    std::mutex mutex;
+    deque<int> morsels;
+  };
+  vector<Queue> queues;
+};
 
-    // 3. increase matching tuple counter
-    count++;
+// the state shared by the threads of a parallel scan
+struct ParallelScan {
+  int attr;
+  ResultSink::Format format;
+  const RecordFile* rf;
+  const SelPlan* plan;
+  PageId begin, end;   // the pages to scan
 
-    // 4. print the tuple
-    switch (attr) {
-    case 1:  // SELECT key
-      fprintf(stdout, "%d\n", key);
-      break;
-    case 2:  // SELECT value
-      fprintf(stdout, "%s\n", value.c_str());
-      break;
-    case 3:  // SELECT *
-      fprintf(stdout, "%d '%s'\n", key, value.c_str());
+  MorselQueue queue;
+  atomic<bool> stop;   // set when the scan is given up
+
+  // the results of the morsels, protected by the mutex
+  std::mutex mutex;
+  condition_variable done;
+  vector<string> output;
+  vector<int> counts;
+  vector<RC> rcs;
+  vector<char> finished;
+
+  ParallelScan(int numMorsels, int numThreads)
+    : queue(numMorsels, numThreads), stop(false), output(numMorsels),
+      counts(numMorsels, 0), rcs(numMorsels, 0), finished(numMorsels, 0) { }
+};
+
+static void scanWorker(ParallelScan& scan, int thread)
+{
+  int morsel;
+
+  while (!scan.stop && scan.queue.next(thread, morsel)) {
+    string buf;
+    int count;
+    PageId begin = scan.begin + morsel * MORSEL_PAGES;
+    PageId end = min(begin + MORSEL_PAGES, scan.end);
+
+    RC rc = scanPages(scan.attr, scan.format, *scan.rf, *scan.plan, begin, end, buf, count);
+
+    lock_guard<mutex> lock(scan.mutex);
+    scan.output[morsel].swap(buf);
+    scan.counts[morsel] = count;
+    scan.rcs[morsel] = rc;
+    scan.finished[morsel] = 1;
+    scan.done.notify_all();
+  }
+}
+
+// scan the whole table, add the tuples that meet all conditions to the
+// result and count them
+static RC scanTable(int attr, const RecordFile& rf, const SelPlan& plan, ResultSink& sink, int& count)
+{
+  RC rc = 0;
+
+  // the last page holding records is the page of the end record id,
+  // unless that page is still empty
+  PageId begin = rf.beginRid().pid;
+  PageId end = rf.endRid().pid + (rf.endRid().sid > 0 ? 1 : 0);
+  int morsels = end > begin ? (end - begin + MORSEL_PAGES - 1) / MORSEL_PAGES : 0;
+  int threads = min(SqlEngine::getThreads(), morsels);
+
+  count = 0;
+
+  // a small table is scanned by this thread alone
+  if (threads <= 1) {
+    string buf;
+    int n;
+
+    for (PageId pid = begin; pid < end; pid += MORSEL_PAGES) {
+      if ((rc = scanPages(attr, sink.getFormat(), rf, plan, pid, min(pid + MORSEL_PAGES, end), buf, n)) < 0) return rc;
+      sink.addRows(buf);
+      buf.clear();
+      count += n;
+    }
+    return 0;
+  }
+
+  ParallelScan scan(morsels, threads);
+  scan.attr = attr;
+  scan.format = sink.getFormat();
+  scan.rf = &rf;
+  scan.plan = &plan;
+  scan.begin = begin;
+  scan.end = end;
+
+  vector<thread> workers;
+  for (int i = 0; i < threads; i++) {
+    workers.push_back(thread(scanWorker, std::ref(scan), i));
+  }
+
+  // add the morsels to the result in page order as they are finished
+  for (int i = 0; i < morsels; i++) {
+    string buf;
+    {
+      unique_lock<mutex> lock(scan.mutex);
+      while (!scan.finished[i]) scan.done.wait(lock);
+      scan.output[i].swap(buf);
+      rc = scan.rcs[i];
+    }
+    if (rc < 0) {
+      scan.stop = true;
       break;
     }
+    sink.addRows(buf);
+    count += scan.counts[i];
+  }
+
+  for (unsigned i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+
+  return rc;
+}
+
+// true if the SELECT is answered by the keys in the index alone: only
+// the key or COUNT(*) is selected, and all conditions are on the key
+static bool keysOnly(int attr, const SelPlan& plan)
+{
+  return (attr == 1 || attr == 4) && plan.valueTests.empty();
+}
+
+// answer a SELECT for which keysOnly() holds from the index alone.
+// a COUNT(*) is answered by BTreeIndex::countRange(), which only descends
+// the tree if the index is counted. the keys are read from the leaves a
+// whole leaf at a time, and since they are sorted, the range and the
+// skipped keys are found by binary search instead of testing every key
+static RC scanIndex(int attr, BTreeIndex& index, const SelPlan& plan, ResultSink& sink, int& count)
+{
+  RC   rc;
+  BTreeIndex::Scanner scanner(index);
+  const int* keys;
+  const RecordId* rids;
+  int  n;
+  bool last = false;
+
+  count = 0;
+  if (attr == 4) {
+    if ((rc = index.countRange(plan.keyLo, plan.keyHi, count)) < 0) return rc;
+
+    // take off the skipped keys
+    for (unsigned i = 0; i < plan.skipKeys.size(); i++) {
+      if ((rc = index.countRange(plan.skipKeys[i], plan.skipKeys[i], n)) < 0) return rc;
+      count -= n;
+    }
+    return 0;
+  }
+
+  if ((rc = scanner.open(plan.keyLo)) < 0) return rc;
+
+  while (!last && (rc = scanner.nextBatch(INT_MAX, keys, rids, n)) == 0) {
+    // the first key past keyHi ends the scan
+    if (keys[n - 1] > plan.keyHi) {
+      n = upper_bound(keys, keys + n, plan.keyHi) - keys;
+      last = true;
+    }
+    if (n == 0) continue;
+
+    // the skipped keys that may be in this leaf
+    vector<int>::const_iterator skip = lower_bound(plan.skipKeys.begin(), plan.skipKeys.end(), keys[0]);
+    vector<int>::const_iterator skipEnd = upper_bound(skip, plan.skipKeys.end(), keys[n - 1]);
+
+    for (int i = 0; i < n; i++) {
+      while (skip != skipEnd && *skip < keys[i]) ++skip;
+      if (skip != skipEnd && *skip == keys[i]) continue;
+
+      count++;
+      sink.add(attr, keys[i], NULL);
+    }
+  }
+
+  return rc == RC_END_OF_TREE ? 0 : rc;
+}
+
+// the # of table pages fetchTuples() reads in one batch
+static const int FETCH_PAGES = 32;
+
+// read the tuples found through an index, given as (pid << 32 | sid),
+// add those whose value meets the conditions to the result and count
+// them. the tuples are sorted first, so the table is read in page order
+// and every page is pinned once for all of its tuples, instead of once
+// per tuple in index order. the pages are brought in FETCH_PAGES at a
+// time with one batch of reads
+static RC fetchTuples(int attr, const RecordFile& rf, const SelPlan& plan,
+                      vector<unsigned long long>& found, ResultSink& sink, int& count)
+{
+  RC rc;
+
+  count = 0;
+  sort(found.begin(), found.end());
+
+  // the pages to read, in order
+  vector<PageId> pages;
+  for (unsigned i = 0; i < found.size(); i++) {
+    PageId pid = found[i] >> 32;
+    if (pages.empty() || pages.back() != pid) pages.push_back(pid);
+  }
+
+  vector<int> sids;
+  vector<int> tupleKeys;
+  vector<const char*> values;
+
+  for (unsigned i = 0, p = 0; i < found.size(); p++) {
+    // read the next batch of pages with all reads in flight at once
+    if (p % FETCH_PAGES == 0) {
+      int batch = pages.size() - p < (unsigned) FETCH_PAGES ? pages.size() - p : FETCH_PAGES;
+      if ((rc = rf.fetchPages(&pages[p], batch)) < 0) return rc;
+    }
+
+    // the slots of the next page
+    PageId pid = pages[p];
+    sids.clear();
+    for (; i < found.size() && (PageId) (found[i] >> 32) == pid; i++) {
+      sids.push_back((int) (found[i] & 0xffffffff));
+    }
+    tupleKeys.resize(sids.size());
+    values.resize(sids.size());
+
+    if ((rc = rf.pinPage(pid, &sids[0], sids.size(), &tupleKeys[0], &values[0])) < 0) return rc;
+    for (unsigned j = 0; j < sids.size(); j++) {
+      if (!plan.matchesValue(values[j])) continue;
+      count++;
+      if (attr != 4) sink.add(attr, tupleKeys[j], values[j]);
+    }
+    rf.unpinPage(pid);
+  }
+
+  return 0;
+}
+
+// the prefixes that bound the values of [valueLo, valueHi] in the value
+// index
+static void valuePrefixes(const SelPlan& plan, char* lo, char* hi)
+{
+  ValueIndex::makePrefix(plan.valueLo != NULL ? plan.valueLo : "", lo);
+  if (plan.valueHi != NULL) ValueIndex::makePrefix(plan.valueHi, hi);
+  else memset(hi, 0xff, ValueIndex::PREFIX_LENGTH);
+}
+
+// # of distinct pages that n tuples spread evenly over a table of
+// tablePages pages are on (Cardenas' formula)
+static double distinctPages(double tablePages, double n)
+{
+  return tablePages * (1 - pow(1 - 1 / tablePages, n));
+}
+
+// true if the value index is the better way to the tuples: the value
+// conditions bound the values, either no key range can be read from the
+// key index or a single value is asked for, which usually matches far
+// fewer tuples than a range of keys, and reading the range through the
+// value index takes fewer page reads than scanning the table. the
+// matching entries are counted in the index. the tuples of the values
+// longer than the prefix are read in page order, and their share of the
+// matches is taken to be their share of all entries
+static bool useValueIndex(const RecordFile& rf, BTreeIndex* index, ValueIndex* valueIndex,
+                          const SelPlan& plan)
+{
+  char lo[ValueIndex::PREFIX_LENGTH];
+  char hi[ValueIndex::PREFIX_LENGTH];
+  int  matches;
+
+  if (valueIndex == NULL || !plan.valueRange) return false;
+  if (index != NULL && plan.keyRange && plan.valueLo != plan.valueHi) return false;
+  if (valueIndex->getEntryCount() == 0) return true;
+
+  valuePrefixes(plan, lo, hi);
+  if (valueIndex->countRange(lo, hi, matches) < 0) return false;
+
+  double tablePages = rf.endRid().pid - rf.beginRid().pid + 1;
+  double leafPages = ceil((double) matches / ValueIndex::LEAF_ENTRIES);
+  double fetches = (double) matches * valueIndex->getLongCount() / valueIndex->getEntryCount();
+
+  return valueIndex->getTreeHeight() + leafPages + distinctPages(tablePages, fetches) < tablePages;
+}
+
+// find the tuples whose value is in [valueLo, valueHi] through the value
+// index, add those that meet all conditions to the result and count them.
+// an entry that holds the whole value is checked on its own; the tuples
+// of longer values are read from the table by fetchTuples() to compare
+// the rest of the value
+static RC scanValueIndex(int attr, const RecordFile& rf, ValueIndex& valueIndex,
+                         const SelPlan& plan, ResultSink& sink, int& count)
+{
+  RC   rc;
+  ValueIndex::Scanner scanner(valueIndex);
+  const ValueIndex::Entry* entry;
+  char lo[ValueIndex::PREFIX_LENGTH];
+  char hi[ValueIndex::PREFIX_LENGTH];
+  vector<unsigned long long> found;  // the tuples to read, as (pid, sid)
+
+  // the prefixes of the bounds bound the prefixes of the matching values
+  valuePrefixes(plan, lo, hi);
+
+  count = 0;
+  if ((rc = scanner.open(lo)) < 0) return rc;
+
+  while ((rc = scanner.next(entry)) == 0) {
+    // the entries are sorted, so the first prefix past hi ends the scan
+    if (memcmp(entry->prefix, hi, ValueIndex::PREFIX_LENGTH) > 0) break;
+
+    if (ValueIndex::isComplete(*entry)) {
+      if (!plan.matches(entry->key, entry->prefix)) continue;
+      count++;
+      if (attr != 4) sink.add(attr, entry->key, entry->prefix);
+      continue;
+    }
 
-    // 5. move to the next tuple
-next_tuple:
-    if (using_index)
-      ++key;
-    else
-      ++rid;
+    if (plan.matchesKey(entry->key))
+      found.push_back((unsigned long long) entry->rid.pid << 32 | (unsigned) entry->rid.sid);
   }
+  if (rc < 0 && rc != RC_END_OF_TREE) return rc;
+  scanner.close();
+
+  int fetched;
+  if ((rc = fetchTuples(attr, rf, plan, found, sink, fetched)) < 0) return rc;
+  count += fetched;
+  return 0;
+}
+
+// true if reading the tuples of [keyLo, keyHi] through the index is
+// expected to take fewer page reads than scanning the whole table.
+// the matching entries are estimated from the key histogram of the
+// index. their tuples are taken to be spread evenly over the table, so
+// the pages they are on are counted by Cardenas' formula: a page that
+// holds several of them is read once, since fetchIndexRange() reads the
+// tuples in page order
+static bool indexScanPays(const RecordFile& rf, const BTreeIndex& index, const SelPlan& plan)
+{
+  const BTreeIndex::KeyStats* stats = index.getStats();
+
+  // an index written before statistics were kept is always used
+  if (stats == NULL || stats->entries == 0) return true;
+
+  double tablePages = rf.endRid().pid - rf.beginRid().pid + 1;
+  double matches = index.estimateRange(plan.keyLo, plan.keyHi);
+
+  double leafPages = ceil(matches / stats->entries * stats->leaves);
+  double tuplePages = distinctPages(tablePages, matches);
 
+  return index.getTreeHeight() + leafPages + tuplePages < tablePages;
+}
+
+// read the tuples of [keyLo, keyHi] through the index, add those that
+// meet all conditions to the result and count them. the RecordIds of the
+// entries whose key matches are collected and read by fetchTuples()
+static RC fetchIndexRange(int attr, const RecordFile& rf, BTreeIndex& index, const SelPlan& plan,
+                          ResultSink& sink, int& count)
+{
+  RC   rc;
+  BTreeIndex::Scanner scanner(index);
+  const int* keys;
+  const RecordId* rids;
+  int  n;
+  bool last = false;
+  vector<unsigned long long> found;  // the tuples to read, as (pid, sid)
+
+  count = 0;
+  if ((rc = scanner.open(plan.keyLo)) < 0) return rc;
+
+  while (!last && (rc = scanner.nextBatch(INT_MAX, keys, rids, n)) == 0) {
+    // the first key past keyHi ends the scan
+    if (keys[n - 1] > plan.keyHi) {
+      n = upper_bound(keys, keys + n, plan.keyHi) - keys;
+      last = true;
+    }
+    for (int i = 0; i < n; i++) {
+      if (plan.matchesKey(keys[i]))
+        found.push_back((unsigned long long) rids[i].pid << 32 | (unsigned) rids[i].sid);
+    }
+  }
+  if (rc < 0 && rc != RC_END_OF_TREE) return rc;
+  scanner.close();
+
+  return fetchTuples(attr, rf, plan, found, sink, count);
+}
+
+// execute a compiled SELECT. see SqlEngine::select()
+static RC selectPlan(int attr, const RecordFile& rf, BTreeIndex* index, ValueIndex* valueIndex,
+                     const SelPlan& plan, FILE* out)
+{
+  RC     rc;
+  int    count;
+  ResultSink sink(out, SqlEngine::getOutputFormat()); // buffers the rows
+
+  // start searching tuples
+  count = 0;
+
+  // the conditions contradict each other, so nothing is read
+  if (plan.empty)
+    goto print_count;
+
+  // the keys in the leaves are all we need, so the table is not read.
+  // the leaves are smaller than the table, so this always pays
+  if (index != NULL && keysOnly(attr, plan)) {
+    if ((rc = scanIndex(attr, *index, plan, sink, count)) < 0) {
+      fprintf(stderr, "Error: while reading the index\n");
+      goto exit_select;
+    }
+    goto print_count;
+  }
+
+  // the value conditions narrow the tuples to a range of the value index
+  if (useValueIndex(rf, index, valueIndex, plan)) {
+    if ((rc = scanValueIndex(attr, rf, *valueIndex, plan, sink, count)) < 0) {
+      fprintf(stderr, "Error: while reading the value index\n");
+      goto exit_select;
+    }
+    goto print_count;
+  }
+
+  if (index == NULL || !plan.keyRange || !indexScanPays(rf, *index, plan)) {
+    // without an index, or when the key range holds a large part of
+    // the table, the table is scanned a batch of tuples at a time
+    if ((rc = scanTable(attr, rf, plan, sink, count)) < 0) {
+      fprintf(stderr, "Error: while reading a tuple from the table\n");
+      goto exit_select;
+    }
+    goto print_count;
+  }
+
+  // read the tuples of the key range in page order
+  if ((rc = fetchIndexRange(attr, rf, *index, plan, sink, count)) < 0) {
+    fprintf(stderr, "Error: while reading a tuple from the table\n");
+    goto exit_select;
+  }
+
+print_count:
   // print matching tuple count if "select count(*)"
   if (attr == 4) {
-    fprintf(stdout, "%d\n", count);
+    sink.addCount(count);
   }
   rc = 0;
 
-  // close the table file and return
 exit_select:
+  sink.finish();
+  return rc;
+}
+
+RC SqlEngine::select(int attr, const string& table, const vector<SelCond>& cond, FILE* out)
+{
+  RecordFile rf;   // RecordFile containing the table
+  BTreeIndex bti;  // index of the table, if it exists and is needed
+  bool       has_index = false;
+  ValueIndex vdx;  // value index of the table, if it exists and is needed
+  bool       has_value_index = false;
+  SelPlan    plan; // the compiled conditions
+  RC         rc;
+
+  plan.compile(cond);
+
+  // when nothing can match, the table is not even opened
+  if (plan.empty && access((table + ".tbl").c_str(), F_OK) == 0)
+    return selectPlan(attr, rf, NULL, NULL, plan, out);
+
+  // when the index holds the whole answer, only the index is opened
+  if (keysOnly(attr, plan) && access((table + ".tbl").c_str(), F_OK) == 0 &&
+      bti.open(table + ".idx", 'm') == 0) {
+    rc = selectPlan(attr, rf, &bti, NULL, plan, out);
+    bti.close();
+    return rc;
+  }
+
+  // open the table file. select only reads, so the table and the
+  // index are mapped and their pages are used in place
+  if ((rc = rf.open(table + ".tbl", 'm')) < 0) {
+    fprintf(stderr, "Error: table %s does not exist\n", table.c_str());
+    return rc;
+  }
+
+  // open index file, if it exists and is needed. without an index
+  // we fall back to a full scan
+  if (plan.keyRange && bti.open(table + ".idx", 'm') == 0)
+    has_index = true;
+  if (plan.valueRange && vdx.open(table + ".vidx", 'm') == 0)
+    has_value_index = true;
+
+  rc = selectPlan(attr, rf, has_index ? &bti : NULL, has_value_index ? &vdx : NULL, plan, out);
+
+  // close the table file and return
+  if (has_index)
+    bti.close();
+  if (has_value_index)
+    vdx.close();
   rf.close();
   return rc;
 }
 
+RC SqlEngine::select(int attr, const RecordFile& rf, BTreeIndex* index, ValueIndex* valueIndex,
+                     const vector<SelCond>& cond, FILE* out)
+{
+  SelPlan plan;
+
+  plan.compile(cond);
+  return selectPlan(attr, rf, index, valueIndex, plan, out);
+}
+
+//
+// pipelined LOAD. a reader thread cuts the load file into blocks of
+// whole lines, parser threads turn the blocks into tuples, and the
+// thread running the LOAD stores the tuples in the order of the file.
+// only a few blocks may be in flight at once, so a slow stage holds up
+// the stages before it instead of piling up blocks in memory.
+//
+
+// a block of whole lines of the load file and the tuples parsed from it.
+// the values point into the lines, which are either a part of the
+// mapped load file or the text of the block
+struct LoadBlock {
+  long seq;              // the position of the block in the file
+  const char* begin;     // the lines of the block
+  const char* end;
+  string text;           // the lines, if the file could not be mapped
+  vector<int> keys;      // the tuples parsed from the lines
+  vector<const char*> values;
+  vector<int> lengths;
+  RC rc;                 // the parse error after the tuples. 0 if none
+};
+
+class LoadPipeline {
+ public:
+  // the # of bytes of the file in a block
+  static const int BLOCK_SIZE = 1 << 20;
+
+  /**
+   * start reading and parsing the load file. the file is mapped into
+   * memory if possible and read in blocks otherwise.
+   * @param fd[IN] the load file, open for reading. it is closed by
+   *               the destructor
+   * @param numParsers[IN] # of parser threads
+   */
+  LoadPipeline(int fd, int numParsers);
+
+  /**
+   * stop the threads, even if the file was not read to its end.
+   */
+  ~LoadPipeline();
+
+  /**
+   * @return the next parsed block in file order. the block is valid
+   *         until the next call. NULL past the end of the file
+   */
+  LoadBlock* next();
+
+ private:
+  int fd;
+  const char* mapped;          // the mapped file. NULL if it is read
+  size_t mappedSize;
+  int maxBlocks;               // # of blocks read but not yet stored
+
+  // all fields below are protected by the mutex
+  std::mutex mutex;
+  condition_variable cond;
+  deque<LoadBlock*> raw;       // blocks waiting for a parser
+  map<long, LoadBlock*> parsed; // blocks waiting for their turn
+  long nextRead;               // the seq of the next block read
+  long nextWrite;              // the seq of the next block stored
+  bool eof;                    // the whole file was read
+  bool stop;                   // the threads have to stop
+
+  vector<thread> threads;
+  LoadBlock* current;          // the block returned by next()
+
+  // wait until another block may be handed out. false if we have to stop
+  bool waitForRoom();
+
+  // hand a block to the parsers
+  void push(LoadBlock* block);
+
+  void reader();
+  void parser();
+
+  LoadPipeline(const LoadPipeline&);
+  LoadPipeline& operator=(const LoadPipeline&);
+};
+
+LoadPipeline::LoadPipeline(int fd, int numParsers) : fd(fd)
+{
+  struct stat st;
+
+  maxBlocks = 2 * numParsers + 2;
+  nextRead = nextWrite = 0;
+  eof = stop = false;
+  current = NULL;
+
+  // a regular file is mapped, so the lines are never copied
+  mapped = NULL;
+  mappedSize = 0;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      mapped = (const char*) p;
+      mappedSize = st.st_size;
+    }
+  }
+
+  threads.push_back(thread(&LoadPipeline::reader, this));
+  for (int i = 0; i < numParsers; i++) {
+    threads.push_back(thread(&LoadPipeline::parser, this));
+  }
+}
+
+LoadPipeline::~LoadPipeline()
+{
+  {
+    lock_guard<std::mutex> lock(mutex);
+    stop = true;
+    cond.notify_all();
+  }
+  for (unsigned i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+
+  delete current;
+  for (unsigned i = 0; i < raw.size(); i++) delete raw[i];
+  for (map<long, LoadBlock*>::iterator it = parsed.begin(); it != parsed.end(); ++it) {
+    delete it->second;
+  }
+
+  if (mapped != NULL) munmap((void*) mapped, mappedSize);
+  ::close(fd);
+}
+
+LoadBlock* LoadPipeline::next()
+{
+  unique_lock<std::mutex> lock(mutex);
+
+  delete current;
+  current = NULL;
+
+  while (!stop) {
+    map<long, LoadBlock*>::iterator it = parsed.find(nextWrite);
+    if (it != parsed.end()) {
+      // a block is stored, so the reader may read another one
+      current = it->second;
+      parsed.erase(it);
+      nextWrite++;
+      cond.notify_all();
+      return current;
+    }
+
+    if (eof && nextWrite == nextRead) break;
+    cond.wait(lock);
+  }
+
+  return NULL;
+}
+
+bool LoadPipeline::waitForRoom()
+{
+  unique_lock<std::mutex> lock(mutex);
+  while (!stop && nextRead - nextWrite >= maxBlocks) cond.wait(lock);
+  return !stop;
+}
+
+void LoadPipeline::push(LoadBlock* block)
+{
+  block->rc = 0;
+
+  lock_guard<std::mutex> lock(mutex);
+  block->seq = nextRead++;
+  raw.push_back(block);
+  cond.notify_all();
+}
+
+void LoadPipeline::reader()
+{
+  if (mapped != NULL) {
+    // cut the mapped file into blocks that end after a newline
+    const char* pos = mapped;
+    const char* end = mapped + mappedSize;
+
+    while (pos < end) {
+      if (!waitForRoom()) return;
+
+      const char* cut = end;
+      if (end - pos > BLOCK_SIZE) {
+        const char* eol = (const char*) memchr(pos + BLOCK_SIZE - 1, '\n', end - (pos + BLOCK_SIZE - 1));
+        if (eol != NULL) cut = eol + 1;
+      }
+
+      LoadBlock* block = new LoadBlock;
+      block->begin = pos;
+      block->end = cut;
+      pos = cut;
+      push(block);
+    }
+  } else {
+    // read the file. the lines read but not handed out yet are carried
+    // over to the next block
+    vector<char> buf(BLOCK_SIZE);
+    string carry;
+    ssize_t n;
+
+    while (1) {
+      if (!waitForRoom()) return;
+
+      while ((n = ::read(fd, &buf[0], BLOCK_SIZE)) < 0 && errno == EINTR);
+      bool end = (n <= 0);
+      if (!end) carry.append(&buf[0], n);
+
+      // a block ends after the last complete line. the last line of the
+      // file may have no newline
+      string::size_type cut = end ? carry.size() : carry.rfind('\n');
+      if (cut == string::npos) continue;
+      if (!end) cut++;
+
+      if (cut > 0) {
+        LoadBlock* block = new LoadBlock;
+        block->text.assign(carry, 0, cut);
+        block->begin = block->text.data();
+        block->end = block->begin + block->text.size();
+        carry.erase(0, cut);
+        push(block);
+      }
+
+      if (end) break;
+    }
+  }
+
+  lock_guard<std::mutex> lock(mutex);
+  eof = true;
+  cond.notify_all();
+}
+
+void LoadPipeline::parser()
+{
+  const char* value;
+  int key, len;
+
+  while (1) {
+    LoadBlock* block;
+    {
+      unique_lock<std::mutex> lock(mutex);
+      while (!stop && raw.empty() && !eof) cond.wait(lock);
+      if (stop || raw.empty()) return;
+
+      block = raw.front();
+      raw.pop_front();
+    }
+
+    // parse the lines up to the first bad one
+    const char* pos = block->begin;
+    const char* eol;
+    while (pos < block->end) {
+      if ((eol = (const char*) memchr(pos, '\n', block->end - pos)) == NULL) eol = block->end;
+
+      if ((block->rc = SqlEngine::parseLoadLine(pos, eol - pos, key, value, len)) != 0) break;
+      block->keys.push_back(key);
+      block->values.push_back(value);
+      block->lengths.push_back(len);
+      pos = eol + 1;
+    }
+
+    lock_guard<std::mutex> lock(mutex);
+    parsed[block->seq] = block;
+    cond.notify_all();
+  }
+}
+
 RC SqlEngine::load(const string& table, const string& loadfile, bool index)
 {
   RC ret;
   RecordId rid;
   int k;
-  string v;
+
+  // SELECT answers key-only queries from the index alone, so an index
+  // must cover every tuple. a table that has one keeps it up to date
+  // even when WITH INDEX is not given
+  if (!index && access((table + ".idx").c_str(), F_OK) == 0) index = true;
 
   // open table file
   RecordFile rf;
@@ -242,10 +1324,9 @@ RC SqlEngine::load(const string& table, const string& loadfile, bool index)
   }
 
   // open loadfile
-  ifstream ifs;
-  ifs.open(loadfile.c_str());
-  if (!ifs.is_open()) { // error
-    fprintf(stderr, "ifs failed to open %s\n", loadfile.c_str());
+  int fd = ::open(loadfile.c_str(), O_RDONLY);
+  if (fd < 0) { // error
+    fprintf(stderr, "failed to open %s\n", loadfile.c_str());
     return RC_FILE_OPEN_FAILED;
   }
 
@@ -253,69 +1334,181 @@ RC SqlEngine::load(const string& table, const string& loadfile, bool index)
   if (index) { // build index
     if (ret = bti.open(table + ".idx", 'w')) { // error
       fprintf(stderr, "bti.open() failed to open index file\n");
+      ::close(fd);
       return ret;
     }
   }
 
-  string line;
-  // read lines
-  while (getline(ifs, line)) {
+  // the index is built bottom-up once all rids are known
+  BTreeIndex::BulkLoader loader(bti);
+
+  // the tuples are packed into pages in memory, so every page of the
+  // table is written once
+  RecordFile::BulkWriter writer(rf);
+
+  // the load file is read and parsed by other threads
+  LoadPipeline pipeline(fd, getThreads());
+  LoadBlock* block;
 
-    // parse for key-value pair
-    if (ret = SqlEngine::parseLoadLine(line, k, v)) { // parsing failed
+  // the first error. the tuples stored before it stay in the table
+  RC rc = 0;
+  bool indexFailed = false;
+
+  // store the parsed lines in the order of the file
+  while (rc == 0 && (block = pipeline.next()) != NULL) {
+    for (unsigned i = 0; i < block->keys.size(); i++) {
+      k = block->keys[i];
+
+      // append key-value pair to rf
+      if (rc = writer.append(k, block->values[i], block->lengths[i], rid)) { // append failed
+        fprintf(stderr, "append returned nonzero\n");
+        break;
+      }
+
+      if (index) {
+        // hand the (key, rid) pair to the bulk loader
+        if (rc = loader.add(k, rid)) { // add failed
+          fprintf(stderr, "loader.add returned nonzero\n");
+          indexFailed = true;
+          break;
+        }
+      }
+    }
+
+    // the line after the tuples could not be parsed
+    if (rc == 0 && (rc = block->rc)) { // parsing failed
       // parse failed
-      cout << ret;
+      cout << rc;
       fprintf(stderr, "parseLoadLine returned nonzero\n");
-      return ret;
     }
+  }
 
-    // append key-value pair to rf
-    if (ret = rf.append(k, v, rid)) { // append failed
-      fprintf(stderr, "append returned nonzero\n");
-      return ret;
+  // the tuples stored so far are written and indexed even after an
+  // error, since SELECT trusts the indexes to hold every tuple of the
+  // table. an index that cannot be completed is removed instead, and
+  // SELECT scans the table until the next LOAD WITH INDEX
+
+  // write the last, partially filled page
+  if (ret = writer.finish()) {
+    fprintf(stderr, "writer.finish returned nonzero\n");
+    if (rc == 0) rc = ret;
+    indexFailed = true;
+  }
+
+  if (index) {
+    // sort the pairs and write the index
+    if (!indexFailed && (ret = loader.finish())) { // build failed
+      fprintf(stderr, "loader.finish returned nonzero\n");
+      if (rc == 0) rc = ret;
+      indexFailed = true;
     }
 
-    if (index) {
-      // insert rid into index
-      if (ret = bti.insert(k, rid)) { // insert failed
-        fprintf(stderr, "bit.insert returned nonzero\n");
-        return ret;
+    // the planner estimates the matching keys from the statistics
+    if (!indexFailed && (ret = bti.refreshStats())) {
+      fprintf(stderr, "bti.refreshStats returned nonzero\n");
+      if (rc == 0) rc = ret;
+      indexFailed = true;
+    }
+    bti.close();
+    if (indexFailed) unlink((table + ".idx").c_str());
+  }
+
+  // the value index is built again from all tuples of the table, when
+  // it is asked for or the table already has one, since SELECT trusts
+  // it to cover every tuple. the old file is removed first, so no stale
+  // page is left behind
+  if (index || access((table + ".vidx").c_str(), F_OK) == 0) {
+    ValueIndex vdx;
+    unlink((table + ".vidx").c_str());
+    if (ret = vdx.open(table + ".vidx", 'w')) {
+      fprintf(stderr, "vdx.open() failed to open value index file\n");
+      if (rc == 0) rc = ret;
+    } else {
+      if (ret = vdx.build(rf)) { // build failed
+        fprintf(stderr, "vdx.build returned nonzero\n");
+        if (rc == 0) rc = ret;
       }
+      vdx.close();
+      if (ret) unlink((table + ".vidx").c_str());
     }
   }
 
   //fprintf(stderr, "load successful\n");
-  bti.close();
-  return 0;
+
+  // closing the table writes back the pages still held in the buffer pool
+  ret = rf.close();
+  return rc != 0 ? rc : ret;
+}
+
+// parse the integer at s the way atoi() does: leading white spaces, an
+// optional sign and the digits up to the first non-digit. the value
+// saturates at LONG_MIN/LONG_MAX like strtol() and is then cast to int.
+// unlike atoi(), it does not look at the locale and stops at end
+static int parseKey(const char* s, const char* end)
+{
+  unsigned long v = 0;
+  bool negative = false, overflow = false;
+
+  while (s < end && (*s == ' ' || (*s >= '\t' && *s <= '\r'))) s++;
+  if (s < end && (*s == '-' || *s == '+')) negative = (*s++ == '-');
+
+  // the largest magnitude of the sign
+  unsigned long limit = negative ? (unsigned long) LONG_MAX + 1 : LONG_MAX;
+  for (; s < end && *s >= '0' && *s <= '9'; s++) {
+    unsigned d = *s - '0';
+    if (v > (limit - d) / 10) overflow = true;
+    else v = v * 10 + d;
+  }
+  if (overflow) v = limit;
+
+  return (int) (negative ? -(long) (v - 1) - 1 : (long) v);
 }
 
 RC SqlEngine::parseLoadLine(const string& line, int& key, string& value)
 {
-  const char *s;
-  char        c;
-  string::size_type loc;
+  const char* v;
+  int len;
+  RC rc;
 
-  // ignore beginning white spaces
-  c = *(s = line.c_str());
-  while (c == ' ' || c == '\t') { c = *++s; }
+  // the line ends at the first null character, as it always did
+  const char* s = line.c_str();
+  if ((rc = parseLoadLine(s, strlen(s), key, v, len)) < 0) return rc;
 
-  // get the integer key value
-  key = atoi(s);
+  value.assign(v, len);
+  return 0;
+}
+
+RC SqlEngine::parseLoadLine(const char* line, int len, int& key,
+                            const char*& value, int& valueLen)
+{
+  const char *s = line, *end = line + len;
+  const char *comma, *close;
+  char c;
+
+  // ignore beginning white spaces
+  while (s < end && (*s == ' ' || *s == '\t')) s++;
 
   // look for comma
-  s = strchr(s, ',');
-  if (s == NULL) { return RC_INVALID_FILE_FORMAT; }
+  if ((comma = (const char*) memchr(s, ',', end - s)) == NULL) {
+    return RC_INVALID_FILE_FORMAT;
+  }
+
+  // get the integer key value
+  key = parseKey(s, comma);
 
   // ignore white spaces
-  do { c = *++s; } while (c == ' ' || c == '\t');
+  s = comma + 1;
+  while (s < end && (*s == ' ' || *s == '\t')) s++;
 
   // if there is nothing left, set the value to empty string
-  if (c == 0) {
-    value.erase();
+  if (s == end) {
+    value = s;
+    valueLen = 0;
     return 0;
   }
 
   // is the value field delimited by ' or "?
+  c = *s;
   if (c == '\'' || c == '"') {
     s++;
   } else {
@@ -323,9 +1516,9 @@ RC SqlEngine::parseLoadLine(const string& line, int& key, string& value)
   }
 
   // get the value string
-  value.assign(s);
-  loc = value.find(c, 0);
-  if (loc != string::npos) { value.erase(loc); }
+  if ((close = (const char*) memchr(s, c, end - s)) == NULL) close = end;
+  value = s;
+  valueLen = close - s;
 
   return 0;
 }
@@ -10,9 +10,14 @@
 #ifndef SQLENGINE_H
 #define SQLENGINE_H
 
+#include <cstdio>
 #include <vector>
+#include <atomic>
 #include "Bruinbase.h"
 #include "RecordFile.h"
+#include "BTreeIndex.h"
+#include "ValueIndex.h"
+#include "ResultSink.h"
 
 /**
  * data structure to represent a condition in the WHERE clause
@@ -23,6 +28,30 @@ struct SelCond {
   char* value;  // the value to compare
 };
 
+/**
+ * the state of one parsed command stream. the parser hands every
+ * command to the session, and the session prints the results to out.
+ * the default session simply calls SqlEngine::select() and load().
+ */
+class SqlSession {
+ public:
+  SqlSession(FILE* out) : out(out), quit(false) { }
+  virtual ~SqlSession() { }
+
+  /**
+   * executes a SELECT statement. see SqlEngine::select()
+   */
+  virtual RC select(int attr, const std::string& table, const std::vector<SelCond>& conds);
+
+  /**
+   * executes a LOAD statement. see SqlEngine::load()
+   */
+  virtual RC load(const std::string& table, const std::string& loadfile, bool index);
+
+  FILE* out;   // where the results and the prompt are printed
+  bool  quit;  // set once the user issued QUIT
+};
+
 /**
  * the class that takes, parses, and executes the user commands.
  */
@@ -38,6 +67,16 @@ class SqlEngine {
    */
   static RC run(FILE* commandline);
 
+  /**
+   * parses and executes the commands in a string, such as a line received
+   * by the server. the parser is re-entrant, so several threads may
+   * execute commands at once, each with its own session.
+   * @param commands[IN] the commands to execute
+   * @param session[IN/OUT] the session executing the commands
+   * @return error code. 0 if no error
+   */
+  static RC execute(const std::string& commands, SqlSession& session);
+
   /**
    * executes a SELECT statement.
    * all conditions in conds must be ANDed together.
@@ -46,16 +85,36 @@ class SqlEngine {
    * (1: key, 2: value, 3: *, 4: count(*))
    * @param table[IN] the table name in the FROM clause
    * @param conds[IN] list of conditions in the WHERE clause
+   * @param out[IN] where the result is printed
    * @return error code. 0 if no error
    */
-  static RC select(int attr, const std::string& table, const std::vector<SelCond>& conds);
+  static RC select(int attr, const std::string& table, const std::vector<SelCond>& conds,
+                   FILE* out = stdout);
+
+  /**
+   * executes a SELECT statement on a table that is already open.
+   * the files are only read, so several threads may run a select on
+   * the same open table and index at once.
+   * @param attr[IN] attribute in the SELECT clause
+   * @param rf[IN] the table in the FROM clause
+   * @param index[IN] the index of the table. NULL if there is none
+   * @param valueIndex[IN] the value index of the table. NULL if there is none
+   * @param conds[IN] list of conditions in the WHERE clause
+   * @param out[IN] where the result is printed
+   * @return error code. 0 if no error
+   */
+  static RC select(int attr, const RecordFile& rf, BTreeIndex* index, ValueIndex* valueIndex,
+                   const std::vector<SelCond>& conds, FILE* out);
 
   /**
    * load a table from a load file.
    * @param table[IN] the table name in the LOAD command
    * @param loadfile[IN] the file name of the load file
-   * @param index[IN] true if "WITH INDEX" option was specified
-   * @return error code. 0 if no error
+   * @param index[IN] true if "WITH INDEX" option was specified. the key
+   *                  index and the value index are then built. an index
+   *                  the table already has is updated either way
+   * @return error code. 0 if no error. on an error, the tuples before
+   *         the failed line stay in the table and in its indexes
    */
   static RC load(const std::string& table, const std::string& loadfile, bool index);
 
@@ -67,6 +126,49 @@ class SqlEngine {
    * @return error code. 0 if no error
    */
   static RC parseLoadLine(const std::string& line, int& key, std::string& value);
+
+  /**
+   * parse a line of the load file without copying the value. the value
+   * points into the line and is not null-terminated.
+   * @param line[IN] a line from a load file, without the newline
+   * @param len[IN] the length of the line in bytes
+   * @param key[OUT] the key field of the tuple in the line
+   * @param value[OUT] the first byte of the value field in the line
+   * @param valueLen[OUT] the length of the value field
+   * @return error code. 0 if no error
+   */
+  static RC parseLoadLine(const char* line, int len, int& key,
+                          const char*& value, int& valueLen);
+
+  /**
+   * set the # of threads a full table scan or a LOAD runs on. a scan
+   * splits the table into morsels of pages that the threads scan in
+   * parallel, and a LOAD parses blocks of the load file in parallel.
+   * the tuples are still printed and stored in their order.
+   * @param n[IN] # of threads. 1 scans on the calling thread only
+   */
+  static void setThreads(int n);
+
+  /**
+   * @return the # of threads a full table scan or a LOAD runs on. the
+   *         # of cores unless set by setThreads()
+   */
+  static int getThreads();
+
+  /**
+   * set the format of the tuples printed by a SELECT. see ResultSink.
+   * @param format[IN] the format of the rows. TEXT by default
+   */
+  static void setOutputFormat(ResultSink::Format format);
+
+  /**
+   * @return the format of the tuples printed by a SELECT
+   */
+  static ResultSink::Format getOutputFormat();
+
+ private:
+  static std::atomic<int> threads;
+  static std::atomic<ResultSink::Format> outputFormat;
 };
 
 #endif /* SQLENGINE_H */
@@ -9,11 +9,7 @@
 #include "SqlEngine.h" 
 #include "PageFile.h"
 
-int  sqllex(void);  
-void sqlerror(const char *str) { fprintf(stderr, "Error: %s\n", str); }
-extern "C" { int  sqlwrap() { return 1; } }
-
-static void runSelect(int attr, const char* table, const std::vector<SelCond>& conds)
+static void runSelect(SqlSession* session, int attr, const char* table, const std::vector<SelCond>& conds)
 {
   struct tms tmsbuf;
   clock_t btime, etime;
@@ -21,7 +17,7 @@ static void runSelect(int attr, const char* table, const std::vector<SelCond>& c
 
   btime = times(&tmsbuf);
   bpagecnt = PageFile::getPageReadCount();
-  SqlEngine::select(attr, table, conds);
+  session->select(attr, table, conds);
   etime = times(&tmsbuf);
   epagecnt = PageFile::getPageReadCount();
 
@@ -30,6 +26,12 @@ static void runSelect(int attr, const char* table, const std::vector<SelCond>& c
 
 %}
 
+/* the parser and the scanner keep their state in their arguments
+   instead of globals, so each session can parse on its own thread */
+%define api.pure full
+%lex-param   { void* scanner }
+%parse-param { void* scanner } { SqlSession* session }
+
 %union {
   int integer;
   char* string;
@@ -46,6 +48,11 @@ static void runSelect(int attr, const char* table, const std::vector<SelCond>& c
 %type <string> table value
 %type <cond> condition
 %type <conds> conditions
+
+%code {
+int  sqllex(YYSTYPE* lvalp, void* scanner);
+void sqlerror(void* scanner, SqlSession* session, const char *str) { fprintf(stderr, "Error: %s\n", str); }
+}
 %%
 
 commands:
@@ -54,25 +61,25 @@ commands:
 	;
 
 command:
-        load_command { fprintf(stdout, "Bruinbase> "); }
-	| select_command { fprintf(stdout, "Bruinbase> "); }
+        load_command { fprintf(session->out, "Bruinbase> "); }
+	| select_command { fprintf(session->out, "Bruinbase> "); }
 	| quit_command
-	| error LF { fprintf(stdout, "Bruinbase> "); }
-	| LF { fprintf(stdout, "Bruinbase> "); }
+	| error LF { fprintf(session->out, "Bruinbase> "); }
+	| LF { fprintf(session->out, "Bruinbase> "); }
 	;
 
 quit_command:
-	QUIT { return 0; }
+	QUIT { session->quit = true; return 0; }
 	;
 
 load_command:
 	LOAD table FROM STRING LF { 
-	  SqlEngine::load(std::string($2), std::string($4), false); 
+	  session->load(std::string($2), std::string($4), false); 
 	  free($2);
 	  free($4);
 	}
 	| LOAD table FROM STRING WITH INDEX LF { 
-	  SqlEngine::load(std::string($2), std::string($4), true); 
+	  session->load(std::string($2), std::string($4), true); 
 	  free($2);
 	  free($4);
 	}
@@ -81,11 +88,11 @@ load_command:
 select_command:
 	SELECT attributes FROM table LF {
    	        std::vector<SelCond> conds;
-		runSelect($2, $4, conds);
+		runSelect(session, $2, $4, conds);
 		free($4);
 	}
 	| SELECT attributes FROM table WHERE conditions LF {
-	        runSelect($2, $4, *$6);
+	        runSelect(session, $2, $4, *$6);
 	  	free($4);
 	  	for (unsigned i = 0; i < $6->size(); i++) {
 		    free((*$6)[i].value);
@@ -128,7 +135,7 @@ attribute:
 	ID { 
 		if (strcasecmp($1, "key") == 0) $$=1;
 		else if (strcasecmp($1, "value") == 0) $$=2;
-		else sqlerror("wrong attribute name. neither key or value");
+		else sqlerror(scanner, session, "wrong attribute name. neither key or value");
 		free($1);
 	}
 
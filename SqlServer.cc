@@ -0,0 +1,294 @@
+#include "SqlServer.h"
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+// # of connections waiting in the kernel for accept()
+static const int LISTEN_BACKLOG = 64;
+
+/**
+ * the session of a connection. commands go to the shared tables of
+ * the server instead of opening the files every time.
+ */
+class SqlServer::Session : public SqlSession {
+ public:
+  Session(SqlServer& server, FILE* out) : SqlSession(out), server(server) { }
+
+  RC select(int attr, const string& table, const vector<SelCond>& conds)
+  {
+    return server.select(attr, table, conds, out);
+  }
+
+  RC load(const string& table, const string& loadfile, bool index)
+  {
+    return server.load(table, loadfile, index);
+  }
+
+ private:
+  SqlServer& server;
+};
+
+SqlServer::Table::~Table()
+{
+  if (hasIndex) index.close();
+  if (hasValueIndex) valueIndex.close();
+  rf.close();
+}
+
+SqlServer::SqlServer(int numThreads)
+{
+  this->numThreads = numThreads > 0 ? numThreads : 1;
+  listenFd = -1;
+  stopping = false;
+  readers = 0;
+  writer = false;
+}
+
+SqlServer::~SqlServer()
+{
+  if (listenFd >= 0) ::close(listenFd);
+}
+
+RC SqlServer::listenUnix(const string& path)
+{
+  struct sockaddr_un addr;
+
+  if (listenFd >= 0 || path.size() >= sizeof(addr.sun_path)) return RC_SOCKET_FAILED;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+
+  if ((listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return RC_SOCKET_FAILED;
+
+  // a socket left behind by an earlier server would make bind() fail
+  ::unlink(path.c_str());
+  if (::bind(listenFd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+      ::listen(listenFd, LISTEN_BACKLOG) < 0) {
+    ::close(listenFd);
+    listenFd = -1;
+    return RC_SOCKET_FAILED;
+  }
+
+  return 0;
+}
+
+RC SqlServer::listenTcp(int port)
+{
+  struct sockaddr_in addr;
+  int on = 1;
+
+  if (listenFd >= 0 || port <= 0 || port > 65535) return RC_SOCKET_FAILED;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if ((listenFd = ::socket(AF_INET, SOCK_STREAM, 0)) < 0) return RC_SOCKET_FAILED;
+
+  ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (::bind(listenFd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+      ::listen(listenFd, LISTEN_BACKLOG) < 0) {
+    ::close(listenFd);
+    listenFd = -1;
+    return RC_SOCKET_FAILED;
+  }
+
+  return 0;
+}
+
+RC SqlServer::run()
+{
+  if (listenFd < 0) return RC_SOCKET_FAILED;
+
+  // a client that goes away must not kill the server when we write to it
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int i = 0; i < numThreads; i++) {
+    workers.push_back(thread(&SqlServer::worker, this));
+  }
+
+  // hand every new connection to the workers
+  while (1) {
+    int fd = ::accept(listenFd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      break;
+    }
+
+    lock_guard<mutex> lock(queueMutex);
+    connections.push_back(fd);
+    queueCond.notify_one();
+  }
+
+  // let the workers finish the connections they have
+  {
+    lock_guard<mutex> lock(queueMutex);
+    stopping = true;
+    queueCond.notify_all();
+  }
+  for (unsigned i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  workers.clear();
+
+  // close the tables
+  tables.clear();
+  return 0;
+}
+
+void SqlServer::stop()
+{
+  // wakes up accept() in run()
+  if (listenFd >= 0) ::shutdown(listenFd, SHUT_RDWR);
+}
+
+void SqlServer::worker()
+{
+  while (1) {
+    int fd;
+    {
+      unique_lock<mutex> lock(queueMutex);
+      while (connections.empty() && !stopping) queueCond.wait(lock);
+      if (connections.empty()) return;
+
+      fd = connections.front();
+      connections.pop_front();
+    }
+    serve(fd);
+  }
+}
+
+void SqlServer::serve(int fd)
+{
+  FILE* out;
+  char  buf[4096];
+  string pending;
+  ssize_t n;
+
+  // the results are written through a stdio stream of the socket
+  if ((out = fdopen(dup(fd), "w")) == NULL) {
+    ::close(fd);
+    return;
+  }
+
+  Session session(*this, out);
+  fprintf(out, "Bruinbase> ");
+  fflush(out);
+
+  // execute every complete line the client sent
+  while (!session.quit && (n = ::read(fd, buf, sizeof(buf))) > 0) {
+    pending.append(buf, n);
+
+    string::size_type eol;
+    while (!session.quit && (eol = pending.find('\n')) != string::npos) {
+      SqlEngine::execute(pending.substr(0, eol + 1), session);
+      pending.erase(0, eol + 1);
+      fflush(out);
+    }
+  }
+
+  fclose(out);
+  ::close(fd);
+}
+
+void SqlServer::lockShared()
+{
+  unique_lock<mutex> lock(lockMutex);
+  while (writer) lockCond.wait(lock);
+  readers++;
+}
+
+void SqlServer::unlockShared()
+{
+  lock_guard<mutex> lock(lockMutex);
+  if (--readers == 0) lockCond.notify_all();
+}
+
+void SqlServer::lockExclusive()
+{
+  unique_lock<mutex> lock(lockMutex);
+  while (writer) lockCond.wait(lock);
+
+  // no new SELECT starts from here on. wait for the running ones
+  writer = true;
+  while (readers > 0) lockCond.wait(lock);
+}
+
+void SqlServer::unlockExclusive()
+{
+  lock_guard<mutex> lock(lockMutex);
+  writer = false;
+  lockCond.notify_all();
+}
+
+RC SqlServer::getTable(const string& name, shared_ptr<Table>& table)
+{
+  RC rc;
+  lock_guard<mutex> lock(tablesMutex);
+
+  map<string, shared_ptr<Table> >::iterator it = tables.find(name);
+  if (it != tables.end()) {
+    table = it->second;
+    return 0;
+  }
+
+  // open the table and its indexes, if there are any, for good
+  shared_ptr<Table> t(new Table);
+  t->hasIndex = false;
+  t->hasValueIndex = false;
+  if ((rc = t->rf.open(name + ".tbl", 'm')) < 0) {
+    return rc;
+  }
+  t->hasIndex = (t->index.open(name + ".idx", 'm') == 0);
+  t->hasValueIndex = (t->valueIndex.open(name + ".vidx", 'm') == 0);
+
+  tables[name] = t;
+  table = t;
+  return 0;
+}
+
+RC SqlServer::select(int attr, const string& table, const vector<SelCond>& conds, FILE* out)
+{
+  RC rc;
+  shared_ptr<Table> t;
+
+  lockShared();
+  if ((rc = getTable(table, t)) < 0) {
+    // the client has no console, so the error goes to the client
+    fprintf(out, "Error: table %s does not exist\n", table.c_str());
+  } else {
+    rc = SqlEngine::select(attr, t->rf, t->hasIndex ? &t->index : NULL,
+                           t->hasValueIndex ? &t->valueIndex : NULL, conds, out);
+  }
+  unlockShared();
+
+  return rc;
+}
+
+RC SqlServer::load(const string& table, const string& loadfile, bool index)
+{
+  RC rc;
+
+  lockExclusive();
+
+  // the mapping of an open table does not see the new pages, so the
+  // table is reopened by the next SELECT
+  {
+    lock_guard<mutex> lock(tablesMutex);
+    tables.erase(table);
+  }
+  rc = SqlEngine::load(table, loadfile, index);
+
+  unlockExclusive();
+  return rc;
+}
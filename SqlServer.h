@@ -0,0 +1,115 @@
+#ifndef SQLSERVER_H
+#define SQLSERVER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "Bruinbase.h"
+#include "SqlEngine.h"
+
+/**
+ * A bruinbase server that takes commands from clients on a Unix domain
+ * socket or a localhost TCP port. Every connection works like the
+ * console: the client sends command lines and receives the results,
+ * each followed by the "Bruinbase> " prompt.
+ * Connections are served by a pool of worker threads. Tables and their
+ * indexes stay open (mapped) across requests, so SELECTs of all clients
+ * share them. A LOAD waits for the running SELECTs and runs alone.
+ */
+class SqlServer {
+ public:
+  static const int DEFAULT_THREADS = 4;
+
+  /**
+   * @param numThreads[IN] # of worker threads, i.e., # of clients
+   *                       served at the same time
+   */
+  SqlServer(int numThreads = DEFAULT_THREADS);
+  ~SqlServer();
+
+  /**
+   * listen on a Unix domain socket. an existing socket file is replaced.
+   * @param path[IN] the path of the socket
+   * @return error code. 0 if no error
+   */
+  RC listenUnix(const std::string& path);
+
+  /**
+   * listen on a TCP port of the loopback interface.
+   * @param port[IN] the port to listen on
+   * @return error code. 0 if no error
+   */
+  RC listenTcp(int port);
+
+  /**
+   * accept and serve connections until stop() is called.
+   * @return error code. 0 if no error
+   */
+  RC run();
+
+  /**
+   * stop accepting connections. run() returns once the connections
+   * being served are closed.
+   */
+  void stop();
+
+ private:
+  // a table and its indexes, opened in 'm' mode
+  struct Table {
+    RecordFile rf;
+    BTreeIndex index;
+    bool       hasIndex;
+    ValueIndex valueIndex;
+    bool       hasValueIndex;
+
+    ~Table();
+  };
+
+  // the session of one connection. defined in SqlServer.cc
+  class Session;
+
+  int  numThreads;
+  int  listenFd;
+  bool stopping;
+
+  // accepted connections waiting for a worker
+  std::vector<std::thread> workers;
+  std::deque<int> connections;
+  std::mutex queueMutex;
+  std::condition_variable queueCond;
+
+  // the open tables by name
+  std::map<std::string, std::shared_ptr<Table> > tables;
+  std::mutex tablesMutex;
+
+  // SELECTs share the tables while a LOAD has them to itself
+  int  readers;
+  bool writer;
+  std::mutex lockMutex;
+  std::condition_variable lockCond;
+
+  void lockShared();
+  void unlockShared();
+  void lockExclusive();
+  void unlockExclusive();
+
+  // take connections from the queue and serve them
+  void worker();
+  void serve(int fd);
+
+  // find an open table or open it
+  RC getTable(const std::string& name, std::shared_ptr<Table>& table);
+
+  RC select(int attr, const std::string& table, const std::vector<SelCond>& conds, FILE* out);
+  RC load(const std::string& table, const std::string& loadfile, bool index);
+
+  SqlServer(const SqlServer&);
+  SqlServer& operator=(const SqlServer&);
+};
+
+#endif // SQLSERVER_H
@@ -0,0 +1,350 @@
+#include "ValueIndex.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+// "BBVX" in a little-endian int. marks the header page of a value index
+static const int VALUE_INDEX_MAGIC = 0x58564242;
+
+// page 0 of the index
+struct HeaderPage {
+  int    magic;
+  PageId rootPid;
+  int    treeHeight;
+  int    entryCount;
+  int    longCount;
+};
+
+// a leaf. the leaves are chained in the order of their entries
+struct LeafPage {
+  int    count;  // # of entries
+  PageId next;   // the next leaf. 0 for the last one
+  ValueIndex::Entry entries[ValueIndex::LEAF_ENTRIES];
+};
+
+// a non-leaf node. keys[i] is the first entry under children[i + 1]
+struct NonLeafPage {
+  int    count;  // # of keys. the node has one more child
+  int    unused;
+  PageId children[ValueIndex::NONLEAF_ENTRIES + 1];
+  ValueIndex::Entry keys[ValueIndex::NONLEAF_ENTRIES];
+};
+
+// the order of the entries: by prefix, then by rid
+static bool lessEntry(const ValueIndex::Entry& a, const ValueIndex::Entry& b)
+{
+  int c = memcmp(a.prefix, b.prefix, ValueIndex::PREFIX_LENGTH);
+  return c < 0 || (c == 0 && a.rid < b.rid);
+}
+
+// the first of n sorted entries whose prefix is not less than prefix
+static int lowerBound(const ValueIndex::Entry* entries, int n, const char* prefix)
+{
+  int lo = 0, hi = n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (memcmp(entries[mid].prefix, prefix, ValueIndex::PREFIX_LENGTH) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// the first of n sorted entries whose prefix is greater than prefix
+static int upperBound(const ValueIndex::Entry* entries, int n, const char* prefix)
+{
+  int lo = 0, hi = n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (memcmp(entries[mid].prefix, prefix, ValueIndex::PREFIX_LENGTH) <= 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+ValueIndex::ValueIndex()
+{
+  rootPid = 0;
+  treeHeight = 0;
+  entryCount = 0;
+  longCount = 0;
+  writable = false;
+}
+
+ValueIndex::~ValueIndex()
+{
+}
+
+RC ValueIndex::open(const string& indexname, char mode)
+{
+  RC rc;
+  char page[PageFile::PAGE_SIZE];
+  HeaderPage header;
+
+  rootPid = 0;
+  treeHeight = 0;
+  entryCount = 0;
+  longCount = 0;
+
+  if ((rc = pf.open(indexname, mode)) < 0) return rc;
+  writable = (mode == 'w' || mode == 'W');
+
+  // a new index is empty until it is built
+  if (pf.endPid() == 0) return 0;
+
+  if ((rc = pf.read(0, page)) < 0) {
+    pf.close();
+    return rc;
+  }
+  memcpy(&header, page, sizeof(header));
+  if (header.magic != VALUE_INDEX_MAGIC) {
+    pf.close();
+    return RC_INVALID_FILE_FORMAT;
+  }
+
+  rootPid = header.rootPid;
+  treeHeight = header.treeHeight;
+  entryCount = header.entryCount;
+  longCount = header.longCount;
+  return 0;
+}
+
+RC ValueIndex::close()
+{
+  return pf.close();
+}
+
+RC ValueIndex::writeHeader()
+{
+  char page[PageFile::PAGE_SIZE];
+  HeaderPage header;
+
+  header.magic = VALUE_INDEX_MAGIC;
+  header.rootPid = rootPid;
+  header.treeHeight = treeHeight;
+  header.entryCount = entryCount;
+  header.longCount = longCount;
+
+  memset(page, 0, PageFile::PAGE_SIZE);
+  memcpy(page, &header, sizeof(header));
+  return pf.write(0, page);
+}
+
+void ValueIndex::makePrefix(const char* value, char* prefix)
+{
+  // strncpy pads a short value with null characters
+  strncpy(prefix, value, PREFIX_LENGTH);
+}
+
+RC ValueIndex::build(const RecordFile& rf)
+{
+  RC rc;
+  RecordId rid;
+  int count, key;
+  const char* value;
+  Entry entry;
+  vector<Entry> entries;
+
+  if (!writable) return RC_INVALID_FILE_MODE;
+
+  // take the prefix of every tuple. the sids of a page run from 0 to
+  // its record count
+  for (rid.pid = rf.beginRid().pid; rid.pid <= rf.endRid().pid; rid.pid++) {
+    if ((rc = rf.getPageRecordCount(rid.pid, count)) < 0) return rc;
+    for (rid.sid = 0; rid.sid < count; rid.sid++) {
+      if ((rc = rf.pin(rid, key, value)) < 0) return rc;
+      makePrefix(value, entry.prefix);
+      rf.unpin(rid);
+
+      entry.key = key;
+      entry.rid = rid;
+      entries.push_back(entry);
+    }
+  }
+
+  sort(entries.begin(), entries.end(), lessEntry);
+
+  char page[PageFile::PAGE_SIZE];
+  vector<PageId> level;   // the nodes of the level just written
+  vector<Entry>  firsts;  // the first entry under each of them
+  PageId pid = 1;
+  int n = entries.size();
+
+  // pack the entries into full leaves, chained in order
+  for (int i = 0; i < n; i += LEAF_ENTRIES) {
+    LeafPage* leaf = (LeafPage*) page;
+    memset(page, 0, PageFile::PAGE_SIZE);
+    leaf->count = (n - i < LEAF_ENTRIES) ? n - i : LEAF_ENTRIES;
+    leaf->next = (i + LEAF_ENTRIES < n) ? pid + 1 : 0;
+    memcpy(leaf->entries, &entries[i], leaf->count * sizeof(Entry));
+    if ((rc = pf.write(pid, page)) < 0) return rc;
+
+    level.push_back(pid++);
+    firsts.push_back(entries[i]);
+  }
+  treeHeight = level.empty() ? 0 : 1;
+
+  // put full non-leaf levels on top until a single root is left
+  while (level.size() > 1) {
+    vector<PageId> upper;
+    vector<Entry>  upperFirsts;
+
+    for (unsigned i = 0; i < level.size(); i += NONLEAF_ENTRIES + 1) {
+      NonLeafPage* node = (NonLeafPage*) page;
+      int children = min((int) level.size() - (int) i, NONLEAF_ENTRIES + 1);
+
+      memset(page, 0, PageFile::PAGE_SIZE);
+      node->count = children - 1;
+      for (int j = 0; j < children; j++) {
+        node->children[j] = level[i + j];
+        if (j > 0) node->keys[j - 1] = firsts[i + j];
+      }
+      if ((rc = pf.write(pid, page)) < 0) return rc;
+
+      upper.push_back(pid++);
+      upperFirsts.push_back(firsts[i]);
+    }
+
+    level.swap(upper);
+    firsts.swap(upperFirsts);
+    treeHeight++;
+  }
+
+  rootPid = level.empty() ? 0 : level[0];
+  entryCount = n;
+  longCount = 0;
+  for (int i = 0; i < n; i++) {
+    if (!isComplete(entries[i])) longCount++;
+  }
+  return writeHeader();
+}
+
+RC ValueIndex::rank(const char* prefix, bool after, int& rank) const
+{
+  RC rc;
+  char* node;
+  PageId child = rootPid;
+
+  rank = 0;
+  if (child == 0) return 0;
+
+  // descend like Scanner::open(). the entries greater than prefix start
+  // under the child left of the first separator that is greater
+  for (int level = 1; level < treeHeight; level++) {
+    if ((rc = pf.pin(child, node)) < 0) return rc;
+
+    const NonLeafPage* nonLeaf = (const NonLeafPage*) node;
+    int i = after ? upperBound(nonLeaf->keys, nonLeaf->count, prefix)
+                  : lowerBound(nonLeaf->keys, nonLeaf->count, prefix);
+    PageId pid = child;
+    child = nonLeaf->children[i];
+    pf.unpin(pid);
+  }
+
+  if ((rc = pf.pin(child, node)) < 0) return rc;
+  const LeafPage* leaf = (const LeafPage*) node;
+  int eid = after ? upperBound(leaf->entries, leaf->count, prefix)
+                  : lowerBound(leaf->entries, leaf->count, prefix);
+  pf.unpin(child);
+
+  // the leaves start at page 1, and all but the last one are full
+  rank = (child - 1) * LEAF_ENTRIES + eid;
+  return 0;
+}
+
+RC ValueIndex::countRange(const char* lo, const char* hi, int& count) const
+{
+  RC rc;
+  int first, end;
+
+  count = 0;
+  if ((rc = rank(lo, false, first)) < 0) return rc;
+  if ((rc = rank(hi, true, end)) < 0) return rc;
+  if (end > first) count = end - first;
+  return 0;
+}
+
+ValueIndex::Scanner::Scanner(const ValueIndex& index) : index(index)
+{
+  pid = 0;
+  page = NULL;
+  eid = 0;
+  hinted = 0;
+}
+
+ValueIndex::Scanner::~Scanner()
+{
+  close();
+}
+
+RC ValueIndex::Scanner::open(const char* prefix)
+{
+  RC rc;
+  char* node;
+  PageId child = index.rootPid;
+
+  close();
+  if (child == 0) return 0;
+
+  // descend the non-leaf levels. the entries not less than prefix start
+  // under the child left of the first separator that is not less
+  for (int level = 1; level < index.treeHeight; level++) {
+    if ((rc = index.pf.pin(child, node)) < 0) return rc;
+
+    const NonLeafPage* nonLeaf = (const NonLeafPage*) node;
+    PageId pid = child;
+    child = nonLeaf->children[lowerBound(nonLeaf->keys, nonLeaf->count, prefix)];
+    index.pf.unpin(pid);
+  }
+
+  if ((rc = fetch(child)) < 0) return rc;
+
+  const LeafPage* leaf = (const LeafPage*) page;
+  eid = lowerBound(leaf->entries, leaf->count, prefix);
+  return 0;
+}
+
+void ValueIndex::Scanner::close()
+{
+  if (pid > 0) index.pf.unpin(pid);
+
+  pid = 0;
+  page = NULL;
+  eid = 0;
+}
+
+RC ValueIndex::Scanner::fetch(PageId pid)
+{
+  RC rc;
+  char* leaf;
+
+  close();
+
+  // pid 0 is the header page, so it marks the end of the leaf chain
+  if (pid <= 0) return 0;
+
+  if ((rc = index.pf.pin(pid, leaf)) < 0) return rc;
+  this->pid = pid;
+  page = leaf;
+  return 0;
+}
+
+RC ValueIndex::Scanner::next(const Entry*& entry)
+{
+  RC rc;
+
+  // follow the leaf chain until we land on an entry
+  while (pid > 0 && eid >= ((const LeafPage*) page)->count) {
+    if ((rc = fetch(((const LeafPage*) page)->next)) < 0) return rc;
+    eid = 0;
+
+    // the scan goes on past its first leaf. the leaves are written in
+    // order, so the pages after this one are the leaves it reads next
+    if (pid > 0) hinted = index.pf.prefetchAhead(pid + 1, index.pf.endPid(), hinted);
+  }
+  if (pid == 0) return RC_END_OF_TREE;
+
+  entry = &((const LeafPage*) page)->entries[eid++];
+  return 0;
+}
@@ -0,0 +1,172 @@
+#ifndef VALUEINDEX_H
+#define VALUEINDEX_H
+
+#include <string>
+#include "Bruinbase.h"
+#include "PageFile.h"
+#include "RecordFile.h"
+
+/**
+ * A secondary B+tree index on the value column of a table.
+ * An entry holds the first PREFIX_LENGTH bytes of a value, padded with
+ * null characters, the key of the tuple and its RecordId. The entries are
+ * sorted by (prefix, rid), so no two entries are equal and the tuples of
+ * one value stay in table order.
+ * Prefixes compare like the values they come from, so the values in a
+ * range lie in a range of prefixes. A value shorter than the prefix is
+ * kept whole in its entry; only the entries of longer values have to be
+ * compared against their tuple in the RecordFile.
+ * The index is built in one pass over all tuples of its table, so it is
+ * rebuilt whenever the table grows.
+ */
+class ValueIndex {
+ public:
+  // the # of bytes of a value kept in an entry
+  static const int PREFIX_LENGTH = 16;
+
+  // an entry of a leaf
+  struct Entry {
+    char     prefix[PREFIX_LENGTH];  // the value, cut or padded with '\0'
+    int      key;                    // the key of the tuple
+    RecordId rid;                    // the location of the tuple
+  };
+
+  // # of entries in a leaf
+  static const int LEAF_ENTRIES = (PageFile::PAGE_SIZE - 2 * sizeof(int)) / sizeof(Entry);
+
+  // # of separator entries in a non-leaf node, which has one more child
+  static const int NONLEAF_ENTRIES =
+    (PageFile::PAGE_SIZE - 2 * sizeof(int) - sizeof(PageId)) / (sizeof(Entry) + sizeof(PageId));
+
+  ValueIndex();
+  ~ValueIndex();
+
+  /**
+   * open the index file in read, write or mmap mode.
+   * @param indexname[IN] the name of the index file
+   * @param mode[IN] 'r' for read, 'w' for write, 'm' for mmap
+   * @return error code. 0 if no error
+   */
+  RC open(const std::string& indexname, char mode);
+
+  /**
+   * close the index file.
+   * @return error code. 0 if no error
+   */
+  RC close();
+
+  /**
+   * build the index from all tuples of a table. the entries are sorted
+   * in memory, and the leaves and the non-leaf levels are written in one
+   * sequential pass. the index must be open in 'w' mode and empty.
+   * @param rf[IN] the table to index
+   * @return error code. 0 if no error
+   */
+  RC build(const RecordFile& rf);
+
+  /**
+   * @return # of entries, i.e., # of tuples in the table when it was indexed
+   */
+  int getEntryCount() const { return entryCount; }
+
+  /**
+   * @return # of entries whose value is longer than the prefix, so their
+   *         tuple has to be read to compare the value
+   */
+  int getLongCount() const { return longCount; }
+
+  /**
+   * @return # of levels. 1 if the root is a leaf, 0 if the index is empty
+   */
+  int getTreeHeight() const { return treeHeight; }
+
+  /**
+   * count the entries whose prefix lies in [lo, hi]. the leaves are full
+   * and written in order, so the rank of an entry follows from its leaf
+   * and its slot, and the count takes two descents of the tree.
+   * @param lo[IN] the smallest prefix, PREFIX_LENGTH bytes
+   * @param hi[IN] the largest prefix, PREFIX_LENGTH bytes
+   * @param count[OUT] # of entries in the range
+   * @return error code. 0 if no error
+   */
+  RC countRange(const char* lo, const char* hi, int& count) const;
+
+  /**
+   * cut or pad a value to the prefix of its entry.
+   * @param value[IN] the null-terminated value
+   * @param prefix[OUT] PREFIX_LENGTH bytes
+   */
+  static void makePrefix(const char* value, char* prefix);
+
+  /**
+   * @param entry[IN] an entry of the index
+   * @return true if the prefix holds the whole value, which then is
+   *         null-terminated inside the prefix
+   */
+  static bool isComplete(const Entry& entry) { return entry.prefix[PREFIX_LENGTH - 1] == '\0'; }
+
+  /**
+   * walks the leaves of the index in the order of the entries. the
+   * current leaf stays pinned while its entries are read.
+   */
+  class Scanner {
+   public:
+    Scanner(const ValueIndex& index);
+    ~Scanner();
+
+    /**
+     * position the scanner at the first entry whose prefix is not
+     * less than the given one.
+     * @param prefix[IN] PREFIX_LENGTH bytes, as made by makePrefix()
+     * @return error code. 0 if no error, even if no such entry exists
+     */
+    RC open(const char* prefix);
+
+    /**
+     * release the current leaf. called by the destructor as well.
+     */
+    void close();
+
+    /**
+     * read the entry at the scanner position and move to the next one.
+     * @param entry[OUT] the entry inside the pinned leaf. it stays valid
+     *                   until the next call to the scanner
+     * @return error code. 0 if no error. RC_END_OF_TREE past the last entry
+     */
+    RC next(const Entry*& entry);
+
+   private:
+    const ValueIndex& index;
+    PageId pid;        // the pinned leaf. 0 if none
+    const char* page;  // the content of the pinned leaf
+    int    eid;        // the next entry in the leaf
+    PageId hinted;     // the page after the last prefetched page
+
+    // pin the leaf pid. pid 0 ends the scan
+    RC fetch(PageId pid);
+
+    Scanner(const Scanner&);
+    Scanner& operator=(const Scanner&);
+  };
+
+ private:
+  PageFile pf;        // the pages of the index. page 0 is the header
+  PageId rootPid;     // the root node. 0 if the index is empty
+  int    treeHeight;  // # of levels. 1 if the root is a leaf
+  int    entryCount;  // # of entries in the leaves
+  int    longCount;   // # of entries whose value does not fit the prefix
+  bool   writable;    // true if the header is written back on close
+
+  // write the header page
+  RC writeHeader();
+
+  // the rank of the first entry whose prefix is not less than (or, if
+  // after is true, greater than) the given one. entryCount if none
+  RC rank(const char* prefix, bool after, int& rank) const;
+
+  // forbid copying
+  ValueIndex(const ValueIndex&);
+  ValueIndex& operator=(const ValueIndex&);
+};
+
+#endif // VALUEINDEX_H
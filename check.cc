@@ -0,0 +1,963 @@
+/**
+ * Self-checks of Bruinbase, run by "make check". Every check compares a
+ * fast path against a plain way to the same answer, such as the counts
+ * of a counted B+tree against a scan of its leaves. The files the
+ * checks create are removed at the end.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include "Bruinbase.h"
+#include "BTreeIndex.h"
+#include "RecordFile.h"
+#include "ValueIndex.h"
+#include "SqlEngine.h"
+#include "KeyCompare.h"
+#include "ResultSink.h"
+#include "AsyncIO.h"
+#include "BufferPool.h"
+
+using namespace std;
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static void check(bool ok, const char* what, const char* file, int line)
+{
+  checks++;
+  if (ok) return;
+  failures++;
+  fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+}
+
+// a random value of 1 to maxLength characters
+static string randomValue(int maxLength)
+{
+  string value(1 + rand() % maxLength, ' ');
+  for (unsigned i = 0; i < value.size(); i++) value[i] = 'a' + rand() % 26;
+  return value;
+}
+
+// rank, countRange and readNth of a counted index against its leaves
+static void checkCountedTree()
+{
+  const char* name = "check_counted.idx";
+  BTreeIndex index;
+  vector<int> keys;
+
+  unlink(name);
+  CHECK(index.open(name, 'w') == 0);
+  for (int i = 0; i < 20000; i++) {
+    RecordId rid = { i / 10, i % 10 };
+    int key = rand() % 5000 - 2500;
+    CHECK(index.insert(key, rid) == 0);
+  }
+
+  // the keys in the order of the leaves
+  IndexCursor cursor;
+  int key;
+  RecordId rid;
+  index.locate(INT_MIN, cursor);
+  while (index.readForward(cursor, key, rid) == 0) keys.push_back(key);
+  CHECK(keys.size() == 20000);
+  CHECK(is_sorted(keys.begin(), keys.end()));
+
+  for (int i = 0; i < 500; i++) {
+    int lo = rand() % 6000 - 3000;
+    int hi = lo + rand() % 1000;
+    int count, rank;
+
+    CHECK(index.countRange(lo, hi, count) == 0);
+    CHECK(count == upper_bound(keys.begin(), keys.end(), hi) - lower_bound(keys.begin(), keys.end(), lo));
+    CHECK(index.rank(lo, rank) == 0);
+    CHECK(rank == lower_bound(keys.begin(), keys.end(), lo) - keys.begin());
+
+    int n = rand() % keys.size();
+    CHECK(index.readNth(n, key, rid) == 0 && key == keys[n]);
+  }
+  CHECK(index.readNth(keys.size(), key, rid) == RC_END_OF_TREE);
+
+  index.close();
+  unlink(name);
+}
+
+// records written in a format read back the same after reopening
+static void checkRecordFile(RecordFile::Format format, int maxLength)
+{
+  const char* name = "check_records.tbl";
+  RecordFile rf;
+  vector<RecordId> rids;
+  vector<string> values;
+
+  unlink(name);
+  CHECK(rf.open(name, 'w', format) == 0);
+  for (int i = 0; i < 3000; i++) {
+    RecordId rid;
+    values.push_back(randomValue(maxLength));
+    CHECK(rf.append(i, values.back(), rid) == 0);
+    rids.push_back(rid);
+  }
+  CHECK(rf.close() == 0);
+
+  CHECK(rf.open(name, 'r', format) == 0);
+  for (unsigned i = 0; i < rids.size(); i++) {
+    int key;
+    string value;
+    CHECK(rf.read(rids[i], key, value) == 0 && key == (int) i && value == values[i]);
+  }
+
+  // the pages hold all the records, no more
+  int total = 0;
+  for (PageId pid = rf.beginRid().pid; pid <= rf.endRid().pid; pid++) {
+    int count;
+    if (rf.getPageRecordCount(pid, count) == 0) total += count;
+  }
+  CHECK(total == (int) rids.size());
+
+  rf.close();
+  unlink(name);
+}
+
+// the prefix range counts of a value index against the values
+static void checkValueIndex()
+{
+  const char* table = "check_values.tbl";
+  const char* name = "check_values.vidx";
+  RecordFile rf;
+  ValueIndex vdx;
+  vector<string> prefixes;
+
+  unlink(table);
+  unlink(name);
+  CHECK(rf.open(table, 'w') == 0);
+  for (int i = 0; i < 5000; i++) {
+    RecordId rid;
+    string value = randomValue(30);
+    char prefix[ValueIndex::PREFIX_LENGTH];
+    CHECK(rf.append(i, value, rid) == 0);
+    ValueIndex::makePrefix(value.c_str(), prefix);
+    prefixes.push_back(string(prefix, ValueIndex::PREFIX_LENGTH));
+  }
+  CHECK(vdx.open(name, 'w') == 0);
+  CHECK(vdx.build(rf) == 0);
+  CHECK(vdx.getEntryCount() == 5000);
+
+  for (int i = 0; i < 200; i++) {
+    char lo[ValueIndex::PREFIX_LENGTH];
+    char hi[ValueIndex::PREFIX_LENGTH];
+    string a = randomValue(3), b = randomValue(3);
+    if (b < a) swap(a, b);
+    ValueIndex::makePrefix(a.c_str(), lo);
+    ValueIndex::makePrefix(b.c_str(), hi);
+
+    int expected = 0, count;
+    for (unsigned j = 0; j < prefixes.size(); j++) {
+      if (memcmp(prefixes[j].data(), lo, ValueIndex::PREFIX_LENGTH) >= 0 &&
+          memcmp(prefixes[j].data(), hi, ValueIndex::PREFIX_LENGTH) <= 0) expected++;
+    }
+    CHECK(vdx.countRange(lo, hi, count) == 0 && count == expected);
+  }
+
+  vdx.close();
+  rf.close();
+  unlink(table);
+  unlink(name);
+}
+
+// a condition of a WHERE clause
+static SelCond makeCond(int attr, SelCond::Comparator comp, const char* value)
+{
+  SelCond cond;
+  cond.attr = attr;
+  cond.comp = comp;
+  cond.value = const_cast<char*>(value);
+  return cond;
+}
+
+// the output of a SELECT, with its lines sorted since the access paths
+// return the tuples in different orders
+static string selectOutput(int attr, const string& table, const vector<SelCond>& conds)
+{
+  vector<string> lines;
+  char buffer[1024];
+  string output;
+
+  FILE* out = tmpfile();
+  if (out == NULL) return output;
+  SqlEngine::select(attr, table, conds, out);
+  rewind(out);
+  while (fgets(buffer, sizeof(buffer), out) != NULL) lines.push_back(buffer);
+  fclose(out);
+
+  sort(lines.begin(), lines.end());
+  for (unsigned i = 0; i < lines.size(); i++) output += lines[i];
+  return output;
+}
+
+// the output of a SELECT with at most one condition
+static string selectOutput(int attr, const string& table)
+{
+  return selectOutput(attr, table, vector<SelCond>());
+}
+
+static string selectOutput(int attr, const string& table, int condAttr,
+                           SelCond::Comparator comp, const char* value)
+{
+  return selectOutput(attr, table, vector<SelCond>(1, makeCond(condAttr, comp, value)));
+}
+
+static void writeFile(const char* name, const char* text)
+{
+  FILE* f = fopen(name, "w");
+  if (f == NULL) return;
+  fputs(text, f);
+  fclose(f);
+}
+
+// a load file of the tuples (i, "value i") for i in [from, to]
+static void writeLoadFile(const char* name, int from, int to)
+{
+  FILE* f = fopen(name, "w");
+  if (f == NULL) return;
+  for (int i = from; i <= to; i++) fprintf(f, "%d,\"value %d\"\n", i, i);
+  fclose(f);
+}
+
+static void removeTable(const string& table)
+{
+  unlink((table + ".tbl").c_str());
+  unlink((table + ".idx").c_str());
+  unlink((table + ".vidx").c_str());
+}
+
+// a LOAD without WITH INDEX into a table that has an index keeps it
+// complete, so the key-only queries answered from it see the new
+// tuples. the table is large enough for the index to be used
+static void checkIndexAfterLoad()
+{
+  removeTable("check_load");
+  writeLoadFile("check_a.del", 1, 2000);
+  writeFile("check_b.del", "3000,\"cherry\"\n");
+
+  CHECK(SqlEngine::load("check_load", "check_a.del", true) == 0);
+  CHECK(SqlEngine::load("check_load", "check_b.del", false) == 0);
+
+  CHECK(selectOutput(4, "check_load") == "2001\n");
+  CHECK(selectOutput(4, "check_load", 1, SelCond::GT, "1990") == "11\n");
+  CHECK(selectOutput(1, "check_load", 1, SelCond::GE, "1999") == "1999\n2000\n3000\n");
+
+  removeTable("check_load");
+  unlink("check_a.del");
+  unlink("check_b.del");
+}
+
+// a LOAD without WITH INDEX rebuilds the value index of the table, with
+// or without a key index
+static void checkValueIndexAfterLoad()
+{
+  writeLoadFile("check_a.del", 1, 2000);
+  writeFile("check_b.del", "3000,\"cherry\"\n");
+
+  for (int keyIndex = 1; keyIndex >= 0; keyIndex--) {
+    removeTable("check_load");
+    CHECK(SqlEngine::load("check_load", "check_a.del", true) == 0);
+    if (!keyIndex) unlink("check_load.idx");
+    CHECK(SqlEngine::load("check_load", "check_b.del", false) == 0);
+    CHECK(selectOutput(3, "check_load", 2, SelCond::EQ, "cherry") == "3000 'cherry'\n");
+  }
+
+  removeTable("check_load");
+  unlink("check_a.del");
+  unlink("check_b.del");
+}
+
+// a LOAD that fails on a line of its file keeps the tuples before the
+// line, and the indexes hold them too
+static void checkFailedLoad()
+{
+  removeTable("check_load");
+  writeLoadFile("check_a.del", 1, 20);
+  CHECK(SqlEngine::load("check_load", "check_a.del", true) == 0);
+
+  FILE* f = fopen("check_b.del", "w");
+  if (f == NULL) return;
+  for (int i = 21; i <= 120; i++) fprintf(f, "%d,\"value %d\"\n", i, i);
+  fprintf(f, "no comma on this line\n");
+  for (int i = 121; i <= 220; i++) fprintf(f, "%d,\"value %d\"\n", i, i);
+  fclose(f);
+  CHECK(SqlEngine::load("check_load", "check_b.del", false) != 0);
+
+  CHECK(selectOutput(4, "check_load") == "120\n");
+  CHECK(selectOutput(4, "check_load", 2, SelCond::GT, "a") == "120\n");
+  CHECK(selectOutput(4, "check_load", 1, SelCond::GT, "100") == "20\n");
+  CHECK(selectOutput(3, "check_load", 1, SelCond::EQ, "50") == "50 'value 50'\n");
+  CHECK(selectOutput(3, "check_load", 2, SelCond::EQ, "value 120") == "120 'value 120'\n");
+  CHECK(selectOutput(4, "check_load", 1, SelCond::GT, "120") == "0\n");
+
+  removeTable("check_load");
+  unlink("check_a.del");
+  unlink("check_b.del");
+}
+
+// SELECTs on the value through the value index against a scan of a
+// table without indexes, for equality, range and prefix conditions. the
+// values are often longer than the prefixes of the index, so many of
+// the tuples are read from the table
+static void checkValueQueries()
+{
+  vector<string> values;
+
+  removeTable("check_vi");
+  removeTable("check_vs");
+  FILE* f = fopen("check_v.del", "w");
+  if (f == NULL) return;
+  for (int i = 0; i < 5000; i++) {
+    // a few common starts, so prefixes are shared by many values
+    values.push_back(string(1, 'a' + rand() % 4) + randomValue(30));
+    fprintf(f, "%d,\"%s\"\n", i, values.back().c_str());
+  }
+  fclose(f);
+  CHECK(SqlEngine::load("check_vi", "check_v.del", true) == 0);
+  CHECK(SqlEngine::load("check_vs", "check_v.del", false) == 0);
+
+  // an equality lookup reads fewer pages through the index than a scan
+  int before = PageFile::getPageReadCount();
+  CHECK(selectOutput(4, "check_vi", 2, SelCond::EQ, values[0].c_str()) != "0\n");
+  int indexReads = PageFile::getPageReadCount() - before;
+  before = PageFile::getPageReadCount();
+  selectOutput(4, "check_vs", 2, SelCond::EQ, values[0].c_str());
+  CHECK(indexReads < PageFile::getPageReadCount() - before);
+
+  for (int i = 0; i < 100; i++) {
+    vector<SelCond> conds;
+    string lo, hi;
+
+    switch (i % 3) {
+    case 0:  // a value of the table
+      lo = values[rand() % values.size()];
+      conds.push_back(makeCond(2, SelCond::EQ, lo.c_str()));
+      break;
+    case 1:  // a range
+      lo = values[rand() % values.size()].substr(0, 3);
+      hi = lo + randomValue(2);
+      conds.push_back(makeCond(2, SelCond::GT, lo.c_str()));
+      conds.push_back(makeCond(2, SelCond::LE, hi.c_str()));
+      break;
+    default:  // the values with a prefix
+      lo = values[rand() % values.size()].substr(0, 2 + rand() % 3);
+      hi = lo;
+      hi[hi.size() - 1]++;
+      conds.push_back(makeCond(2, SelCond::GE, lo.c_str()));
+      conds.push_back(makeCond(2, SelCond::LT, hi.c_str()));
+      break;
+    }
+
+    CHECK(selectOutput(4, "check_vi", conds) == selectOutput(4, "check_vs", conds));
+    CHECK(selectOutput(3, "check_vi", conds) == selectOutput(3, "check_vs", conds));
+  }
+
+  removeTable("check_vi");
+  removeTable("check_vs");
+  unlink("check_v.del");
+}
+
+// the vectorized key compares against a loop over the keys, for arrays
+// that end inside a vector and inside a bitmap word
+static void checkKeyCompare()
+{
+  const int sizes[] = { 0, 1, 3, 7, 8, 9, 31, 63, 64, 65, 130, 200 };
+  const int vals[] = { INT_MIN, INT_MIN + 1, -1, 0, 1, 50, INT_MAX - 1, INT_MAX };
+  KeyCompare::Word lt[4], eq[4], lt2[4];
+  int keys[200];
+
+  for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    int n = sizes[s];
+    for (int i = 0; i < n; i++) {
+      switch (rand() % 8) {
+      case 0:  keys[i] = INT_MIN; break;
+      case 1:  keys[i] = INT_MAX; break;
+      default: keys[i] = rand() % 101 - 50; break;
+      }
+    }
+
+    for (unsigned v = 0; v < sizeof(vals) / sizeof(vals[0]); v++) {
+      int val = vals[v];
+      memset(lt, 0, sizeof(lt));
+      memset(eq, 0, sizeof(eq));
+      memset(lt2, 0, sizeof(lt2));
+      KeyCompare::compare(keys, n, val, lt, eq);
+      KeyCompare::compare(keys, n, val, lt2, NULL);
+
+      int less = 0;
+      bool ok = memcmp(lt, lt2, sizeof(lt)) == 0;
+      for (int i = 0; i < 4 * KeyCompare::WORD_BITS; i++) {
+        bool isLess = (lt[i / KeyCompare::WORD_BITS] >> (i % KeyCompare::WORD_BITS)) & 1;
+        bool isEqual = (eq[i / KeyCompare::WORD_BITS] >> (i % KeyCompare::WORD_BITS)) & 1;
+        if (isLess != (i < n && keys[i] < val)) ok = false;
+        if (isEqual != (i < n && keys[i] == val)) ok = false;
+        if (i < n && keys[i] < val) less++;
+      }
+      CHECK(ok);
+      CHECK(KeyCompare::countLess(keys, n, val) == less);
+    }
+  }
+}
+
+// a tuple of a table, kept in memory to compute the answers to SELECTs
+struct Tuple {
+  int key;
+  string value;
+};
+
+// true if a tuple meets all conditions, checked one by one the way the
+// conditions read
+static bool matches(const Tuple& t, const vector<SelCond>& conds)
+{
+  for (unsigned i = 0; i < conds.size(); i++) {
+    int c = conds[i].attr == 1 ? (t.key > atoi(conds[i].value)) - (t.key < atoi(conds[i].value))
+                               : strcmp(t.value.c_str(), conds[i].value);
+    bool ok = false;
+    switch (conds[i].comp) {
+    case SelCond::EQ: ok = c == 0; break;
+    case SelCond::NE: ok = c != 0; break;
+    case SelCond::LT: ok = c < 0; break;
+    case SelCond::GT: ok = c > 0; break;
+    case SelCond::LE: ok = c <= 0; break;
+    case SelCond::GE: ok = c >= 0; break;
+    }
+    if (!ok) return false;
+  }
+  return true;
+}
+
+// the output a SELECT should give, with its lines sorted
+static string expectedOutput(int attr, const vector<Tuple>& tuples, const vector<SelCond>& conds)
+{
+  vector<string> lines;
+  string output;
+  char line[64];
+  int count = 0;
+
+  for (unsigned i = 0; i < tuples.size(); i++) {
+    if (!matches(tuples[i], conds)) continue;
+    count++;
+    snprintf(line, sizeof(line), "%d", tuples[i].key);
+    if (attr == 1) lines.push_back(string(line) + "\n");
+    if (attr == 2) lines.push_back(tuples[i].value + "\n");
+    if (attr == 3) lines.push_back(string(line) + " '" + tuples[i].value + "'\n");
+  }
+  if (attr == 4) {
+    snprintf(line, sizeof(line), "%d\n", count);
+    return line;
+  }
+
+  sort(lines.begin(), lines.end());
+  for (unsigned i = 0; i < lines.size(); i++) output += lines[i];
+  return output;
+}
+
+// write random tuples to a load file. the keys repeat and include the
+// smallest and largest int
+static void writeTuples(const char* loadfile, int n, vector<Tuple>& tuples)
+{
+  tuples.clear();
+  FILE* f = fopen(loadfile, "w");
+  if (f == NULL) return;
+  for (int i = 0; i < n; i++) {
+    Tuple t;
+    switch (rand() % 50) {
+    case 0:  t.key = INT_MIN; break;
+    case 1:  t.key = INT_MAX; break;
+    default: t.key = rand() % 2000 - 1000; break;
+    }
+    t.value = randomValue(20);
+    tuples.push_back(t);
+    fprintf(f, "%d,\"%s\"\n", t.key, t.value.c_str());
+  }
+  fclose(f);
+}
+
+// a key condition on a table scanned a batch at a time against the
+// tuples. the table spans many batches, and the last one is partial
+static void checkScanFilters()
+{
+  const SelCond::Comparator comps[] = { SelCond::EQ, SelCond::NE, SelCond::LT,
+                                        SelCond::GT, SelCond::LE, SelCond::GE };
+  const char* vals[] = { "-2147483648", "2147483647", "0", "-1000", "999", "17", "-333" };
+  vector<Tuple> tuples;
+
+  removeTable("check_scan");
+  writeTuples("check_scan.del", 5003, tuples);
+  CHECK(SqlEngine::load("check_scan", "check_scan.del", false) == 0);
+  unlink("check_scan.del");
+  for (unsigned c = 0; c < sizeof(comps) / sizeof(comps[0]); c++) {
+    for (unsigned v = 0; v < sizeof(vals) / sizeof(vals[0]); v++) {
+      vector<SelCond> conds(1, makeCond(1, comps[c], vals[v]));
+      CHECK(selectOutput(4, "check_scan", conds) == expectedOutput(4, tuples, conds));
+      CHECK(selectOutput(1, "check_scan", conds) == expectedOutput(1, tuples, conds));
+    }
+  }
+  removeTable("check_scan");
+}
+
+// WHERE clauses of several conditions on the key and the value against
+// the tuples, on a table with indexes and one without. the conditions
+// often overlap, contradict each other or meet in a single key or value,
+// which the compiled plan merges into ranges
+static void checkConditions()
+{
+  const SelCond::Comparator comps[] = { SelCond::EQ, SelCond::NE, SelCond::LT,
+                                        SelCond::GT, SelCond::LE, SelCond::GE };
+  const char* edges[] = { "-2147483648", "2147483647", "-2147483647", "2147483646" };
+  vector<Tuple> tuples;
+
+  removeTable("check_cond");
+  removeTable("check_plain");
+  writeTuples("check_cond.del", 3000, tuples);
+  CHECK(SqlEngine::load("check_cond", "check_cond.del", true) == 0);
+  CHECK(SqlEngine::load("check_plain", "check_cond.del", false) == 0);
+  unlink("check_cond.del");
+
+  for (int i = 0; i < 300; i++) {
+    vector<SelCond> conds;
+    vector<string> values(1 + rand() % 4);
+
+    // the conditions of a clause are around one tuple, so they meet
+    const Tuple& t = tuples[rand() % tuples.size()];
+    for (unsigned j = 0; j < values.size(); j++) {
+      int attr = 1 + rand() % 2;
+      char number[16];
+
+      if (attr == 1) {
+        // a key of the table, one next to it, or an edge of the int range
+        if (rand() % 5 == 0) {
+          values[j] = edges[rand() % 4];
+        } else {
+          long long key = (long long) t.key + rand() % 3 - 1;
+          snprintf(number, sizeof(number), "%d", key < INT_MIN || key > INT_MAX ? t.key : (int) key);
+          values[j] = number;
+        }
+      } else {
+        // a value of the table or a part of one
+        values[j] = rand() % 2 ? t.value : t.value.substr(0, 1 + rand() % 3);
+      }
+      conds.push_back(makeCond(attr, comps[rand() % 6], values[j].c_str()));
+    }
+
+    string expected = expectedOutput(3, tuples, conds);
+    CHECK(selectOutput(3, "check_cond", conds) == expected);
+    CHECK(selectOutput(3, "check_plain", conds) == expected);
+    CHECK(selectOutput(4, "check_cond", conds) == expectedOutput(4, tuples, conds));
+  }
+
+  removeTable("check_cond");
+  removeTable("check_plain");
+}
+
+// the tuples of a table in the order they are stored
+static void readTable(const string& table, vector<Tuple>& tuples)
+{
+  RecordFile rf;
+
+  tuples.clear();
+  if (rf.open(table + ".tbl", 'r') != 0) return;
+  for (PageId pid = rf.beginRid().pid; pid <= rf.endRid().pid; pid++) {
+    int count;
+    if (rf.getPageRecordCount(pid, count) != 0) continue;
+    for (int sid = 0; sid < count; sid++) {
+      RecordId rid = { pid, sid };
+      Tuple t;
+      if (rf.read(rid, t.key, t.value) == 0) tuples.push_back(t);
+    }
+  }
+  rf.close();
+}
+
+// the text of a load file of several pipeline blocks. the last line has
+// no newline
+static string loadText(vector<Tuple>& tuples)
+{
+  string text;
+  char line[64];
+
+  tuples.clear();
+  for (int i = 0; i < 150000; i++) {
+    Tuple t;
+    t.key = rand() - RAND_MAX / 2;
+    t.value = randomValue(15);
+    tuples.push_back(t);
+    snprintf(line, sizeof(line), "%d,\"%s\"", t.key, t.value.c_str());
+    text += line;
+    if (i + 1 < 150000) text += '\n';
+  }
+  return text;
+}
+
+static bool sameTuples(const vector<Tuple>& a, const vector<Tuple>& b)
+{
+  if (a.size() != b.size()) return false;
+  for (unsigned i = 0; i < a.size(); i++) {
+    if (a[i].key != b[i].key || a[i].value != b[i].value) return false;
+  }
+  return true;
+}
+
+// a LOAD parsed by several threads stores the tuples in the order of
+// the file, whether the file is mapped or read through a pipe
+static void checkLoadPipeline()
+{
+  vector<Tuple> tuples, stored;
+  string text = loadText(tuples);
+  int threads = SqlEngine::getThreads();
+
+  writeFile("check_pipe.del", text.c_str());
+  for (int n = 1; n <= 4; n += 3) {
+    SqlEngine::setThreads(n);
+    removeTable("check_pipe");
+    CHECK(SqlEngine::load("check_pipe", "check_pipe.del", false) == 0);
+    readTable("check_pipe", stored);
+    CHECK(sameTuples(stored, tuples));
+  }
+  unlink("check_pipe.del");
+
+  // a pipe cannot be mapped, so it is read a block at a time
+  unlink("check_pipe.fifo");
+  CHECK(mkfifo("check_pipe.fifo", 0600) == 0);
+  {
+    thread writer(writeFile, "check_pipe.fifo", text.c_str());
+    removeTable("check_pipe");
+    CHECK(SqlEngine::load("check_pipe", "check_pipe.fifo", false) == 0);
+
+    // a writer still waiting for a reader, because the LOAD failed early,
+    // is let go with a broken pipe
+    int fd = open("check_pipe.fifo", O_RDONLY | O_NONBLOCK);
+    if (fd >= 0) close(fd);
+    writer.join();
+    readTable("check_pipe", stored);
+    CHECK(sameTuples(stored, tuples));
+    unlink("check_pipe.fifo");
+  }
+
+  SqlEngine::setThreads(threads);
+  removeTable("check_pipe");
+}
+
+// the load line parser Bruinbase started with, which read a copy of
+// every line. the in-place parser must give the same tuples
+static RC originalParseLoadLine(const string& line, int& key, string& value)
+{
+  const char *s;
+  char        c;
+  string::size_type loc;
+
+  // ignore beginning white spaces
+  c = *(s = line.c_str());
+  while (c == ' ' || c == '\t') { c = *++s; }
+
+  // get the integer key value
+  key = atoi(s);
+
+  // look for comma
+  s = strchr(s, ',');
+  if (s == NULL) { return RC_INVALID_FILE_FORMAT; }
+
+  // ignore white spaces
+  do { c = *++s; } while (c == ' ' || c == '\t');
+
+  // if there is nothing left, set the value to empty string
+  if (c == 0) {
+    value.erase();
+    return 0;
+  }
+
+  // is the value field delimited by ' or "?
+  if (c == '\'' || c == '"') {
+    s++;
+  } else {
+    c = '\n';
+  }
+
+  // get the value string
+  value.assign(s);
+  loc = value.find(c, 0);
+  if (loc != string::npos) { value.erase(loc); }
+
+  return 0;
+}
+
+// random lines of keys, signs, blanks, commas and quotes against the
+// original parser. the line is followed by more text in memory, which
+// the parser must not look at
+static void checkLoadLineParser()
+{
+  const char* pieces[] = { " ", "\t", ",", "'", "\"", "-", "+", "0", "7", "42",
+                           "2147483647", "2147483648", "-2147483649",
+                           "99999999999999999999", "abc", "x y" };
+  const int numPieces = sizeof(pieces) / sizeof(pieces[0]);
+
+  for (int i = 0; i < 20000; i++) {
+    string line;
+    int n = rand() % 8;
+    for (int j = 0; j < n; j++) line += pieces[rand() % numPieces];
+
+    int key, expectedKey, len;
+    string expected;
+    const char* value;
+    string buffer = line + ",\"after the line\"";
+
+    RC expectedRc = originalParseLoadLine(line, expectedKey, expected);
+    RC rc = SqlEngine::parseLoadLine(buffer.data(), line.size(), key, value, len);
+    CHECK(rc == expectedRc);
+    if (rc == 0 && expectedRc == 0) {
+      CHECK(key == expectedKey && string(value, len) == expected);
+    }
+  }
+}
+
+// the bytes written to a temporary file
+static string fileContents(FILE* f)
+{
+  string contents;
+  char buffer[4096];
+  size_t n;
+
+  rewind(f);
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) contents.append(buffer, n);
+  return contents;
+}
+
+static void appendInt32(unsigned n, string& buf)
+{
+  for (int i = 0; i < 4; i++) buf += (char) (n >> (8 * i));
+}
+
+// the rows of a result sink in every format against the rows formatted
+// one by one, over many flushes of its buffer. rows handed over in
+// blocks, as the scan threads do, keep their order
+static void checkResultSink()
+{
+  const ResultSink::Format formats[] = { ResultSink::TEXT, ResultSink::TSV, ResultSink::BINARY };
+  const char* values[] = { "plain", "", "tab\there", "new\nline", "back\\slash", "cr\r" };
+
+  for (int f = 0; f < 3; f++) {
+    for (int attr = 1; attr <= 3; attr++) {
+      FILE* out = tmpfile();
+      if (out == NULL) return;
+      string expected, block;
+      char line[64];
+
+      {
+        ResultSink sink(out, formats[f]);
+        for (int i = 0; i < 20000; i++) {
+          int key = i % 7 == 0 ? -i : i * 1000;
+          const char* value = values[i % 6];
+
+          // what each format makes of the row
+          string v = value;
+          if (formats[f] == ResultSink::TSV) {
+            v.clear();
+            for (const char* c = value; *c; c++) {
+              switch (*c) {
+              case '\\': v += "\\\\"; break;
+              case '\t': v += "\\t"; break;
+              case '\n': v += "\\n"; break;
+              case '\r': v += "\\r"; break;
+              default:   v += *c;
+              }
+            }
+          }
+          snprintf(line, sizeof(line), "%d", key);
+          switch (formats[f]) {
+          case ResultSink::TEXT:
+            expected += attr == 1 ? string(line) : attr == 2 ? v : string(line) + " '" + v + "'";
+            expected += '\n';
+            break;
+          case ResultSink::TSV:
+            expected += attr == 1 ? string(line) : attr == 2 ? v : string(line) + "\t" + v;
+            expected += '\n';
+            break;
+          case ResultSink::BINARY:
+            appendInt32((attr != 2 ? 4 : 0) + (attr != 1 ? strlen(value) : 0), expected);
+            if (attr != 2) appendInt32(key, expected);
+            if (attr != 1) expected += value;
+            break;
+          }
+
+          // every other run of rows is handed over as one block, which
+          // may be larger than the buffer
+          if (i / 5000 % 2 == 0) {
+            sink.add(attr, key, value);
+          } else {
+            ResultSink::formatRow(formats[f], attr, key, value, block);
+            if (i % 5000 == 4999) {
+              sink.addRows(block);
+              block.clear();
+            }
+          }
+        }
+        sink.addCount(20000);
+        sink.finish();
+      }
+
+      if (formats[f] == ResultSink::BINARY) {
+        appendInt32(4, expected);
+        appendInt32(20000, expected);
+        appendInt32(0xffffffff, expected);
+      } else {
+        expected += "20000\n";
+      }
+      CHECK(fileContents(out) == expected);
+      fclose(out);
+    }
+  }
+}
+
+// batches of reads and writes on both backends of AsyncIO, with more
+// requests than fit in flight, reads that end at the end of the file and
+// transfers that fail
+static void checkAsyncIO()
+{
+  const int PAGES = 300;
+  const int SIZE = PageFile::PAGE_SIZE;
+  const AsyncIO::Backend backends[] = { AsyncIO::URING, AsyncIO::THREADS };
+  vector<char> data(PAGES * SIZE);
+  vector<char> buffer(PAGES * SIZE);
+  vector<struct iovec> iov(PAGES);
+  vector<AsyncIO::Request> reqs(PAGES);
+
+  for (unsigned i = 0; i < data.size(); i++) data[i] = rand();
+
+  for (int b = 0; b < 2; b++) {
+    AsyncIO io(8, backends[b]);
+
+    // write the pages in random order, then read them back
+    unlink("check_aio.dat");
+    int fd = open("check_aio.dat", O_CREAT | O_RDWR, 0644);
+    if (fd < 0) return;
+    for (bool write = true; ; write = false) {
+      for (int i = 0; i < PAGES; i++) {
+        int pid = i * 7 % PAGES;
+        iov[i].iov_base = write ? &data[pid * SIZE] : &buffer[pid * SIZE];
+        iov[i].iov_len = SIZE;
+        AsyncIO::Request req = { fd, write, (off_t) pid * SIZE, &iov[i], 1, -1 };
+        reqs[i] = req;
+      }
+      CHECK(io.run(&reqs[0], PAGES) == 0);
+      bool done = true;
+      for (int i = 0; i < PAGES; i++) done = done && reqs[i].result == SIZE;
+      CHECK(done);
+      if (!write) break;
+    }
+    CHECK(buffer == data);
+
+    // a read past the last page gets the bytes up to the end of the file
+    iov[0].iov_base = &buffer[0];
+    iov[0].iov_len = 3 * SIZE;
+    AsyncIO::Request tail = { fd, false, (off_t) (PAGES - 1) * SIZE, &iov[0], 1, -1 };
+    CHECK(io.run(&tail, 1) == 0 && tail.result == SIZE);
+    AsyncIO::Request past = { fd, false, (off_t) (PAGES + 5) * SIZE, &iov[0], 1, -1 };
+    CHECK(io.run(&past, 1) == 0 && past.result == 0);
+    close(fd);
+
+    // every request of a failing batch fails on its own and comes back
+    fd = open("check_aio.dat", O_RDONLY);
+    for (int i = 0; i < PAGES; i++) {
+      iov[i].iov_base = &data[i * SIZE];
+      iov[i].iov_len = SIZE;
+      AsyncIO::Request req = { i % 2 ? fd : -1, i % 2 == 1, (off_t) i * SIZE, &iov[i], 1, 0 };
+      reqs[i] = req;
+    }
+    CHECK(io.run(&reqs[0], PAGES) == 0);
+    bool failed = true;
+    for (int i = 0; i < PAGES; i++) failed = failed && reqs[i].result == -EBADF;
+    CHECK(failed);
+    CHECK(io.getInFlight() == 0);
+
+    // submit() and complete() return every request once
+    for (int i = 0; i < PAGES; i++) {
+      iov[i].iov_base = &buffer[i * SIZE];
+      AsyncIO::Request req = { fd, false, (off_t) i * SIZE, &iov[i], 1, -1 };
+      reqs[i] = req;
+    }
+    vector<AsyncIO::Request*> batch(PAGES), got(PAGES);
+    for (int i = 0; i < PAGES; i++) batch[i] = &reqs[i];
+    CHECK(io.submit(&batch[0], PAGES) == 0);
+    int n = 0;
+    for (int k; n < PAGES && (k = io.complete(&got[n], PAGES - n, 1)) > 0; n += k);
+    sort(got.begin(), got.begin() + n);
+    CHECK(n == PAGES && unique(got.begin(), got.end()) == got.end() && io.getInFlight() == 0);
+    close(fd);
+    unlink("check_aio.dat");
+  }
+
+  // the pages fetched into the pool in one batch, in runs of consecutive
+  // pages and alone, hold what was written
+  FILE* f = fopen("check_aio.dat", "w");
+  if (f == NULL) return;
+  fwrite(&data[0], 1, data.size(), f);
+  fclose(f);
+
+  BufferPool pool(64);
+  PageFile pf;
+  pf.setBufferPool(&pool);
+  CHECK(pf.open("check_aio.dat", 'r') == 0);
+  PageId pids[40];
+  for (int i = 0; i < 40; i++) pids[i] = i < 20 ? 100 + i : (i * 37) % PAGES;
+  CHECK(pf.fetchPages(pids, 40) == 0);
+  int reads = PageFile::getPageReadCount();
+  bool same = true;
+  for (int i = 0; i < 40; i++) {
+    char* page;
+    if (pf.pin(pids[i], page) != 0) { same = false; continue; }
+    same = same && memcmp(page, &data[pids[i] * SIZE], SIZE) == 0;
+    pf.unpin(pids[i]);
+  }
+  CHECK(same && PageFile::getPageReadCount() == reads);
+  pf.close();
+  unlink("check_aio.dat");
+}
+
+int main()
+{
+  srand(2008);
+
+  // a LOAD that stops reading a pipe early must not kill the checks
+  signal(SIGPIPE, SIG_IGN);
+
+  checkCountedTree();
+  // a FIXED slot keeps the '\0' that ends its value
+  checkRecordFile(RecordFile::FIXED, RecordFile::MAX_VALUE_LENGTH - 1);
+  checkRecordFile(RecordFile::SLOTTED, RecordFile::MAX_SLOTTED_VALUE_LENGTH);
+  checkIndexAfterLoad();
+  checkValueIndex();
+  checkValueIndexAfterLoad();
+  checkValueQueries();
+  checkFailedLoad();
+  checkKeyCompare();
+  checkScanFilters();
+  checkConditions();
+  checkLoadPipeline();
+  checkLoadLineParser();
+  checkResultSink();
+  checkAsyncIO();
+
+  if (failures > 0) {
+    fprintf(stderr, "%d of %d checks failed\n", failures, checks);
+    return 1;
+  }
+  printf("all %d checks passed\n", checks);
+  return 0;
+}
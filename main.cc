@@ -9,12 +9,61 @@
  
 #include "Bruinbase.h"
 #include "SqlEngine.h"
+#include "SqlServer.h"
 #include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
 
-int main()
+static void usage(const char* prog)
 {
-  // run the SQL engine taking user commands from standard input (console).
-  SqlEngine::run(stdin);
+  fprintf(stderr, "usage: %s [-s socket | -p port] [-t threads] [-j threads] [-f format] [-r pages]\n", prog);
+  fprintf(stderr, "  without -s or -p, commands are read from the console\n");
+  fprintf(stderr, "  -s socket   serve clients on a Unix domain socket\n");
+  fprintf(stderr, "  -p port     serve clients on a localhost TCP port\n");
+  fprintf(stderr, "  -t threads  # of clients served at once (default %d)\n",
+          SqlServer::DEFAULT_THREADS);
+  fprintf(stderr, "  -j threads  # of threads of a scan or a LOAD (default: # of cores)\n");
+  fprintf(stderr, "  -f format   format of SELECT results: text, tsv or binary (default text)\n");
+  fprintf(stderr, "  -r pages    # of pages read ahead of a scan, 0 for none (default %d)\n",
+          PageFile::DEFAULT_PREFETCH_WINDOW);
+}
+
+int main(int argc, char* argv[])
+{
+  const char* socketPath = NULL;
+  int port = 0;
+  int threads = SqlServer::DEFAULT_THREADS;
+  ResultSink::Format format;
+  int c;
+
+  while ((c = getopt(argc, argv, "s:p:t:j:f:r:")) != -1) {
+    switch (c) {
+    case 's': socketPath = optarg; break;
+    case 'p': port = atoi(optarg); break;
+    case 't': threads = atoi(optarg); break;
+    case 'j': SqlEngine::setThreads(atoi(optarg)); break;
+    case 'r': PageFile::setPrefetchWindow(atoi(optarg)); break;
+    case 'f':
+      if (!ResultSink::parseFormat(optarg, format)) { usage(argv[0]); return 1; }
+      SqlEngine::setOutputFormat(format);
+      break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+
+  if (socketPath == NULL && port == 0) {
+    // run the SQL engine taking user commands from standard input (console).
+    SqlEngine::run(stdin);
+    return 0;
+  }
+
+  // otherwise serve the clients connecting to the socket or the port
+  SqlServer server(threads);
+  RC rc = socketPath != NULL ? server.listenUnix(socketPath) : server.listenTcp(port);
+  if (rc < 0) {
+    fprintf(stderr, "Error: cannot listen on %s\n", socketPath != NULL ? socketPath : "the port");
+    return 1;
+  }
 
-  return 0;
+  return server.run() < 0 ? 1 : 0;
 }